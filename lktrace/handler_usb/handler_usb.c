@@ -0,0 +1,495 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/ptrace.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/usb.h>
+
+#include "../lktrace.h"
+
+/*
+ * lktrace USB URB latency handlers. Every URB is timed from
+ * usb_submit_urb to its giveback by the host controller driver, keyed
+ * by URB pointer, and accounted to its device and endpoint : log2
+ * latency histogram, submission rate, transferred bytes and completion
+ * errors. Load this module after lktrace_fs, then add to an lktrace
+ * instance list :
+ *
+ *	usb_submit_urb 0 lkusb_submit
+ *	usb_hcd_giveback_urb 0 lkusb_giveback
+ *
+ * Results are read from <debugfs>/lktrace_usb/urb, any write resets
+ * them. The bus and dev parameters restrict tracing to one bus or one
+ * device, 0 means any.
+ *
+ * An URB submitted again before its giveback was seen failed its
+ * submission (or was submitted before the probes were added), it is
+ * counted lost on its endpoint. Two URBs in flight hashing to the same
+ * slot also lose the older one, counted as collisions.
+ */
+
+#define LKUSB_INFLIGHT_BITS	(12)
+#define LKUSB_LOCKS		(64)
+#define LKUSB_MAXEP		(128)
+/* log2 of latency in ns, slot 0 is 0 ns */
+#define LKUSB_SLOTS		(40)
+#define LKUSB_BARLEN		(30)
+
+static int bus;
+module_param(bus, int, 0644);
+MODULE_PARM_DESC(bus, "trace only this bus number, 0 for any");
+
+static int dev;
+module_param(dev, int, 0644);
+MODULE_PARM_DESC(dev, "trace only this device number, 0 for any");
+
+struct lkusb_inflight {
+	struct urb	*lkui_urb;
+	u64		lkui_ts;
+};
+
+static struct lkusb_inflight lkusb_inflight[1 << LKUSB_INFLIGHT_BITS];
+/* lkusb_locks[i] protects inflight slots equal to i modulo LKUSB_LOCKS */
+static spinlock_t lkusb_locks[LKUSB_LOCKS];
+
+enum {
+	LKUSB_ERR_UNLINK,
+	LKUSB_ERR_GONE,
+	LKUSB_ERR_STALL,
+	LKUSB_ERR_PROTO,
+	LKUSB_ERR_OVERFLOW,
+	LKUSB_ERR_SHORT,
+	LKUSB_ERR_OTHER,
+	LKUSB_ERR_MAX,
+};
+
+static char const *const lkusb_err_names[LKUSB_ERR_MAX] = {
+	"unlink", "gone", "stall", "proto", "overflow", "short", "other",
+};
+
+static char const *const lkusb_type_names[] = {
+	[PIPE_ISOCHRONOUS]	= "isoc",
+	[PIPE_INTERRUPT]	= "int",
+	[PIPE_CONTROL]		= "ctrl",
+	[PIPE_BULK]		= "bulk",
+};
+
+/*
+ * one endpoint of one device
+ * @lkue_bus : bus number
+ * @lkue_dev : device number on the bus
+ * @lkue_addr : endpoint number, USB_DIR_IN bit for in endpoints
+ * @lkue_type : PIPE_* transfer type
+ * @lkue_vendor : device idVendor
+ * @lkue_product : device idProduct
+ * @lkue_submits : submitted URBs
+ * @lkue_completes : URBs given back, with or without error
+ * @lkue_lost : URBs submitted again without a giveback seen
+ * @lkue_bytes : transferred bytes of completed URBs
+ * @lkue_max : longest submit to giveback, ns
+ * @lkue_errors : completions per error class
+ * @lkue_hist : log2 submit to giveback histogram
+ */
+struct lkusb_ep {
+	int	lkue_bus;
+	int	lkue_dev;
+	u8	lkue_addr;
+	u8	lkue_type;
+	u16	lkue_vendor;
+	u16	lkue_product;
+	u64	lkue_submits;
+	u64	lkue_completes;
+	u64	lkue_lost;
+	u64	lkue_bytes;
+	u64	lkue_max;
+	u64	lkue_errors[LKUSB_ERR_MAX];
+	u64	lkue_hist[LKUSB_SLOTS];
+};
+
+/* lkusb_ep_lock protects everything below */
+static DEFINE_SPINLOCK(lkusb_ep_lock);
+static struct lkusb_ep lkusb_eps[LKUSB_MAXEP];
+static unsigned int lkusb_neps;
+static unsigned long lkusb_collisions;
+static unsigned long lkusb_full;
+static u64 lkusb_since;
+
+static struct dentry *lkusb_dir;
+
+static bool lkusb_wanted(struct urb const *urb)
+{
+	struct usb_device const *udev = urb->dev;
+
+	if(udev == NULL) {
+		return false;
+	}
+	return (bus == 0 || udev->bus->busnum == bus) &&
+	       (dev == 0 || udev->devnum == dev);
+}
+
+static int lkusb_err_class(int status)
+{
+	switch(status) {
+	case -ENOENT:
+	case -ECONNRESET:
+		return LKUSB_ERR_UNLINK;
+	case -ESHUTDOWN:
+	case -ENODEV:
+		return LKUSB_ERR_GONE;
+	case -EPIPE:
+		return LKUSB_ERR_STALL;
+	case -EPROTO:
+	case -EILSEQ:
+	case -ETIME:
+		return LKUSB_ERR_PROTO;
+	case -EOVERFLOW:
+		return LKUSB_ERR_OVERFLOW;
+	case -EREMOTEIO:
+		return LKUSB_ERR_SHORT;
+	}
+	return LKUSB_ERR_OTHER;
+}
+
+/* lkusb_ep_lock held, NULL when the table is full */
+static struct lkusb_ep *lkusb_ep_get(struct urb const *urb)
+{
+	struct usb_device const *udev = urb->dev;
+	unsigned int pipe = urb->pipe;
+	struct lkusb_ep *ep;
+	u8 addr;
+	unsigned int i;
+
+	addr = usb_pipeendpoint(pipe) | (usb_pipein(pipe) ? USB_DIR_IN : 0);
+	for(i = 0; i < lkusb_neps; ++i) {
+		ep = &lkusb_eps[i];
+		if(ep->lkue_addr == addr && ep->lkue_dev == udev->devnum &&
+		   ep->lkue_bus == udev->bus->busnum) {
+			return ep;
+		}
+	}
+	if(lkusb_neps == LKUSB_MAXEP) {
+		lkusb_full++;
+		return NULL;
+	}
+	ep = &lkusb_eps[lkusb_neps++];
+	ep->lkue_bus     = udev->bus->busnum;
+	ep->lkue_dev     = udev->devnum;
+	ep->lkue_addr    = addr;
+	ep->lkue_type    = usb_pipetype(pipe);
+	ep->lkue_vendor  = le16_to_cpu(udev->descriptor.idVendor);
+	ep->lkue_product = le16_to_cpu(udev->descriptor.idProduct);
+	return ep;
+}
+
+static unsigned int lkusb_slot(struct urb const *urb)
+{
+	return hash_ptr((void *)urb, LKUSB_INFLIGHT_BITS);
+}
+
+/* usb_submit_urb(urb, mem_flags) handler */
+int lkusb_submit(struct kprobe *kp, struct pt_regs *regs)
+{
+	struct urb *urb = (struct urb *)lktrace_fetch_arg(regs, 1);
+	unsigned int i;
+	struct lkusb_inflight *f;
+	struct lkusb_ep *ep;
+	unsigned long flags;
+	bool lost = false, collision = false;
+
+	if(urb == NULL || !lkusb_wanted(urb)) {
+		return 0;
+	}
+
+	i = lkusb_slot(urb);
+	f = &lkusb_inflight[i];
+	spin_lock_irqsave(&lkusb_locks[i % LKUSB_LOCKS], flags);
+	if(f->lkui_urb == urb) {
+		lost = true;
+	} else if(f->lkui_urb) {
+		collision = true;
+	}
+	f->lkui_urb = urb;
+	f->lkui_ts  = local_clock();
+	spin_unlock_irqrestore(&lkusb_locks[i % LKUSB_LOCKS], flags);
+
+	spin_lock_irqsave(&lkusb_ep_lock, flags);
+	ep = lkusb_ep_get(urb);
+	if(ep) {
+		ep->lkue_submits++;
+		ep->lkue_lost += lost;
+	}
+	lkusb_collisions += collision;
+	spin_unlock_irqrestore(&lkusb_ep_lock, flags);
+	return 0;
+}
+
+/* usb_hcd_giveback_urb(hcd, urb, status) handler */
+int lkusb_giveback(struct kprobe *kp, struct pt_regs *regs)
+{
+	struct urb *urb = (struct urb *)lktrace_fetch_arg(regs, 2);
+	int status = (int)lktrace_fetch_arg(regs, 3);
+	unsigned int i, slot;
+	struct lkusb_inflight *f;
+	struct lkusb_ep *ep;
+	unsigned long flags;
+	u64 ts = 0, lat;
+
+	if(urb == NULL || !lkusb_wanted(urb)) {
+		return 0;
+	}
+
+	i = lkusb_slot(urb);
+	f = &lkusb_inflight[i];
+	spin_lock_irqsave(&lkusb_locks[i % LKUSB_LOCKS], flags);
+	if(f->lkui_urb == urb) {
+		ts = f->lkui_ts;
+		f->lkui_urb = NULL;
+	}
+	spin_unlock_irqrestore(&lkusb_locks[i % LKUSB_LOCKS], flags);
+	if(ts == 0) {
+		return 0;
+	}
+
+	lat  = local_clock() - ts;
+	slot = lat ? min(ilog2(lat) + 1, LKUSB_SLOTS - 1) : 0;
+	/* the hcd status is overridden by an unlink in progress */
+	if(urb->unlinked) {
+		status = urb->unlinked;
+	}
+
+	spin_lock_irqsave(&lkusb_ep_lock, flags);
+	ep = lkusb_ep_get(urb);
+	if(ep) {
+		ep->lkue_completes++;
+		ep->lkue_bytes += urb->actual_length;
+		ep->lkue_max = max(ep->lkue_max, lat);
+		ep->lkue_hist[slot]++;
+		if(status) {
+			ep->lkue_errors[lkusb_err_class(status)]++;
+		}
+	}
+	spin_unlock_irqrestore(&lkusb_ep_lock, flags);
+	return 0;
+}
+
+static void lkusb_reset(void)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	for(i = 0; i < ARRAY_SIZE(lkusb_inflight); ++i) {
+		spin_lock_irqsave(&lkusb_locks[i % LKUSB_LOCKS], flags);
+		lkusb_inflight[i].lkui_urb = NULL;
+		spin_unlock_irqrestore(&lkusb_locks[i % LKUSB_LOCKS], flags);
+	}
+	spin_lock_irqsave(&lkusb_ep_lock, flags);
+	memset(lkusb_eps, 0, sizeof(lkusb_eps));
+	lkusb_neps       = 0;
+	lkusb_collisions = 0;
+	lkusb_full       = 0;
+	lkusb_since      = local_clock();
+	spin_unlock_irqrestore(&lkusb_ep_lock, flags);
+}
+
+/*------------------ debugfs urb file ------------------------------*/
+
+static int lkusb_cmp_ep(void const *a, void const *b)
+{
+	struct lkusb_ep const *ea = a, *eb = b;
+
+	if(ea->lkue_bus != eb->lkue_bus) {
+		return ea->lkue_bus - eb->lkue_bus;
+	}
+	if(ea->lkue_dev != eb->lkue_dev) {
+		return ea->lkue_dev - eb->lkue_dev;
+	}
+	return (ea->lkue_addr & 0x7f) != (eb->lkue_addr & 0x7f) ?
+		(ea->lkue_addr & 0x7f) - (eb->lkue_addr & 0x7f) :
+		ea->lkue_addr - eb->lkue_addr;
+}
+
+/* upper bound in ns of the slot holding the pct percentile */
+static u64 lkusb_pct(u64 const *hist, u64 total, unsigned int pct)
+{
+	u64 want = div_u64(total * pct + 99, 100), seen = 0;
+	unsigned int i;
+
+	for(i = 0; i < LKUSB_SLOTS; ++i) {
+		seen += hist[i];
+		if(seen && seen >= want) {
+			return i ? 1ULL << i : 0;
+		}
+	}
+	return 0;
+}
+
+static void lkusb_show_hist(struct seq_file *m, u64 const *hist)
+{
+	static char const bar[] = "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@";
+	unsigned int i, first = LKUSB_SLOTS, last = 0;
+	u64 maxcount = 0;
+	int len;
+
+	for(i = 0; i < LKUSB_SLOTS; ++i) {
+		if(hist[i]) {
+			first = min(first, i);
+			last  = i;
+			maxcount = max(maxcount, hist[i]);
+		}
+	}
+	for(i = first; i <= last && maxcount; ++i) {
+		len = div64_u64(hist[i] * LKUSB_BARLEN, maxcount);
+		seq_printf(m, "\t\t%12llu ns %10llu |%.*s%*s|\n",
+				i ? 1ULL << (i - 1) : 0ULL, hist[i],
+				len, bar, LKUSB_BARLEN - len, "");
+	}
+}
+
+static void lkusb_show_counts(struct seq_file *m, struct lkusb_ep const *e,
+				u64 secs)
+{
+	unsigned int i;
+
+	seq_printf(m, "submits/s %llu completes %llu lost %llu kB/s %llu "
+			"p50 %llu p99 %llu max %llu us",
+			div64_u64(e->lkue_submits, secs), e->lkue_completes,
+			e->lkue_lost, div64_u64(e->lkue_bytes >> 10, secs),
+			div_u64(lkusb_pct(e->lkue_hist, e->lkue_completes, 50),
+									1000),
+			div_u64(lkusb_pct(e->lkue_hist, e->lkue_completes, 99),
+									1000),
+			div_u64(e->lkue_max, 1000));
+	for(i = 0; i < LKUSB_ERR_MAX; ++i) {
+		if(e->lkue_errors[i]) {
+			seq_printf(m, " %s %llu", lkusb_err_names[i],
+							e->lkue_errors[i]);
+		}
+	}
+	seq_printf(m, "\n");
+}
+
+static void lkusb_sum(struct lkusb_ep *to, struct lkusb_ep const *from)
+{
+	unsigned int i;
+
+	to->lkue_submits   += from->lkue_submits;
+	to->lkue_completes += from->lkue_completes;
+	to->lkue_lost      += from->lkue_lost;
+	to->lkue_bytes     += from->lkue_bytes;
+	to->lkue_max        = max(to->lkue_max, from->lkue_max);
+	for(i = 0; i < LKUSB_ERR_MAX; ++i) {
+		to->lkue_errors[i] += from->lkue_errors[i];
+	}
+	for(i = 0; i < LKUSB_SLOTS; ++i) {
+		to->lkue_hist[i] += from->lkue_hist[i];
+	}
+}
+
+/* per device totals and histogram, then its endpoints */
+static int lkusb_fops_show(struct seq_file *m, void *v)
+{
+	struct lkusb_ep *eps, devsum;
+	unsigned int n, i, j;
+	unsigned long flags, collisions, full;
+	u64 secs;
+
+	eps = vmalloc(sizeof(lkusb_eps));
+	if(eps == NULL) {
+		return -ENOMEM;
+	}
+	spin_lock_irqsave(&lkusb_ep_lock, flags);
+	n = lkusb_neps;
+	memcpy(eps, lkusb_eps, n * sizeof(*eps));
+	collisions = lkusb_collisions;
+	full = lkusb_full;
+	secs = max_t(u64, div_u64(local_clock() - lkusb_since, NSEC_PER_SEC),
+									1);
+	spin_unlock_irqrestore(&lkusb_ep_lock, flags);
+
+	seq_printf(m, "elapsed %llus collisions %lu untracked %lu\n", secs,
+							collisions, full);
+	sort(eps, n, sizeof(*eps), lkusb_cmp_ep, NULL);
+	for(i = 0; i < n; i = j) {
+		memset(&devsum, 0, sizeof(devsum));
+		for(j = i; j < n && eps[j].lkue_bus == eps[i].lkue_bus &&
+				eps[j].lkue_dev == eps[i].lkue_dev; ++j) {
+			lkusb_sum(&devsum, &eps[j]);
+		}
+		seq_printf(m, "\nbus %d dev %d %04x:%04x ", eps[i].lkue_bus,
+				eps[i].lkue_dev, eps[i].lkue_vendor,
+				eps[i].lkue_product);
+		lkusb_show_counts(m, &devsum, secs);
+		lkusb_show_hist(m, devsum.lkue_hist);
+		for(; i < j; ++i) {
+			seq_printf(m, "\tep %02x %-3s %-4s ", eps[i].lkue_addr,
+				eps[i].lkue_addr & USB_DIR_IN ? "in" : "out",
+				lkusb_type_names[eps[i].lkue_type & 3]);
+			lkusb_show_counts(m, &eps[i], secs);
+			lkusb_show_hist(m, eps[i].lkue_hist);
+		}
+	}
+	vfree(eps);
+	return 0;
+}
+
+static int lkusb_fops_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lkusb_fops_show, NULL);
+}
+
+static ssize_t lkusb_fops_write(struct file *file, char const __user *ubuff,
+				size_t size, loff_t *where)
+{
+	lkusb_reset();
+	return size;
+}
+
+static struct file_operations lkusb_fops = {
+	.open		=	lkusb_fops_open,
+	.read		=	seq_read,
+	.write		=	lkusb_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	single_release,
+	.owner		=	THIS_MODULE,
+};
+
+static int __init lkusb_init(void)
+{
+	struct dentry *file;
+	unsigned int i;
+
+	for(i = 0; i < LKUSB_LOCKS; ++i) {
+		spin_lock_init(&lkusb_locks[i]);
+	}
+	lkusb_since = local_clock();
+
+	lkusb_dir = debugfs_create_dir("lktrace_usb", NULL);
+	if(IS_ERR_OR_NULL(lkusb_dir)) {
+		printk(KERN_ERR "can't create lktrace_usb debugfs dir\n");
+		return -ENODEV;
+	}
+	file = debugfs_create_file("urb", 0600, lkusb_dir, NULL, &lkusb_fops);
+	if(IS_ERR_OR_NULL(file)) {
+		printk(KERN_ERR "can't create lktrace_usb urb file\n");
+		debugfs_remove_recursive(lkusb_dir);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+/* lktrace parks our handlers, and waits for them, when we go away */
+static void __exit lkusb_exit(void)
+{
+	debugfs_remove_recursive(lkusb_dir);
+}
+
+module_init(lkusb_init);
+module_exit(lkusb_exit);
+MODULE_LICENSE("GPL");
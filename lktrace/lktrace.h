@@ -0,0 +1,596 @@
+#ifndef LKTRACE_H
+#define LKTRACE_H
+
+#include <linux/kprobes.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+#define LKTRACE_FUNCNAME_MAXLEN (32)
+
+/* handler name meaning "no user handler, lktrace actions only" */
+#define LKTRACE_NOHANDLER	"-"
+
+struct super_block;
+struct dentry;
+struct inode;
+struct file;
+struct file_operations;
+struct lktrace_instance;
+
+/*------------------ argument fetch -------------------------------*/
+
+enum lktrace_fetch_kind {
+	LKTRACE_FETCH_NONE = 0,
+	LKTRACE_FETCH_ARG,	/* function argument, calling convention */
+	LKTRACE_FETCH_REG,	/* raw pt_regs register */
+};
+
+/*
+ * where a probe action reads its value
+ * @lkf_kind	: one of lktrace_fetch_kind
+ * @lkf_index	: argument number (from 1) or pt_regs offset
+ */
+struct lktrace_fetch {
+	enum lktrace_fetch_kind	lkf_kind;
+	unsigned int		lkf_index;
+};
+
+int lktrace_fetch_parse(struct lktrace_fetch *, char const *);
+
+unsigned long lktrace_fetch_value(struct lktrace_fetch const *,
+				struct pt_regs *);
+
+int lktrace_fetch_print(struct lktrace_fetch const *, char *, size_t);
+
+unsigned long lktrace_fetch_arg(struct pt_regs *, unsigned int);
+
+void lktrace_fetch_set_arg(struct pt_regs *, unsigned int, unsigned long);
+
+/*------------------ conditions -----------------------------------*/
+
+enum lktrace_cond_op {
+	LKTRACE_COND_EQ,
+	LKTRACE_COND_NE,
+	LKTRACE_COND_GE,
+	LKTRACE_COND_LE,
+	LKTRACE_COND_GT,
+	LKTRACE_COND_LT,
+	LKTRACE_COND_AND,
+};
+
+/*
+ * test on a fetched value, matches always when lkc_fetch is NONE
+ */
+struct lktrace_cond {
+	struct lktrace_fetch	lkc_fetch;
+	enum lktrace_cond_op	lkc_op;
+	unsigned long		lkc_value;
+};
+
+int lktrace_cond_parse(struct lktrace_cond *, char *);
+
+bool lktrace_cond_match(struct lktrace_cond const *, struct pt_regs *);
+
+int lktrace_cond_print(struct lktrace_cond const *, char *, size_t);
+
+/*------------------ value histograms -----------------------------*/
+
+struct lktrace_hist;
+
+struct seq_file;
+
+struct lktrace_hist *lktrace_hist_create(char *);
+
+struct lktrace_hist *lktrace_hist_create_log2(void);
+
+void lktrace_hist_destroy(struct lktrace_hist *);
+
+void lktrace_hist_update(struct lktrace_hist *, struct pt_regs *);
+
+void lktrace_hist_add(struct lktrace_hist *, unsigned long);
+
+void lktrace_hist_clear(struct lktrace_hist *);
+
+void lktrace_hist_show(struct seq_file *, struct lktrace_hist *);
+
+int lktrace_hist_print(struct lktrace_hist const *, char *, size_t);
+
+int lktracefile_create_hist_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+/*------------------ pid / cgroup / cpu scope ---------------------*/
+
+struct lktrace_scope;
+
+int lktrace_scope_is_option(char const *);
+
+int lktrace_scope_parse(struct lktrace_scope **, char *);
+
+int lktrace_scope_print(struct lktrace_scope const *, char *, size_t);
+
+void lktrace_scope_destroy(struct lktrace_scope *);
+
+bool lktrace_scope_match(struct lktrace_scope const *);
+
+int lktracefile_create_scope_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+/*------------------ triggers -------------------------------------*/
+
+struct lktrace_trigger;
+
+int lktrace_trigger_is_option(char const *);
+
+int lktrace_trigger_parse(struct lktrace_instance *,
+			struct lktrace_trigger **, char *);
+
+int lktrace_trigger_print(struct lktrace_trigger const *, char *, size_t);
+
+void lktrace_trigger_destroy(struct lktrace_trigger *);
+
+bool lktrace_trigger_gate(struct lktrace_trigger const *);
+
+void lktrace_trigger_fire(struct lktrace_trigger const *,
+			struct lktrace_instance *);
+
+int lktracefile_create_switches_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+/*------------------ latency pairing ------------------------------*/
+
+struct lktrace_pairing;
+
+int lktrace_pair_is_option(char const *);
+
+int lktrace_pair_parse(struct lktrace_instance *,
+			struct lktrace_pairing **, char *);
+
+int lktrace_pair_print(struct lktrace_pairing const *, char *, size_t);
+
+void lktrace_pair_destroy(struct lktrace_pairing *);
+
+void lktrace_pair_hit(struct lktrace_pairing const *, struct pt_regs *);
+
+int lktracefile_create_latency_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+/*------------------ trace buffers --------------------------------*/
+
+#define LKTRACE_RECORD_NARGS (4)
+
+/*
+ * one probe hit
+ * @lkr_ts	: trace_clock_local timestamp (ns)
+ * @lkr_ip	: probed address
+ * @lkr_pid	: current pid
+ * @lkr_id	: probe event id, see lkpl_id
+ * @lkr_args	: first function arguments
+ */
+struct lktrace_record {
+	u64		lkr_ts;
+	unsigned long	lkr_ip;
+	pid_t		lkr_pid;
+	u32		lkr_id;
+	unsigned long	lkr_args[LKTRACE_RECORD_NARGS];
+};
+
+struct lktrace_buffer;
+
+struct lktrace_buffer *lktrace_buffer_create(void);
+
+void lktrace_buffer_destroy(struct lktrace_buffer *);
+
+void lktrace_buffer_record(struct lktrace_buffer *, u32, unsigned long,
+			struct pt_regs *);
+
+int lktrace_buffer_freeze(struct lktrace_buffer *);
+
+int lktracefile_create_snapshot_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+int lktracefile_create_raw_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+int lktracefile_create_buffer_size_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+/*------------------ ctf export -----------------------------------*/
+
+int lktracefile_create_metadata_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+/*------------------ instances ------------------------------------*/
+
+/*
+ * one tracing session, top level of lktracefs or instances/<name>
+ * @lki_list	: link in lktrace_instance_head
+ * @lki_name	: directory name, empty for top level instance
+ * @lki_enabled	: probes record into lki_buffer
+ * @lki_probes	: probes of this instance, under lktrace_probelist_mutex
+ * @lki_buffer	: per cpu trace buffers
+ * @lki_scope	: session wide scope, RCU protected
+ * @lki_next_id	: last probe event id given, 0 is never used
+ * @lki_switches: trigger switches, see lktrace_trigger.c
+ * @lki_pairs	: latency pairs, see lktrace_pair.c
+ * @lki_preset	: running analysis preset, see lktrace_preset.c
+ * @lki_ref	: held by the instance directory and its open files
+ */
+struct lktrace_instance {
+	struct list_head	lki_list;
+	char			lki_name[LKTRACE_FUNCNAME_MAXLEN];
+	int			lki_enabled;
+	struct list_head	lki_probes;
+	struct lktrace_buffer	*lki_buffer;
+	struct lktrace_scope __rcu *lki_scope;
+	u32			lki_next_id;
+	struct list_head	lki_switches;
+	struct list_head	lki_pairs;
+	struct lktrace_preset	*lki_preset;
+	struct kref		lki_ref;
+};
+
+extern struct lktrace_instance *lktrace_top_instance;
+
+int lktrace_instance_init(void);
+
+void lktrace_instance_exit(void);
+
+struct lktrace_instance *lktrace_instance_create(char const *);
+
+void lktrace_instance_destroy(struct lktrace_instance *);
+
+void lktrace_instance_get(struct lktrace_instance *);
+
+void lktrace_instance_put(struct lktrace_instance *);
+
+int lktrace_for_each_instance(int (*)(struct lktrace_instance *, void *),
+			void *);
+
+/*------------------ probe registry -------------------------------*/
+
+enum lktrace_probe_state {
+	LKTRACE_PROBE_PENDING,	/* symbol not loaded yet */
+	LKTRACE_PROBE_ARMED,	/* attached and resolved */
+};
+
+enum lktrace_probe_mech {
+	LKTRACE_MECH_KPROBE,	/* breakpoint based kprobe */
+	LKTRACE_MECH_FTRACE,	/* ftrace function entry callback */
+	LKTRACE_MECH_UPROBE,	/* userspace probe on a binary */
+	LKTRACE_MECH_TRACEPOINT,/* static kernel tracepoint */
+};
+
+struct module;
+struct lktrace_ftrace;
+struct lktrace_uprobe;
+struct tracepoint;
+
+/*
+ * one probed address, shared by every instance probing it
+ * @lks_list	: link in lktrace_site_head
+ * @lks_hnode	: link in site hash, keyed by name and offset
+ * @lks_fname	: probed function name, interned
+ * @lks_offset	: offset inside probed function
+ * @lks_state	: pending until function is resolved and attached
+ * @lks_mech	: how the site is attached once armed
+ * @lks_ftrace	: ftrace_ops when attached through ftrace
+ * @lks_uprobe	: uprobe consumer when attached as uprobe
+ * @lks_tp	: tracepoint when attached to one
+ * @lks_module	: module holding probed function, NULL for vmlinux
+ * @lks_probes	: attached probes, RCU list walked on each hit
+ * @lks_probe	: kprobe, pre_handler is lktrace_site_dispatch
+ */
+struct lktrace_site {
+	struct list_head	lks_list;
+	struct hlist_node	lks_hnode;
+	char const		*lks_fname;
+	off_t			lks_offset;
+
+	u8			lks_state;
+	u8			lks_mech;
+	union {
+		struct lktrace_ftrace	*lks_ftrace;
+		struct lktrace_uprobe	*lks_uprobe;
+		struct tracepoint	*lks_tp;
+	};
+	struct module		*lks_module;
+
+	struct list_head	lks_probes;
+	struct kprobe		lks_probe;
+};
+
+/*
+ * optional probe actions, only allocated when an option asks for one
+ * @lkpo_scope	: pid/cgroup/cpu filter, checked first
+ * @lkpo_hist	: value histogram
+ * @lkpo_snapshot: condition freezing trace buffers
+ * @lkpo_trigger: gate and actions on other probes
+ * @lkpo_pairing: latency begin/end actions
+ */
+struct lktrace_probe_opts {
+	struct lktrace_scope	*lkpo_scope;
+	struct lktrace_hist	*lkpo_hist;
+	struct lktrace_cond	*lkpo_snapshot;
+	struct lktrace_trigger	*lkpo_trigger;
+	struct lktrace_pairing	*lkpo_pairing;
+};
+
+/* handler time of one probe on one cpu */
+struct lktrace_probe_cost {
+	u64			lkpc_ns;
+	unsigned long		lkpc_hits;
+};
+
+/*
+ * costs of all probes share per cpu chunks of LKTRACE_BUDGET_CHUNK
+ * slots, see lktrace_budget.c
+ */
+#define LKTRACE_BUDGET_CHUNK_BITS	(8)
+#define LKTRACE_BUDGET_CHUNK		(1U << LKTRACE_BUDGET_CHUNK_BITS)
+#define LKTRACE_BUDGET_MAXCHUNK		(1024)
+
+extern struct lktrace_probe_cost __percpu *
+			lktrace_budget_chunks[LKTRACE_BUDGET_MAXCHUNK];
+
+#define LKTRACE_BUDGET_SLICES	(8)
+#define LKTRACE_BUDGET_OFF	(UINT_MAX)
+
+enum lktrace_budget_reason {
+	LKTRACE_BUDGET_OK,	/* within budgets */
+	LKTRACE_BUDGET_PROBE,	/* over per probe budget */
+	LKTRACE_BUDGET_GLOBAL,	/* heaviest probe when over global budget */
+};
+
+/*
+ * overhead accounting of a probe, see lktrace_budget.c
+ * @lkpb_slot	: slot of the per cpu handler time, updated on each hit
+ * @lkpb_every	: 0 runs every hit, N one hit out of N,
+ *		  LKTRACE_BUDGET_OFF none
+ * @lkpb_reason	: lktrace_budget_reason of lkpb_every
+ * @lkpb_last	: total ns at last evaluation
+ * @lkpb_slice	: ns spent in each slice of the window
+ * @lkpb_rate	: ns per second over the window
+ */
+struct lktrace_probe_budget {
+	unsigned int		lkpb_slot;
+	unsigned int		lkpb_every;
+	u8			lkpb_reason;
+	u64			lkpb_last;
+	u64			lkpb_slice[LKTRACE_BUDGET_SLICES];
+	u64			lkpb_rate;
+};
+
+/*
+ * one instance's probe on a site
+ * @lkpl_list	: link in instance lki_probes
+ * @lkpl_site_list: link in site lks_probes
+ * @lkpl_instance: owning instance
+ * @lkpl_site	: probed site
+ * @lkpl_cbname	: user handler name, interned, LKTRACE_NOHANDLER if none
+ * @lkpl_handler: user handler, called after lktrace actions
+ * @lkpl_cbmodule: module holding user handler
+ * @lkpl_opts	: optional actions, NULL for plain probes
+ * @lkpl_id	: event id in trace records and ctf metadata
+ * @lkpl_state	: pending until user handler is resolved
+ * @lkpl_budget	: handler time and throttling
+ */
+struct lktrace_probelist
+{
+	struct list_head	lkpl_list;
+	struct list_head	lkpl_site_list;
+	struct lktrace_instance	*lkpl_instance;
+	struct lktrace_site	*lkpl_site;
+
+	char const		*lkpl_cbname;
+	kprobe_pre_handler_t	lkpl_handler;
+	struct module		*lkpl_cbmodule;
+	struct lktrace_probe_opts *lkpl_opts;
+
+	u32			lkpl_id;
+	u8			lkpl_state;
+	struct lktrace_probe_budget lkpl_budget;
+};
+
+extern struct mutex lktrace_probelist_mutex;
+
+unsigned long lktrace_lookup_name(char const *);
+
+unsigned long lktrace_symbol_offset(unsigned long);
+
+int lktrace_site_hit(struct lktrace_site *, unsigned long, struct pt_regs *);
+
+int lktrace_site_dispatch(struct kprobe *, struct pt_regs *);
+
+int lktrace_probe_add(struct lktrace_instance *, char *);
+
+int lktrace_probe_remove(struct lktrace_instance *, char const *, long,
+			char const *);
+
+int lktrace_probe_print(struct lktrace_probelist const *, char *, size_t);
+
+int lktrace_for_each_probe(struct lktrace_instance *,
+			int (*)(struct lktrace_probelist *, void *),
+			void *);
+
+int lktrace_probe_init(void);
+
+void lktrace_probe_exit(void);
+
+int lktracefile_create_list_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+int lktracefile_create_registry_file(struct super_block *, struct dentry *);
+
+/*------------------ overhead budget ------------------------------*/
+
+void lktrace_budget_init(void);
+
+void lktrace_budget_exit(void);
+
+int lktrace_budget_slot_alloc(struct lktrace_probe_budget *);
+
+void lktrace_budget_slot_free(struct lktrace_probe_budget const *);
+
+void lktrace_budget_pool_destroy(void);
+
+void lktrace_budget_pool_stats(unsigned int *, size_t *);
+
+static inline struct lktrace_probe_cost *
+lktrace_budget_this_cost(struct lktrace_probe_budget const *b)
+{
+	return this_cpu_ptr(lktrace_budget_chunks[b->lkpb_slot >>
+					LKTRACE_BUDGET_CHUNK_BITS]) +
+		(b->lkpb_slot & (LKTRACE_BUDGET_CHUNK - 1));
+}
+
+int lktrace_budget_print(struct lktrace_probe_budget const *, char *, size_t);
+
+int lktracefile_create_budget_file(struct super_block *, struct dentry *);
+
+/*------------------ aggregation maps -----------------------------*/
+
+#define LKTRACE_MAP_NVALS	(4)
+#define LKTRACE_STACK_DEPTH	(12)
+
+struct lktrace_map;
+struct lktrace_stackmap;
+
+/*
+ * @lkme_key	: two words naming the entry
+ * @lkme_val	: counters or state, zeroed on insert
+ * @lkme_used	: slot in use
+ */
+struct lktrace_map_ent {
+	unsigned long	lkme_key[2];
+	u64		lkme_val[LKTRACE_MAP_NVALS];
+	unsigned long	lkme_used;
+};
+
+struct lktrace_map *lktrace_map_create(unsigned int);
+
+void lktrace_map_destroy(struct lktrace_map *);
+
+void lktrace_map_clear(struct lktrace_map *);
+
+struct lktrace_map_ent *lktrace_map_lock(struct lktrace_map *, unsigned long,
+					unsigned long, bool, unsigned long *);
+
+void lktrace_map_unlock(struct lktrace_map *, struct lktrace_map_ent *,
+			unsigned long);
+
+void lktrace_map_delete(struct lktrace_map *, struct lktrace_map_ent *,
+			unsigned long);
+
+size_t lktrace_map_collect(struct lktrace_map *, struct lktrace_map_ent **);
+
+unsigned long lktrace_map_dropped(struct lktrace_map *);
+
+struct lktrace_stackmap *lktrace_stackmap_create(unsigned int);
+
+void lktrace_stackmap_destroy(struct lktrace_stackmap *);
+
+void lktrace_stackmap_clear(struct lktrace_stackmap *);
+
+u32 lktrace_stackmap_get(struct lktrace_stackmap *, struct pt_regs *);
+
+void lktrace_stackmap_show(struct seq_file *, struct lktrace_stackmap *, u32);
+
+int lktrace_stack_init(void);
+
+unsigned int lktrace_stack_save(unsigned long *, unsigned int,
+				struct pt_regs *);
+
+/*------------------ analysis presets -----------------------------*/
+
+/*
+ * a canned set of probes with handlers of ours feeding in-kernel
+ * tables, run in one instance at a time
+ * @lkps_name	: written to an instance preset file to start it
+ * @lkps_probes	: list lines added to the instance, NULL terminated
+ * @lkps_start	: allocates tables, before probes are added
+ * @lkps_stop	: frees tables, once probes are gone
+ * @lkps_clear	: empties tables
+ * @lkps_show	: ranked tables, read from the preset file
+ * @lkps_owner	: instance running the preset, NULL if stopped
+ */
+struct lktrace_preset {
+	char const		*lkps_name;
+	char const *const	*lkps_probes;
+	int			(*lkps_start)(void);
+	void			(*lkps_stop)(void);
+	void			(*lkps_clear)(void);
+	void			(*lkps_show)(struct seq_file *);
+	struct lktrace_instance	*lkps_owner;
+};
+
+extern struct lktrace_preset lktrace_offcpu_preset;
+
+extern struct lktrace_preset lktrace_lock_preset;
+
+extern struct lktrace_preset lktrace_kmem_preset;
+
+void lktrace_preset_stop(struct lktrace_instance *);
+
+void lktrace_preset_comm(pid_t, char *);
+
+int lktracefile_create_preset_file(struct super_block *, struct dentry *,
+				struct lktrace_instance *);
+
+/*------------------ sampling profiler ----------------------------*/
+
+void lktrace_sample_exit(void);
+
+int lktracefile_create_profile_file(struct super_block *, struct dentry *);
+
+/*------------------ interned names -------------------------------*/
+
+char const *lktrace_str_get(char const *);
+
+void lktrace_str_put(char const *);
+
+void lktrace_str_stats(unsigned int *, size_t *);
+
+/*------------------ ftrace attach --------------------------------*/
+
+unsigned long lktrace_ftrace_ip(void const *);
+
+int lktrace_ftrace_attach(struct lktrace_site *);
+
+void lktrace_ftrace_detach(struct lktrace_site *);
+
+/*------------------ uprobe attach --------------------------------*/
+
+int lktrace_uprobe_is_spec(char const *);
+
+int lktrace_uprobe_parse(char *, unsigned long *);
+
+int lktrace_uprobe_attach(struct lktrace_site *);
+
+void lktrace_uprobe_detach(struct lktrace_site *);
+
+/*------------------ tracepoint attach ----------------------------*/
+
+int lktrace_tp_is_spec(char const *);
+
+int lktrace_tp_parse(char *);
+
+int lktrace_tp_attach(struct lktrace_site *);
+
+void lktrace_tp_detach(struct lktrace_site *);
+
+struct dentry *lktracefs_create_file(struct super_block *,
+				     struct dentry *,
+				     char const *const,
+				     struct file_operations *const,
+				     int);
+
+struct lktrace_instance *lktracefs_file_instance(struct file *);
+
+int lktracefs_single_open(struct file *, int (*)(struct seq_file *, void *));
+
+int lktracefs_single_release(struct inode *, struct file *);
+
+#endif
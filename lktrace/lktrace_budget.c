@@ -0,0 +1,433 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/idr.h>
+#include <linux/cpumask.h>
+
+#include "lktrace.h"
+
+/*
+ * overhead budget. Every probe hit is timed (see
+ * lktrace_probe_dispatch), a periodic work turns the per cpu totals
+ * into ns of handler time per second of wall time over a sliding
+ * window of LKTRACE_BUDGET_SLICES slices. A probe over the per probe
+ * budget is throttled, and while the sum of all probes is over the
+ * global budget the heaviest one is throttled at each slice.
+ *
+ * Throttling either stops the probe or makes it run one hit out of
+ * N, N doubling as long as it stays over budget. It lasts until
+ * "rearm" is written to the budget file, the reason is shown there
+ * and in list files. A budget of 0 is no limit.
+ */
+
+#define LKTRACE_BUDGET_PCT	(NSEC_PER_SEC / 100)
+
+enum lktrace_budget_action {
+	LKTRACE_BUDGET_DISABLE,
+	LKTRACE_BUDGET_SAMPLE,
+};
+
+static char const *const lktrace_budget_reasons[] = {
+	[LKTRACE_BUDGET_OK]	= "ok",
+	[LKTRACE_BUDGET_PROBE]	= "probe budget",
+	[LKTRACE_BUDGET_GLOBAL]	= "global budget",
+};
+
+/* settings, protected by lktrace_probelist_mutex */
+static u64 lktrace_budget_probe = 5 * LKTRACE_BUDGET_PCT;
+static u64 lktrace_budget_global = 20 * LKTRACE_BUDGET_PCT;
+static unsigned int lktrace_budget_window = 8;
+static int lktrace_budget_action = LKTRACE_BUDGET_DISABLE;
+
+/* wall time of each slice, ns */
+static u64 lktrace_budget_slice[LKTRACE_BUDGET_SLICES];
+static unsigned int lktrace_budget_cur;
+static u64 lktrace_budget_stamp;
+
+static void lktrace_budget_fn(struct work_struct *);
+static DECLARE_DELAYED_WORK(lktrace_budget_work, lktrace_budget_fn);
+
+/* evaluation state, only valid during one slice */
+struct lktrace_budget_eval {
+	u64			lkbe_total;
+	struct lktrace_probelist *lkbe_top;
+};
+
+/*
+ * cost slots. One percpu allocation per probe costs the percpu
+ * allocator dearly at tens of thousands of probes, slots come from
+ * chunks instead, allocated as needed and kept until unload. A chunk
+ * pointer is set before any probe using it is published.
+ */
+struct lktrace_probe_cost __percpu *
+			lktrace_budget_chunks[LKTRACE_BUDGET_MAXCHUNK];
+static unsigned int lktrace_budget_nchunks;
+static DEFINE_IDA(lktrace_budget_ida);
+static DEFINE_MUTEX(lktrace_budget_pool_mutex);
+
+static struct lktrace_probe_cost *
+lktrace_budget_cpu_cost(struct lktrace_probe_budget const *b, int cpu)
+{
+	return per_cpu_ptr(lktrace_budget_chunks[b->lkpb_slot >>
+					LKTRACE_BUDGET_CHUNK_BITS], cpu) +
+		(b->lkpb_slot & (LKTRACE_BUDGET_CHUNK - 1));
+}
+
+int lktrace_budget_slot_alloc(struct lktrace_probe_budget *b)
+{
+	struct lktrace_probe_cost __percpu **chunk;
+	int slot, cpu;
+
+	slot = ida_alloc_max(&lktrace_budget_ida,
+			LKTRACE_BUDGET_MAXCHUNK * LKTRACE_BUDGET_CHUNK - 1,
+			GFP_KERNEL);
+	if(slot < 0) {
+		return slot;
+	}
+	chunk = &lktrace_budget_chunks[slot >> LKTRACE_BUDGET_CHUNK_BITS];
+	mutex_lock(&lktrace_budget_pool_mutex);
+	if(*chunk == NULL) {
+		*chunk = __alloc_percpu(LKTRACE_BUDGET_CHUNK *
+					sizeof(struct lktrace_probe_cost),
+					__alignof__(struct lktrace_probe_cost));
+		if(*chunk == NULL) {
+			mutex_unlock(&lktrace_budget_pool_mutex);
+			ida_free(&lktrace_budget_ida, slot);
+			return -ENOMEM;
+		}
+		lktrace_budget_nchunks++;
+	}
+	mutex_unlock(&lktrace_budget_pool_mutex);
+
+	/* a reused slot still holds the costs of a freed probe */
+	b->lkpb_slot = slot;
+	for_each_possible_cpu(cpu) {
+		memset(lktrace_budget_cpu_cost(b, cpu), 0,
+				sizeof(struct lktrace_probe_cost));
+	}
+	return 0;
+}
+
+/* no hit may be in flight on the probe anymore */
+void lktrace_budget_slot_free(struct lktrace_probe_budget const *b)
+{
+	ida_free(&lktrace_budget_ida, b->lkpb_slot);
+}
+
+void lktrace_budget_pool_destroy(void)
+{
+	unsigned int i;
+
+	for(i = 0; i < LKTRACE_BUDGET_MAXCHUNK; ++i) {
+		free_percpu(lktrace_budget_chunks[i]);
+		lktrace_budget_chunks[i] = NULL;
+	}
+	lktrace_budget_nchunks = 0;
+	ida_destroy(&lktrace_budget_ida);
+}
+
+/* slots in allocated chunks and their memory, all cpus */
+void lktrace_budget_pool_stats(unsigned int *nslots, size_t *bytes)
+{
+	mutex_lock(&lktrace_budget_pool_mutex);
+	*nslots = lktrace_budget_nchunks * LKTRACE_BUDGET_CHUNK;
+	mutex_unlock(&lktrace_budget_pool_mutex);
+	*bytes = (size_t)*nslots * sizeof(struct lktrace_probe_cost) *
+		num_possible_cpus();
+}
+
+static u64 lktrace_budget_cost(struct lktrace_probe_budget const *b)
+{
+	u64 ns = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ns += READ_ONCE(lktrace_budget_cpu_cost(b, cpu)->lkpc_ns);
+	}
+	return ns;
+}
+
+static void lktrace_budget_throttle(struct lktrace_probe_budget *b,
+				u8 reason)
+{
+	unsigned int every = b->lkpb_every;
+
+	if(every == LKTRACE_BUDGET_OFF) {
+		return;
+	}
+	if(lktrace_budget_action == LKTRACE_BUDGET_DISABLE) {
+		every = LKTRACE_BUDGET_OFF;
+	} else {
+		every = every ? every * 2 : 2;
+		if(every >= LKTRACE_BUDGET_OFF / 2) {
+			every = LKTRACE_BUDGET_OFF;
+		}
+	}
+	WRITE_ONCE(b->lkpb_every, every);
+	b->lkpb_reason = reason;
+	/* start the window over, the probe cost changed */
+	memset(b->lkpb_slice, 0, sizeof(b->lkpb_slice));
+	b->lkpb_rate = 0;
+}
+
+static int lktrace_budget_eval_instance(struct lktrace_instance *inst,
+					void *data)
+{
+	struct lktrace_budget_eval *ev = data;
+	struct lktrace_probelist *ptr;
+	struct lktrace_probe_budget *b;
+	u64 now, wall = 0, ns = 0;
+	unsigned int i;
+
+	for(i = 0; i < LKTRACE_BUDGET_SLICES; ++i) {
+		wall += lktrace_budget_slice[i];
+	}
+
+	list_for_each_entry(ptr, &inst->lki_probes, lkpl_list) {
+		b   = &ptr->lkpl_budget;
+		now = lktrace_budget_cost(b);
+		b->lkpb_slice[lktrace_budget_cur] = now - b->lkpb_last;
+		b->lkpb_last = now;
+		for(i = 0, ns = 0; i < LKTRACE_BUDGET_SLICES; ++i) {
+			ns += b->lkpb_slice[i];
+		}
+		b->lkpb_rate = wall ?
+			mul_u64_u64_div_u64(ns, NSEC_PER_SEC, wall) : 0;
+
+		if(lktrace_budget_probe &&
+		   b->lkpb_rate > lktrace_budget_probe) {
+			lktrace_budget_throttle(b, LKTRACE_BUDGET_PROBE);
+			continue;
+		}
+		ev->lkbe_total += b->lkpb_rate;
+		if(b->lkpb_every != LKTRACE_BUDGET_OFF &&
+		   (ev->lkbe_top == NULL ||
+		    b->lkpb_rate > ev->lkbe_top->lkpl_budget.lkpb_rate)) {
+			ev->lkbe_top = ptr;
+		}
+	}
+	return 0;
+}
+
+static void lktrace_budget_fn(struct work_struct *work)
+{
+	struct lktrace_budget_eval ev = { 0, NULL };
+	unsigned long slice_ms;
+	u64 now = local_clock();
+
+	mutex_lock(&lktrace_probelist_mutex);
+	lktrace_budget_cur = (lktrace_budget_cur + 1) % LKTRACE_BUDGET_SLICES;
+	lktrace_budget_slice[lktrace_budget_cur] = now - lktrace_budget_stamp;
+	lktrace_budget_stamp = now;
+
+	lktrace_for_each_instance(lktrace_budget_eval_instance, &ev);
+	if(lktrace_budget_global && ev.lkbe_total > lktrace_budget_global &&
+	   ev.lkbe_top) {
+		lktrace_budget_throttle(&ev.lkbe_top->lkpl_budget,
+					LKTRACE_BUDGET_GLOBAL);
+	}
+	slice_ms = lktrace_budget_window * MSEC_PER_SEC / LKTRACE_BUDGET_SLICES;
+	mutex_unlock(&lktrace_probelist_mutex);
+
+	schedule_delayed_work(&lktrace_budget_work, msecs_to_jiffies(slice_ms));
+}
+
+void lktrace_budget_init(void)
+{
+	lktrace_budget_stamp = local_clock();
+	schedule_delayed_work(&lktrace_budget_work, HZ);
+}
+
+void lktrace_budget_exit(void)
+{
+	cancel_delayed_work_sync(&lktrace_budget_work);
+}
+
+/* appended to list lines of throttled probes, after the '#' */
+int lktrace_budget_print(struct lktrace_probe_budget const *b,
+			char *buff,
+			size_t len)
+{
+	if(b->lkpb_every == 0) {
+		return 0;
+	}
+	if(b->lkpb_every == LKTRACE_BUDGET_OFF) {
+		return scnprintf(buff, len, ", disabled: over %s",
+				lktrace_budget_reasons[b->lkpb_reason]);
+	}
+	return scnprintf(buff, len, ", sampled 1/%u: over %s", b->lkpb_every,
+				lktrace_budget_reasons[b->lkpb_reason]);
+}
+
+/*------------------ lktracefs budget file ------------------------*/
+
+static int lktrace_budget_show_instance(struct lktrace_instance *inst,
+					void *data)
+{
+	struct seq_file *m = data;
+	struct lktrace_probelist *ptr;
+	struct lktrace_probe_budget *b;
+
+	list_for_each_entry(ptr, &inst->lki_probes, lkpl_list) {
+		b = &ptr->lkpl_budget;
+		seq_printf(m, "%-16s %s+0x%lx %s %llu ns/s %s",
+				*inst->lki_name ? inst->lki_name : "/",
+				ptr->lkpl_site->lks_fname,
+				ptr->lkpl_site->lks_offset, ptr->lkpl_cbname,
+				(unsigned long long)b->lkpb_rate,
+				lktrace_budget_reasons[b->lkpb_reason]);
+		if(b->lkpb_every == LKTRACE_BUDGET_OFF) {
+			seq_printf(m, " disabled");
+		} else if(b->lkpb_every) {
+			seq_printf(m, " sampled 1/%u", b->lkpb_every);
+		}
+		seq_printf(m, "\n");
+	}
+	return 0;
+}
+
+static int lktrace_budget_fops_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&lktrace_probelist_mutex);
+	seq_printf(m, "probe=%llu global=%llu window=%u action=%s\n",
+			(unsigned long long)lktrace_budget_probe,
+			(unsigned long long)lktrace_budget_global,
+			lktrace_budget_window,
+			lktrace_budget_action == LKTRACE_BUDGET_DISABLE ?
+						"disable" : "sample");
+	lktrace_for_each_instance(lktrace_budget_show_instance, m);
+	mutex_unlock(&lktrace_probelist_mutex);
+	return 0;
+}
+
+static int lktrace_budget_fops_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lktrace_budget_fops_show, NULL);
+}
+
+static int lktrace_budget_rearm_instance(struct lktrace_instance *inst,
+					void *data)
+{
+	struct lktrace_probelist *ptr;
+	struct lktrace_probe_budget *b;
+
+	list_for_each_entry(ptr, &inst->lki_probes, lkpl_list) {
+		b = &ptr->lkpl_budget;
+		memset(b->lkpb_slice, 0, sizeof(b->lkpb_slice));
+		b->lkpb_rate   = 0;
+		b->lkpb_reason = LKTRACE_BUDGET_OK;
+		WRITE_ONCE(b->lkpb_every, 0);
+	}
+	return 0;
+}
+
+/* "<n>" ns of handler time per second, or "<n>%" of one cpu */
+static int lktrace_budget_parse_ns(char const *str, u64 *ns)
+{
+	unsigned long long val;
+	char pct = '\0';
+	int n = sscanf(str, "%llu%c", &val, &pct);
+
+	if(n == 1) {
+		*ns = val;
+		return 0;
+	}
+	if(n == 2 && pct == '%' && val <= 100) {
+		*ns = val * LKTRACE_BUDGET_PCT;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+ * "probe=<n>[%] global=<n>[%] window=<s> action=disable|sample" changes
+ * budgets, "rearm" runs throttled probes at full rate again
+ */
+static ssize_t lktrace_budget_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	char buff[128], *cur, *opt;
+	size_t len = min(size, sizeof(buff) - 1);
+	u64 probe, global;
+	unsigned long window;
+	int action, rearm = 0, ret = 0;
+
+	if(copy_from_user(buff, ubuff, len)) {
+		return -EFAULT;
+	}
+	buff[len] = '\0';
+
+	mutex_lock(&lktrace_probelist_mutex);
+	probe  = lktrace_budget_probe;
+	global = lktrace_budget_global;
+	window = lktrace_budget_window;
+	action = lktrace_budget_action;
+
+	cur = buff;
+	while((opt = strsep(&cur, " \t\n")) != NULL) {
+		if(*opt == '\0') {
+			continue;
+		}
+		if(strncmp(opt, "probe=", 6) == 0) {
+			ret = lktrace_budget_parse_ns(opt + 6, &probe);
+		} else if(strncmp(opt, "global=", 7) == 0) {
+			ret = lktrace_budget_parse_ns(opt + 7, &global);
+		} else if(strncmp(opt, "window=", 7) == 0) {
+			ret = kstrtoul(opt + 7, 10, &window);
+			if(ret == 0 && (window == 0 || window > 3600)) {
+				ret = -EINVAL;
+			}
+		} else if(strcmp(opt, "action=disable") == 0) {
+			action = LKTRACE_BUDGET_DISABLE;
+		} else if(strcmp(opt, "action=sample") == 0) {
+			action = LKTRACE_BUDGET_SAMPLE;
+		} else if(strcmp(opt, "rearm") == 0) {
+			rearm = 1;
+		} else {
+			ret = -EINVAL;
+		}
+		if(ret) {
+			goto end_write;
+		}
+	}
+	lktrace_budget_probe  = probe;
+	lktrace_budget_global = global;
+	lktrace_budget_window = window;
+	lktrace_budget_action = action;
+	if(rearm) {
+		lktrace_for_each_instance(lktrace_budget_rearm_instance, NULL);
+	}
+
+end_write:
+	mutex_unlock(&lktrace_probelist_mutex);
+	return ret ? ret : size;
+}
+
+static struct file_operations lktrace_budget_fops = {
+	.open		=	lktrace_budget_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_budget_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_budget_file(struct super_block *sb,
+				struct dentry *root)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"budget",
+						&lktrace_budget_fops,
+						S_IFREG | 0600);
+	return file ? 0 : -1;
+}
@@ -0,0 +1,890 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/cpu.h>
+#include <linux/smp.h>
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/trace_clock.h>
+#include <linux/uaccess.h>
+
+#include "lktrace.h"
+#include "lktrace_raw.h"
+
+#define LKTRACE_BUFFER_DEFAULT_NREC	(4096)
+#define LKTRACE_BUFFER_MIN_NREC		(16)
+#define LKTRACE_BUFFER_MAX_NREC		(1 << 24)
+/* rings of all instances, resizes included, fit in 1/8 of memory */
+#define LKTRACE_BUFFER_RAM_SHIFT	(3)
+
+/*
+ * per cpu record ring, always in overwrite mode
+ * @lkrg_size	: number of records, power of 2
+ * @lkrg_head	: number of records ever written
+ * @lkrg_first	: records before this one were dropped by a resize
+ * @lkrg_rec	: records
+ */
+struct lktrace_ring {
+	unsigned int		lkrg_size;
+	unsigned long		lkrg_head;
+	unsigned long		lkrg_first;
+	struct lktrace_record	lkrg_rec[];
+};
+
+/*
+ * @lkbc_live	: ring written by probes
+ * @lkbc_spare	: empty ring swapped in on freeze
+ * @lkbc_snap	: frozen ring, owned by snapshot reader
+ */
+struct lktrace_buffer_cpu {
+	struct lktrace_ring	*lkbc_live;
+	struct lktrace_ring	*lkbc_spare;
+	struct lktrace_ring	*lkbc_snap;
+};
+
+enum lktrace_snap_state {
+	LKTRACE_SNAP_ARMED,
+	LKTRACE_SNAP_FREEZING,
+	LKTRACE_SNAP_FROZEN,
+	/* rings are being resized, freezing is refused */
+	LKTRACE_SNAP_RESIZING,
+};
+
+/*
+ * trace buffers of one instance
+ * @lkb_cpu		: per cpu rings
+ * @lkb_snap_state	: one of lktrace_snap_state
+ * @lkb_snap_ts		: freeze timestamp
+ * @lkb_snap_window	: seconds shown before freeze, 0 = whole ring
+ * @lkb_snap_mutex	: snapshot readers against release
+ * @lkb_snap_work	: waits for writers to leave frozen rings
+ * @lkb_nrec		: records of each ring, under lkb_snap_mutex
+ * @lkb_resize_lost	: records dropped by resizes, under lkb_snap_mutex
+ */
+struct lktrace_buffer {
+	struct lktrace_buffer_cpu __percpu *lkb_cpu;
+	atomic_t		lkb_snap_state;
+	u64			lkb_snap_ts;
+	unsigned long		lkb_snap_window;
+	struct mutex		lkb_snap_mutex;
+	struct work_struct	lkb_snap_work;
+	unsigned int		lkb_nrec;
+	unsigned long		lkb_resize_lost;
+};
+
+static void lktrace_snap_work_fn(struct work_struct *work)
+{
+	struct lktrace_buffer *b;
+	b = container_of(work, struct lktrace_buffer, lkb_snap_work);
+
+	/* writers run with preemption disabled */
+	synchronize_rcu();
+	atomic_set(&b->lkb_snap_state, LKTRACE_SNAP_FROZEN);
+}
+
+static struct lktrace_ring *lktrace_ring_alloc(int cpu, unsigned int nrec)
+{
+	struct lktrace_ring *ring;
+
+	ring = vmalloc_node(struct_size(ring, lkrg_rec, nrec),
+				cpu_to_node(cpu));
+	if(ring) {
+		ring->lkrg_size  = nrec;
+		ring->lkrg_head  = 0;
+		ring->lkrg_first = 0;
+	}
+	return ring;
+}
+
+/* index of the oldest record still in ring when head was written */
+static unsigned long lktrace_ring_first(struct lktrace_ring const *ring,
+					unsigned long head)
+{
+	return head - min_t(unsigned long, head - ring->lkrg_first,
+							ring->lkrg_size);
+}
+
+/* probe context : preemption is disabled */
+void lktrace_buffer_record(struct lktrace_buffer *b,
+			u32 id,
+			unsigned long ip,
+			struct pt_regs *regs)
+{
+	struct lktrace_ring *ring;
+	struct lktrace_record *rec;
+	unsigned long flags;
+	int i;
+
+	local_irq_save(flags);
+	ring = READ_ONCE(this_cpu_ptr(b->lkb_cpu)->lkbc_live);
+	if(unlikely(ring == NULL)) {
+		goto end_record;
+	}
+
+	rec = &ring->lkrg_rec[ring->lkrg_head & (ring->lkrg_size - 1)];
+	ring->lkrg_head++;
+
+	rec->lkr_ts  = trace_clock_local();
+	rec->lkr_ip  = ip;
+	rec->lkr_pid = current->pid;
+	rec->lkr_id  = id;
+	for(i = 0; i < LKTRACE_RECORD_NARGS; ++i) {
+		rec->lkr_args[i] = lktrace_fetch_arg(regs, i + 1);
+	}
+
+end_record:
+	local_irq_restore(flags);
+}
+
+/*
+ * freeze live rings of every cpu into the snapshot, tracing goes on
+ * in spare rings. Callable from probe context, the snapshot becomes
+ * readable once all writers left the frozen rings.
+ */
+int lktrace_buffer_freeze(struct lktrace_buffer *b)
+{
+	int cpu;
+
+	if(atomic_cmpxchg(&b->lkb_snap_state, LKTRACE_SNAP_ARMED,
+				LKTRACE_SNAP_FREEZING) != LKTRACE_SNAP_ARMED) {
+		return -EBUSY;
+	}
+
+	b->lkb_snap_ts = trace_clock_local();
+	for_each_possible_cpu(cpu) {
+		struct lktrace_buffer_cpu *c = per_cpu_ptr(b->lkb_cpu, cpu);
+		c->lkbc_snap  = xchg(&c->lkbc_live, c->lkbc_spare);
+		c->lkbc_spare = NULL;
+	}
+	schedule_work(&b->lkb_snap_work);
+	return 0;
+}
+
+/* give frozen rings back as spares and re-arm the trigger */
+static int lktrace_buffer_release(struct lktrace_buffer *b)
+{
+	int cpu, ret = 0;
+
+	mutex_lock(&b->lkb_snap_mutex);
+	if(atomic_read(&b->lkb_snap_state) != LKTRACE_SNAP_FROZEN) {
+		ret = -EBUSY;
+		goto end_release;
+	}
+	for_each_possible_cpu(cpu) {
+		struct lktrace_buffer_cpu *c = per_cpu_ptr(b->lkb_cpu, cpu);
+		c->lkbc_spare = c->lkbc_snap;
+		c->lkbc_snap  = NULL;
+		if(c->lkbc_spare) {
+			c->lkbc_spare->lkrg_head  = 0;
+			c->lkbc_spare->lkrg_first = 0;
+		}
+	}
+	atomic_set(&b->lkb_snap_state, LKTRACE_SNAP_ARMED);
+
+end_release:
+	mutex_unlock(&b->lkb_snap_mutex);
+	return ret;
+}
+
+/*
+ * records held by the rings of all instances, old and new ones of a
+ * resize in progress included
+ */
+static DEFINE_SPINLOCK(lktrace_buffer_mem_lock);
+static unsigned long lktrace_buffer_mem_nrec;
+
+static unsigned long lktrace_buffer_mem_limit(void)
+{
+	return (totalram_pages() >> LKTRACE_BUFFER_RAM_SHIFT) *
+		(PAGE_SIZE / sizeof(struct lktrace_record));
+}
+
+/* account the two rings of nrec records of every possible cpu */
+static int lktrace_buffer_charge(unsigned int nrec)
+{
+	unsigned long n = 2UL * num_possible_cpus() * nrec;
+	int ret = 0;
+
+	spin_lock(&lktrace_buffer_mem_lock);
+	if(lktrace_buffer_mem_nrec + n > lktrace_buffer_mem_limit()) {
+		ret = -ENOSPC;
+	} else {
+		lktrace_buffer_mem_nrec += n;
+	}
+	spin_unlock(&lktrace_buffer_mem_lock);
+	return ret;
+}
+
+static void lktrace_buffer_uncharge(unsigned int nrec)
+{
+	spin_lock(&lktrace_buffer_mem_lock);
+	lktrace_buffer_mem_nrec -= 2UL * num_possible_cpus() * nrec;
+	spin_unlock(&lktrace_buffer_mem_lock);
+}
+
+struct lktrace_buffer *lktrace_buffer_create(void)
+{
+	struct lktrace_buffer *b;
+	int cpu;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if(b == NULL) {
+		return NULL;
+	}
+	atomic_set(&b->lkb_snap_state, LKTRACE_SNAP_ARMED);
+	mutex_init(&b->lkb_snap_mutex);
+	INIT_WORK(&b->lkb_snap_work, lktrace_snap_work_fn);
+	b->lkb_nrec = LKTRACE_BUFFER_DEFAULT_NREC;
+
+	b->lkb_cpu = alloc_percpu(struct lktrace_buffer_cpu);
+	if(b->lkb_cpu == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	/* from here on, destroy gives the charge back */
+	if(lktrace_buffer_charge(b->lkb_nrec)) {
+		free_percpu(b->lkb_cpu);
+		kfree(b);
+		return NULL;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct lktrace_buffer_cpu *c = per_cpu_ptr(b->lkb_cpu, cpu);
+		c->lkbc_live  = lktrace_ring_alloc(cpu, b->lkb_nrec);
+		c->lkbc_spare = lktrace_ring_alloc(cpu, b->lkb_nrec);
+		if(c->lkbc_live == NULL || c->lkbc_spare == NULL) {
+			lktrace_buffer_destroy(b);
+			return NULL;
+		}
+	}
+	return b;
+}
+
+/* probes writing into b must be unregistered */
+void lktrace_buffer_destroy(struct lktrace_buffer *b)
+{
+	int cpu;
+
+	flush_work(&b->lkb_snap_work);
+	for_each_possible_cpu(cpu) {
+		struct lktrace_buffer_cpu *c = per_cpu_ptr(b->lkb_cpu, cpu);
+		vfree(c->lkbc_live);
+		vfree(c->lkbc_spare);
+		vfree(c->lkbc_snap);
+	}
+	lktrace_buffer_uncharge(b->lkb_nrec);
+	free_percpu(b->lkb_cpu);
+	kfree(b);
+}
+
+/*------------------ online resize --------------------------------*/
+
+/*
+ * Each cpu live ring is replaced by a new one holding its most recent
+ * records. Most of them are copied while tracing goes on, then the cpu
+ * itself copies what was written meanwhile and swaps the rings with
+ * interrupts off, so that none of its writers sees a half done switch.
+ * Records are kept at the same index, the ring head goes on.
+ *
+ * @lkrh_cpu	: cpu buffers being switched
+ * @lkrh_old	: ring being replaced
+ * @lkrh_new	: replacing ring
+ * @lkrh_from	: first record copied before the switch
+ * @lkrh_head	: old ring head when that copy started
+ * @lkrh_lost	: records of the old ring not kept
+ */
+struct lktrace_resize {
+	struct lktrace_buffer_cpu	*lkrh_cpu;
+	struct lktrace_ring		*lkrh_old;
+	struct lktrace_ring		*lkrh_new;
+	unsigned long			lkrh_from;
+	unsigned long			lkrh_head;
+	unsigned long			lkrh_lost;
+};
+
+/* copy records [from, to) of src into dst, at the same indexes */
+static void lktrace_ring_copy(struct lktrace_ring *dst,
+			struct lktrace_ring const *src,
+			unsigned long from,
+			unsigned long to)
+{
+	for(; from < to; ++from) {
+		dst->lkrg_rec[from & (dst->lkrg_size - 1)] =
+				src->lkrg_rec[from & (src->lkrg_size - 1)];
+	}
+}
+
+/* on the resized cpu with interrupts off, or with that cpu offline */
+static void lktrace_resize_cpu(void *arg)
+{
+	struct lktrace_resize *h = arg;
+	struct lktrace_ring *old = h->lkrh_old, *new = h->lkrh_new;
+	unsigned long head = old->lkrg_head;
+	unsigned long oldest = lktrace_ring_first(old, head);
+	unsigned long first, resume;
+
+	first = head - min_t(unsigned long, head - oldest, new->lkrg_size);
+	/* the writer running at the first copy may not have been done */
+	resume = h->lkrh_head > h->lkrh_from ? h->lkrh_head - 1 : h->lkrh_head;
+	lktrace_ring_copy(new, old, max(first, resume), head);
+
+	/* first is past anything overwritten during the first copy */
+	new->lkrg_first = first;
+	new->lkrg_head  = head;
+	h->lkrh_lost    = first - oldest;
+	h->lkrh_cpu->lkbc_live = new;
+}
+
+static void lktrace_resize_ring(int cpu, struct lktrace_resize *h)
+{
+	struct lktrace_ring *old = h->lkrh_old;
+	unsigned long head = READ_ONCE(old->lkrg_head);
+
+	smp_rmb();
+	h->lkrh_head = head;
+	h->lkrh_from = head - min_t(unsigned long,
+				head - lktrace_ring_first(old, head),
+				h->lkrh_new->lkrg_size);
+	lktrace_ring_copy(h->lkrh_new, old, h->lkrh_from, head);
+
+	if(cpu_online(cpu)) {
+		smp_call_function_single(cpu, lktrace_resize_cpu, h, 1);
+	} else {
+		lktrace_resize_cpu(h);
+	}
+}
+
+/*
+ * give every cpu rings of nrec records while tracing goes on. Refused
+ * while a snapshot is frozen, -ENOSPC if old and new rings together
+ * overflow the memory of all instances. Returns records dropped by
+ * the switch.
+ */
+static long lktrace_buffer_resize(struct lktrace_buffer *b, unsigned int nrec)
+{
+	struct lktrace_ring **rings;
+	struct lktrace_resize h;
+	unsigned long lost = 0;
+	long ret = 0;
+	int cpu;
+
+	rings = kcalloc(2 * nr_cpu_ids, sizeof(*rings), GFP_KERNEL);
+	if(rings == NULL) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&b->lkb_snap_mutex);
+	if(atomic_cmpxchg(&b->lkb_snap_state, LKTRACE_SNAP_ARMED,
+				LKTRACE_SNAP_RESIZING) != LKTRACE_SNAP_ARMED) {
+		ret = -EBUSY;
+		goto end_resize;
+	}
+	if(nrec == b->lkb_nrec) {
+		goto end_armed;
+	}
+	ret = lktrace_buffer_charge(nrec);
+	if(ret) {
+		goto end_armed;
+	}
+
+	for_each_possible_cpu(cpu) {
+		rings[2 * cpu]     = lktrace_ring_alloc(cpu, nrec);
+		rings[2 * cpu + 1] = lktrace_ring_alloc(cpu, nrec);
+		if(rings[2 * cpu] == NULL || rings[2 * cpu + 1] == NULL) {
+			lktrace_buffer_uncharge(nrec);
+			ret = -ENOMEM;
+			goto end_armed;
+		}
+	}
+
+	cpus_read_lock();
+	for_each_possible_cpu(cpu) {
+		struct lktrace_buffer_cpu *c = per_cpu_ptr(b->lkb_cpu, cpu);
+
+		h.lkrh_cpu = c;
+		h.lkrh_old = c->lkbc_live;
+		h.lkrh_new = rings[2 * cpu];
+		lktrace_resize_ring(cpu, &h);
+		lost += h.lkrh_lost;
+
+		/* old rings are freed below */
+		rings[2 * cpu]     = h.lkrh_old;
+		rings[2 * cpu + 1] = xchg(&c->lkbc_spare, rings[2 * cpu + 1]);
+	}
+	cpus_read_unlock();
+
+	/* old rings are about to be freed */
+	lktrace_buffer_uncharge(b->lkb_nrec);
+	b->lkb_nrec = nrec;
+	b->lkb_resize_lost += lost;
+	ret = lost;
+
+end_armed:
+	atomic_set(&b->lkb_snap_state, LKTRACE_SNAP_ARMED);
+end_resize:
+	mutex_unlock(&b->lkb_snap_mutex);
+	for_each_possible_cpu(cpu) {
+		vfree(rings[2 * cpu]);
+		vfree(rings[2 * cpu + 1]);
+	}
+	kfree(rings);
+	return ret;
+}
+
+/*------------------ lktracefs snapshot file ----------------------*/
+
+/* snapshot iterator position: cpu and record index in cpu ring */
+struct lktrace_snap_iter {
+	struct lktrace_instance	*lksi_inst;
+	struct lktrace_buffer	*lksi_buf;
+	int			lksi_cpu;
+	unsigned long		lksi_idx;
+};
+
+static unsigned long lktrace_ring_count(struct lktrace_ring const *ring)
+{
+	if(ring == NULL) {
+		return 0;
+	}
+	return ring->lkrg_head - lktrace_ring_first(ring, ring->lkrg_head);
+}
+
+static struct lktrace_record *
+lktrace_snap_record(struct lktrace_snap_iter const *it)
+{
+	struct lktrace_ring *ring = per_cpu_ptr(it->lksi_buf->lkb_cpu,
+						it->lksi_cpu)->lkbc_snap;
+	unsigned long first = ring->lkrg_head - lktrace_ring_count(ring);
+	return &ring->lkrg_rec[(first + it->lksi_idx) & (ring->lkrg_size - 1)];
+}
+
+static void *lktrace_snap_seek(struct lktrace_snap_iter *it, loff_t pos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		unsigned long n = lktrace_ring_count(
+				per_cpu_ptr(it->lksi_buf->lkb_cpu, cpu)->lkbc_snap);
+		if(pos < n) {
+			it->lksi_cpu = cpu;
+			it->lksi_idx = pos;
+			return it;
+		}
+		pos -= n;
+	}
+	return NULL;
+}
+
+static void *lktrace_snap_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct lktrace_snap_iter *it = m->private;
+
+	mutex_lock(&it->lksi_buf->lkb_snap_mutex);
+	if(atomic_read(&it->lksi_buf->lkb_snap_state) != LKTRACE_SNAP_FROZEN) {
+		return NULL;
+	}
+	if(*pos == 0) {
+		return SEQ_START_TOKEN;
+	}
+	return lktrace_snap_seek(m->private, *pos - 1);
+}
+
+static void *lktrace_snap_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return lktrace_snap_seek(m->private, *pos - 1);
+}
+
+static void lktrace_snap_seq_stop(struct seq_file *m, void *v)
+{
+	struct lktrace_snap_iter *it = m->private;
+	mutex_unlock(&it->lksi_buf->lkb_snap_mutex);
+}
+
+static int lktrace_snap_seq_show(struct seq_file *m, void *v)
+{
+	struct lktrace_snap_iter *it = m->private;
+	struct lktrace_buffer *b = it->lksi_buf;
+	struct lktrace_record *rec;
+	u64 ts;
+	unsigned long usec;
+	int i;
+
+	if(v == SEQ_START_TOKEN) {
+		ts   = b->lkb_snap_ts;
+		usec = do_div(ts, NSEC_PER_SEC) / NSEC_PER_USEC;
+		seq_printf(m, "# frozen at %llu.%06lu, window %lus\n",
+				(unsigned long long)ts, usec,
+				b->lkb_snap_window);
+		seq_printf(m, "# cpu timestamp pid probe args\n");
+		return 0;
+	}
+
+	rec = lktrace_snap_record(it);
+	if(b->lkb_snap_window && rec->lkr_ts + b->lkb_snap_window *
+					NSEC_PER_SEC < b->lkb_snap_ts) {
+		return SEQ_SKIP;
+	}
+
+	ts   = rec->lkr_ts;
+	usec = do_div(ts, NSEC_PER_SEC) / NSEC_PER_USEC;
+	seq_printf(m, "%3d %llu.%06lu %6d %pS", it->lksi_cpu,
+			(unsigned long long)ts, usec,
+			rec->lkr_pid, (void *)rec->lkr_ip);
+	for(i = 0; i < LKTRACE_RECORD_NARGS; ++i) {
+		seq_printf(m, " 0x%lx", rec->lkr_args[i]);
+	}
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static int lktrace_snap_fops_release(struct inode *inode, struct file *file)
+{
+	struct lktrace_snap_iter *it;
+	struct lktrace_instance *inst;
+
+	it = ((struct seq_file *)file->private_data)->private;
+	inst = it->lksi_inst;
+	seq_release_private(inode, file);
+	lktrace_instance_put(inst);
+	return 0;
+}
+
+static struct seq_operations lktrace_snap_seq_ops = {
+	.start	=	lktrace_snap_seq_start,
+	.next	=	lktrace_snap_seq_next,
+	.stop	=	lktrace_snap_seq_stop,
+	.show	=	lktrace_snap_seq_show,
+};
+
+static int lktrace_snap_fops_open(struct inode *inode, struct file *file)
+{
+	struct lktrace_instance *inst = lktracefs_file_instance(file);
+	struct lktrace_snap_iter *it;
+
+	if(inst == NULL) {
+		return -ENOENT;
+	}
+	it = __seq_open_private(file, &lktrace_snap_seq_ops, sizeof(*it));
+	if(it == NULL) {
+		lktrace_instance_put(inst);
+		return -ENOMEM;
+	}
+	it->lksi_inst = inst;
+	it->lksi_buf  = inst->lki_buffer;
+	return 0;
+}
+
+/*
+ * '1'		: freeze now
+ * '0'		: release snapshot and re-arm
+ * window=N	: only show last N seconds before freeze
+ */
+static ssize_t lktrace_snap_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct lktrace_snap_iter *it;
+	struct lktrace_buffer *b;
+	char buff[32];
+	size_t len = min(size, sizeof(buff) - 1);
+	unsigned long window;
+	int ret;
+
+	it = ((struct seq_file *)file->private_data)->private;
+	b  = it->lksi_buf;
+
+	if(copy_from_user(buff, ubuff, len)) {
+		return -EFAULT;
+	}
+	buff[len] = '\0';
+
+	if(sscanf(buff, "window=%lu", &window) == 1) {
+		b->lkb_snap_window = window;
+		return size;
+	}
+
+	switch(buff[0]) {
+	case '1':
+		ret = lktrace_buffer_freeze(b);
+		if(ret == 0) {
+			flush_work(&b->lkb_snap_work);
+		}
+		break;
+	case '0':
+		ret = lktrace_buffer_release(b);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : size;
+}
+
+static struct file_operations lktrace_snap_fops = {
+	.open		=	lktrace_snap_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_snap_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	lktrace_snap_fops_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_snapshot_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"snapshot",
+						&lktrace_snap_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
+
+/*------------------ lktracefs snapshot_raw file ------------------*/
+
+/*
+ * binary dump of the frozen snapshot, see lktrace_raw.h. Index 0 of
+ * each cpu is its chunk header, records follow from index 1. The
+ * snapshot window is not applied.
+ */
+
+static void *lktrace_raw_seek(struct lktrace_snap_iter *it, loff_t pos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		unsigned long n = 1 + lktrace_ring_count(
+				per_cpu_ptr(it->lksi_buf->lkb_cpu, cpu)->lkbc_snap);
+		if(pos < n) {
+			it->lksi_cpu = cpu;
+			it->lksi_idx = pos;
+			return it;
+		}
+		pos -= n;
+	}
+	return NULL;
+}
+
+static void *lktrace_raw_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct lktrace_snap_iter *it = m->private;
+
+	mutex_lock(&it->lksi_buf->lkb_snap_mutex);
+	if(atomic_read(&it->lksi_buf->lkb_snap_state) != LKTRACE_SNAP_FROZEN) {
+		return NULL;
+	}
+	return lktrace_raw_seek(it, *pos);
+}
+
+static void *lktrace_raw_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	++*pos;
+	return lktrace_raw_seek(m->private, *pos);
+}
+
+static void lktrace_raw_show_chunk(struct seq_file *m,
+				struct lktrace_snap_iter *it)
+{
+	struct lktrace_ring *ring = per_cpu_ptr(it->lksi_buf->lkb_cpu,
+						it->lksi_cpu)->lkbc_snap;
+	struct lktrace_raw_chunk chunk = {
+		.lkrc_magic	= LKTRACE_RAW_MAGIC,
+		.lkrc_cpu	= it->lksi_cpu,
+		.lkrc_recsize	= sizeof(struct lktrace_record),
+		.lkrc_idoff	= offsetof(struct lktrace_record, lkr_id),
+		.lkrc_nrec	= lktrace_ring_count(ring),
+	};
+
+	if(chunk.lkrc_nrec) {
+		chunk.lkrc_lost = ring->lkrg_head - chunk.lkrc_nrec;
+		it->lksi_idx = 0;
+		chunk.lkrc_ts_begin = lktrace_snap_record(it)->lkr_ts;
+		it->lksi_idx = chunk.lkrc_nrec - 1;
+		chunk.lkrc_ts_end = lktrace_snap_record(it)->lkr_ts;
+	}
+	seq_write(m, &chunk, sizeof(chunk));
+}
+
+static int lktrace_raw_seq_show(struct seq_file *m, void *v)
+{
+	struct lktrace_snap_iter *it = v;
+	unsigned long idx = it->lksi_idx;
+
+	if(idx == 0) {
+		lktrace_raw_show_chunk(m, it);
+		return 0;
+	}
+	it->lksi_idx = idx - 1;
+	seq_write(m, lktrace_snap_record(it), sizeof(struct lktrace_record));
+	it->lksi_idx = idx;
+	return 0;
+}
+
+static struct seq_operations lktrace_raw_seq_ops = {
+	.start	=	lktrace_raw_seq_start,
+	.next	=	lktrace_raw_seq_next,
+	.stop	=	lktrace_snap_seq_stop,
+	.show	=	lktrace_raw_seq_show,
+};
+
+static int lktrace_raw_fops_open(struct inode *inode, struct file *file)
+{
+	struct lktrace_instance *inst = lktracefs_file_instance(file);
+	struct lktrace_snap_iter *it;
+
+	if(inst == NULL) {
+		return -ENOENT;
+	}
+	it = __seq_open_private(file, &lktrace_raw_seq_ops, sizeof(*it));
+	if(it == NULL) {
+		lktrace_instance_put(inst);
+		return -ENOMEM;
+	}
+	it->lksi_inst = inst;
+	it->lksi_buf  = inst->lki_buffer;
+	return 0;
+}
+
+static struct file_operations lktrace_raw_fops = {
+	.open		=	lktrace_raw_fops_open,
+	.read		=	seq_read,
+	.llseek		=	seq_lseek,
+	.release	=	lktrace_snap_fops_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_raw_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"snapshot_raw",
+						&lktrace_raw_fops,
+						S_IFREG | 0444);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
+
+/*------------------ lktracefs buffer_size_kb file ----------------*/
+
+static unsigned long lktrace_buffer_mem_kb(unsigned long nrec)
+{
+	return nrec / 1024 * sizeof(struct lktrace_record) +
+		(nrec % 1024) * sizeof(struct lktrace_record) / 1024;
+}
+
+static int lktrace_size_fops_show(struct seq_file *m, void *v)
+{
+	struct lktrace_instance *inst = m->private;
+	struct lktrace_buffer *b = inst->lki_buffer;
+
+	mutex_lock(&b->lkb_snap_mutex);
+	seq_printf(m, "%lu\n", (unsigned long)b->lkb_nrec *
+				sizeof(struct lktrace_record) >> 10);
+	seq_printf(m, "# %u records per cpu, %lu dropped by resizes\n",
+				b->lkb_nrec, b->lkb_resize_lost);
+	mutex_unlock(&b->lkb_snap_mutex);
+	seq_printf(m, "# all instances: %lu kB of %lu kB\n",
+			lktrace_buffer_mem_kb(READ_ONCE(lktrace_buffer_mem_nrec)),
+			lktrace_buffer_mem_kb(lktrace_buffer_mem_limit()));
+	return 0;
+}
+
+static int lktrace_size_fops_open(struct inode *inode, struct file *file)
+{
+	return lktracefs_single_open(file, lktrace_size_fops_show);
+}
+
+/* size of each cpu ring in kB, rounded down to a power of 2 records */
+static ssize_t lktrace_size_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct lktrace_instance *inst;
+	struct lktrace_buffer *b;
+	char buff[32];
+	size_t len = min(size, sizeof(buff) - 1);
+	unsigned long kb, nrec;
+	long lost;
+
+	inst = ((struct seq_file *)file->private_data)->private;
+	b    = inst->lki_buffer;
+	if(copy_from_user(buff, ubuff, len)) {
+		return -EFAULT;
+	}
+	buff[len] = '\0';
+
+	if(kstrtoul(strim(buff), 10, &kb)) {
+		return -EINVAL;
+	}
+	if(kb > (unsigned long)LKTRACE_BUFFER_MAX_NREC *
+				sizeof(struct lktrace_record) >> 10) {
+		printk(KERN_ERR "buffer_size_kb is at most %lu\n",
+			(unsigned long)LKTRACE_BUFFER_MAX_NREC *
+				sizeof(struct lktrace_record) >> 10);
+		return -EINVAL;
+	}
+	nrec = (kb << 10) / sizeof(struct lktrace_record);
+	if(nrec < LKTRACE_BUFFER_MIN_NREC) {
+		return -EINVAL;
+	}
+
+	lost = lktrace_buffer_resize(b, rounddown_pow_of_two(nrec));
+	if(lost == -ENOSPC) {
+		printk(KERN_ERR "lktrace buffers of all instances are limited"
+			" to %lu kB, a resize holds old and new rings\n",
+			lktrace_buffer_mem_kb(lktrace_buffer_mem_limit()));
+	}
+	if(lost < 0) {
+		return lost;
+	}
+	if(lost) {
+		printk(KERN_INFO "buffer resize dropped %ld records\n", lost);
+	}
+	return size;
+}
+
+static struct file_operations lktrace_size_fops = {
+	.open		=	lktrace_size_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_size_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	lktracefs_single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_buffer_size_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"buffer_size_kb",
+						&lktrace_size_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
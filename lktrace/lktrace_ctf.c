@@ -0,0 +1,179 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/stddef.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
+
+/*
+ * CTF 1.8 metadata (TSDL) of an instance. It describes the trace
+ * userspace/lktrace2ctf builds from snapshot_raw : one stream file per
+ * cpu, one packet per chunk, and records copied as is as events. The
+ * record layout is taken from struct lktrace_record, padding included,
+ * so that no conversion is needed. Every probe of the instance is an
+ * event whose id is the probe lkpl_id, id 0 stands for probes removed
+ * since their records were taken.
+ */
+
+#ifdef __BIG_ENDIAN
+# define LKTRACE_CTF_BYTE_ORDER "be"
+#else
+# define LKTRACE_CTF_BYTE_ORDER "le"
+#endif
+
+#define LKTRACE_CTF_FIELD_END(f) \
+	(offsetof(struct lktrace_record, f) + \
+	 sizeof(((struct lktrace_record *)0)->f))
+
+/* all integers are byte aligned, padding is spelled out */
+static char const lktrace_ctf_types[] =
+	"/* CTF 1.8 */\n\n"
+	"typealias integer { size = 8; align = 8; signed = false; }"
+						" := uint8_t;\n"
+	"typealias integer { size = 32; align = 8; signed = false; }"
+						" := uint32_t;\n"
+	"typealias integer { size = 32; align = 8; signed = true; }"
+						" := int32_t;\n"
+	"typealias integer { size = 64; align = 8; signed = false; }"
+						" := uint64_t;\n"
+	"typealias integer { size = 64; align = 8; signed = false;"
+	" map = clock.trace_clock_local.value; } := lktrace_clock_t;\n";
+
+static void lktrace_ctf_pad(struct seq_file *m, size_t from, size_t to)
+{
+	if(to > from) {
+		seq_printf(m, "\t\tuint8_t __pad_%zu[%zu];\n", from, to - from);
+	}
+}
+
+static void lktrace_ctf_show_header(struct seq_file *m)
+{
+	seq_puts(m, lktrace_ctf_types);
+	seq_printf(m, "typealias integer { size = %d; align = 8;"
+		" signed = false; base = hex; } := lktrace_ulong_t;\n\n",
+		BITS_PER_LONG);
+
+	seq_printf(m,	"trace {\n"
+			"\tmajor = 1;\n"
+			"\tminor = 8;\n"
+			"\tbyte_order = %s;\n"
+			"\tpacket.header := struct {\n"
+			"\t\tuint32_t magic;\n"
+			"\t\tuint32_t stream_id;\n"
+			"\t};\n"
+			"};\n\n", LKTRACE_CTF_BYTE_ORDER);
+
+	seq_puts(m,	"clock {\n"
+			"\tname = trace_clock_local;\n"
+			"\tdescription = \"per cpu local clock, ns\";\n"
+			"\tfreq = 1000000000;\n"
+			"};\n\n");
+
+	seq_puts(m,	"stream {\n"
+			"\tid = 0;\n"
+			"\tpacket.context := struct {\n"
+			"\t\tlktrace_clock_t timestamp_begin;\n"
+			"\t\tlktrace_clock_t timestamp_end;\n"
+			"\t\tuint64_t content_size;\n"
+			"\t\tuint64_t packet_size;\n"
+			"\t\tuint64_t events_discarded;\n"
+			"\t\tuint32_t cpu_id;\n"
+			"\t};\n");
+
+	/* record head, up to and including the probe id */
+	seq_puts(m,	"\tevent.header := struct {\n"
+			"\t\tlktrace_clock_t timestamp;\n");
+	lktrace_ctf_pad(m, LKTRACE_CTF_FIELD_END(lkr_ts),
+			offsetof(struct lktrace_record, lkr_ip));
+	seq_puts(m,	"\t\tlktrace_ulong_t ip;\n");
+	lktrace_ctf_pad(m, LKTRACE_CTF_FIELD_END(lkr_ip),
+			offsetof(struct lktrace_record, lkr_pid));
+	seq_puts(m,	"\t\tint32_t pid;\n");
+	lktrace_ctf_pad(m, LKTRACE_CTF_FIELD_END(lkr_pid),
+			offsetof(struct lktrace_record, lkr_id));
+	seq_puts(m,	"\t\tuint32_t id;\n"
+			"\t};\n"
+			"};\n\n");
+}
+
+/*
+ * names come from probe lines, uprobe paths may hold anything : quote
+ * and backslash are escaped, other non printable bytes replaced
+ */
+static void lktrace_ctf_show_name(struct seq_file *m, char const *name)
+{
+	for(; *name; ++name) {
+		unsigned char c = *name;
+
+		if(c == '"' || c == '\\') {
+			seq_putc(m, '\\');
+		} else if(c < 0x20 || c >= 0x7f) {
+			c = '_';
+		}
+		seq_putc(m, c);
+	}
+}
+
+static void lktrace_ctf_show_event(struct seq_file *m, u32 id,
+				char const *name, long off)
+{
+	seq_puts(m,	"event {\n"
+			"\tname = \"");
+	lktrace_ctf_show_name(m, name);
+	seq_printf(m,	"+0x%lx\";\n"
+			"\tid = %u;\n"
+			"\tstream_id = 0;\n"
+			"\tfields := struct {\n", off, id);
+	lktrace_ctf_pad(m, LKTRACE_CTF_FIELD_END(lkr_id),
+			offsetof(struct lktrace_record, lkr_args));
+	seq_printf(m,	"\t\tlktrace_ulong_t args[%d];\n",
+			LKTRACE_RECORD_NARGS);
+	lktrace_ctf_pad(m, LKTRACE_CTF_FIELD_END(lkr_args),
+			sizeof(struct lktrace_record));
+	seq_puts(m,	"\t};\n"
+			"};\n\n");
+}
+
+static int lktrace_ctf_show_probe(struct lktrace_probelist *p, void *data)
+{
+	lktrace_ctf_show_event(data, p->lkpl_id, p->lkpl_site->lks_fname,
+				p->lkpl_site->lks_offset);
+	return 0;
+}
+
+static int lktrace_ctf_fops_show(struct seq_file *m, void *v)
+{
+	lktrace_ctf_show_header(m);
+	lktrace_ctf_show_event(m, 0, "lktrace_removed", 0);
+	return lktrace_for_each_probe(m->private, lktrace_ctf_show_probe, m);
+}
+
+static int lktrace_ctf_fops_open(struct inode *inode, struct file *file)
+{
+	return lktracefs_single_open(file, lktrace_ctf_fops_show);
+}
+
+static struct file_operations lktrace_ctf_fops = {
+	.open		=	lktrace_ctf_fops_open,
+	.read		=	seq_read,
+	.llseek		=	seq_lseek,
+	.release	=	lktracefs_single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_metadata_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"metadata",
+						&lktrace_ctf_fops,
+						S_IFREG | 0444);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
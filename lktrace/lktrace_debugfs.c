@@ -1,177 +1,144 @@
 #include <linux/fs.h>
-#include <linux/kallsyms.h>
-#include <linux/kprobes.h>
+#include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/debugfs.h>
-#include <linux/rculist.h>
-#include <linux/rcupdate.h>
+#include <linux/err.h>
+#include <linux/seq_file.h>
 #include <linux/gfp.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include <linux/mutex.h>
 
+#include "lktrace.h"
 
-#define LKTRACE_FUNCNAME_MAXLEN (32) 
 #define LKTRACE_READBUFF_MAXLEN (512)
 
-static LIST_HEAD(lktrace_probelist_head);
-static DEFINE_MUTEX(lktrace_probelist_mutex);
-
-struct lktrace_probelist
-{
-	struct list_head	lkpl_list;
-	spinlock_t		lkpl_lock;
-
-	char			lkpl_fname[LKTRACE_FUNCNAME_MAXLEN];
-	off_t			lkpl_offset;
-	char			lkpl_cbname[LKTRACE_FUNCNAME_MAXLEN];
-
-	struct kprobe		lkpl_probe;
-};
-
+/*
+ * list file, one per instance. Reading gives one probe per line,
+ * writing "fname off handler [options]" or a line read back adds a
+ * probe and "-glob[+off]" removes matching ones, offsets in hex.
+ */
 
 static int lktrace_debugfs_fops_open(struct inode *, struct file *);
 
-static int lktrace_debugfs_fops_release(struct inode *, struct file *);
+static int lktrace_list_fops_open(struct inode *, struct file *);
 
-static ssize_t lktrace_debugfs_fops_read(struct file *,
-					char __user *,
-					size_t,
-					loff_t* );
+static int lktrace_list_fops_release(struct inode *, struct file *);
 
 static ssize_t lktrace_debugfs_fops_write(struct file *,
 					char const __user *,
 					size_t,
 					loff_t*);
 
+/* debugfs list, always the top level instance */
 static struct file_operations lktrace_debugfs_fops = {
-	.read		=	lktrace_debugfs_fops_read,
+	.read		=	seq_read,
 	.write		=	lktrace_debugfs_fops_write,
 	.open		=	lktrace_debugfs_fops_open,
-	.release	=	lktrace_debugfs_fops_release,
+	.llseek		=	seq_lseek,
+	.release	=	seq_release,
+	.owner		=	THIS_MODULE,
 };
 
-static int lktrace_init_probelist_elem(struct lktrace_probelist *const ptr,
-					char  fname[],
-					off_t off,
-					char cbname[])
-{
-	int ret;
-	strlcpy(ptr->lkpl_fname,  fname, sizeof(ptr->lkpl_fname));
-	ptr->lkpl_offset = off;
-	strlcpy(ptr->lkpl_cbname, fname, sizeof(ptr->lkpl_cbname));
-
-	ptr->lkpl_probe.addr = (kprobe_opcode_t*)kallsyms_lookup_name(fname);
-	if(ptr->lkpl_probe.addr == NULL) {
-		printk("error, can't resolv %s func\n", fname);
-		return -EINVAL; 
-	} else {
-		printk("ok, we resolv %s func at %p addr\n", fname, 
-							ptr->lkpl_probe.addr);
-	}
-
-	ptr->lkpl_probe.addr += off;
+/* lktracefs list, pins its instance while open */
+static struct file_operations lktrace_list_fops = {
+	.read		=	seq_read,
+	.write		=	lktrace_debugfs_fops_write,
+	.open		=	lktrace_list_fops_open,
+	.llseek		=	seq_lseek,
+	.release	=	lktrace_list_fops_release,
+	.owner		=	THIS_MODULE,
+};
 
-	ptr->lkpl_probe.pre_handler = (kprobe_pre_handler_t )
-						kallsyms_lookup_name(cbname);
+static void *lktrace_list_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct lktrace_instance *inst = m->private;
+	mutex_lock(&lktrace_probelist_mutex);
+	return seq_list_start(&inst->lki_probes, *pos);
+}
 
-	if(ptr->lkpl_probe.pre_handler == NULL) {
-		printk("error, can't resolv %s handler\n", cbname);
-		return -EINVAL;
-	} else {
-		printk("ok we resolv %s func at %p addr\n", cbname,
-						ptr->lkpl_probe.pre_handler);
-	}
+static void *lktrace_list_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct lktrace_instance *inst = m->private;
+	return seq_list_next(v, &inst->lki_probes, pos);
+}
 
-	ret = register_kprobe(&ptr->lkpl_probe);
+static void lktrace_list_seq_stop(struct seq_file *m, void *v)
+{
+	mutex_unlock(&lktrace_probelist_mutex);
+}
 
-	if(ret < 0) {
-		printk("can't register kprobe: cause = %d\n", ret);
-	}
+static int lktrace_list_seq_show(struct seq_file *m, void *v)
+{
+	char buff[LKTRACE_READBUFF_MAXLEN];
+	struct lktrace_probelist *walker;
 
-	return ret;
+	walker = list_entry(v, struct lktrace_probelist, lkpl_list);
+	lktrace_probe_print(walker, buff, sizeof(buff));
+	seq_printf(m, "%s\n", buff);
+	return 0;
 }
 
+static struct seq_operations lktrace_list_seq_ops = {
+	.start	=	lktrace_list_seq_start,
+	.next	=	lktrace_list_seq_next,
+	.stop	=	lktrace_list_seq_stop,
+	.show	=	lktrace_list_seq_show,
+};
 
-static struct lktrace_probelist* lktrace_alloc_new_probelist_elem(void)
+static int lktrace_debugfs_fops_open( struct inode *inode, struct file *f)
 {
-	struct lktrace_probelist *ret = kzalloc(sizeof(*ret), GFP_KERNEL);
-	if(ret) {
-		INIT_LIST_HEAD( &ret->lkpl_list );
-		spin_lock_init( &ret->lkpl_lock );
+	int ret = seq_open(f, &lktrace_list_seq_ops);
+	if(ret == 0) {
+		((struct seq_file *)f->private_data)->private = inode->i_private;
 	}
 	return ret;
 }
 
-static int lktrace_debugfs_fops_open( struct inode *inode, struct file *f)
+static int lktrace_list_fops_open(struct inode *inode, struct file *f)
 {
-	/* open just get first link in list */
-	struct lktrace_probelist *ptr;
-	mutex_lock(&lktrace_probelist_mutex);
-	ptr = list_first_entry(&lktrace_probelist_head, 
-				struct lktrace_probelist,
-				lkpl_list);
-	mutex_unlock(&lktrace_probelist_mutex);
-	f->private_data = ptr;
+	struct lktrace_instance *inst = lktracefs_file_instance(f);
+	int ret;
 
-	return 0;
+	if(inst == NULL) {
+		return -ENOENT;
+	}
+	ret = seq_open(f, &lktrace_list_seq_ops);
+	if(ret == 0) {
+		((struct seq_file *)f->private_data)->private = inst;
+	} else {
+		lktrace_instance_put(inst);
+	}
+	return ret;
 }
 
-static int lktrace_debugfs_fops_release( struct inode *inode, struct file *f)
+static int lktrace_list_fops_release(struct inode *inode, struct file *f)
 {
-	f->private_data = NULL;
+	struct lktrace_instance *inst;
+
+	inst = ((struct seq_file *)f->private_data)->private;
+	seq_release(inode, f);
+	lktrace_instance_put(inst);
 	return 0;
 }
 
-static ssize_t lktrace_debugfs_fops_read(struct file *file,
-					char __user  *ubuff,
-					size_t	bufflen,
-					loff_t	*loff)
+/* "-glob[+off]", off in hex like everywhere else */
+static int lktrace_parse_remove(struct lktrace_instance *inst, char *spec)
 {
-	char buff[512];
-	size_t remaining = bufflen;
-	ssize_t count = 0;
-	int ret = 0;
-	/* get current item */
-	struct lktrace_probelist *walker =  file->private_data;
-	
-	/* return EOF */
-	if(walker == NULL || &walker->lkpl_list == &lktrace_probelist_head) {
-		return count;
-	}
-
-	mutex_lock(&lktrace_probelist_mutex);
-	list_for_each_entry(walker, 
-			&lktrace_probelist_head, 
-			lkpl_list) {
-		if(remaining <= 0) {
-			goto end_read;
+	char *plus;
+	long off = -1;
+	int removed;
+
+	spec = strim(spec);
+	plus = strrchr(spec, '+');
+	if(plus) {
+		*plus = '\0';
+		if(kstrtol(plus + 1, 16, &off) || off < 0) {
+			return -EINVAL;
 		}
-		ret = snprintf(	buff, 
-				sizeof(buff), 
-				"%s+%ld %s\n", 
-				walker->lkpl_fname, 
-				walker->lkpl_offset,
-				walker->lkpl_cbname);	
-		
-		// can we add ret bytes in buffer? 
-		if(ret < remaining) {
-			if(copy_to_user(ubuff + count, buff, ret)) {
-				count =  -EIO;
-				goto end_read;
-			}
-		} else {
-			// no space left
-			goto end_read;
-		}
-
-		remaining -= ret;
-		count	  += ret;
 	}
-
-end_read:	
-	mutex_unlock(&lktrace_probelist_mutex);
-	file->private_data = walker;
-	return count;
+	removed = lktrace_probe_remove(inst, spec, off, NULL);
+	printk("%d probes removed\n", removed);
+	return removed ? 0 : -ENOENT;
 }
 
 static ssize_t lktrace_debugfs_fops_write(struct file *file,
@@ -179,14 +146,13 @@ static ssize_t lktrace_debugfs_fops_write(struct file *file,
 					size_t	bufflen,
 					loff_t	*loff)
 {
+	struct lktrace_instance *inst;
 	char *tmpbuff;
-	size_t alloclen = bufflen - (size_t) *loff;
 	int ret;
 	ssize_t count = 0;
-	char fname[LKTRACE_FUNCNAME_MAXLEN], cbname[LKTRACE_FUNCNAME_MAXLEN];
-	off_t off;
 
-	tmpbuff = kzalloc(alloclen, GFP_KERNEL);
+	inst = ((struct seq_file *)file->private_data)->private;
+	tmpbuff = kzalloc(bufflen + 1, GFP_KERNEL);
 
 	if(unlikely(tmpbuff == NULL)) {
 		printk("can't allocate buffer to get user data\n");
@@ -200,32 +166,12 @@ static ssize_t lktrace_debugfs_fops_write(struct file *file,
 		goto end_write;
 	}
 
-	ret = sscanf(	tmpbuff, 
-			"%31s %lx %31s", 
-			fname,
-			&off,
-			cbname);
-	if(ret == 3) {
-		int hasprobe;
-		struct lktrace_probelist *elt = lktrace_alloc_new_probelist_elem();
-		if(elt == NULL) {
-			count = -ENOMEM;
-			goto end_write;
-		}
-
-		hasprobe = lktrace_init_probelist_elem(elt, fname, off, cbname);
-		if(hasprobe < 0) {
-			count = hasprobe;
-			goto end_write;
-		}
-		mutex_lock(&lktrace_probelist_mutex);
-		list_add(&elt->lkpl_list, &lktrace_probelist_head);
-		mutex_unlock(&lktrace_probelist_mutex);
-		count = bufflen;
+	if(tmpbuff[0] == '-') {
+		ret = lktrace_parse_remove(inst, tmpbuff + 1);
 	} else {
-		printk(KERN_ERR "I/O error, sscanf return %d \n", ret);
-		count = -EIO;
+		ret = lktrace_probe_add(inst, tmpbuff);
 	}
+	count = ret ? ret : bufflen;
 
 end_write:
 	kfree(tmpbuff);
@@ -233,24 +179,42 @@ end_write:
 	return count;
 }
 
+int lktracefile_create_list_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"list",
+						&lktrace_list_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
+
 static struct dentry *entry	= NULL;
 static struct dentry *main	= NULL;
 
+/* debugfs lktrace/list is the top level instance list */
 int lktrace_create_debugfs(void *data)
 {
 		/*create lktrace directory*/
 	int ret = 0;
-		
+
 	main = debugfs_create_dir("lktrace", NULL);
-	if(unlikely(main == NULL)){
+	if(unlikely(IS_ERR_OR_NULL(main))){
 		printk(KERN_ERR "unable to create lktrace dir\n");
 				//return -1;
 	}
 
 	entry = debugfs_create_file("list", 0666, main ,data, &lktrace_debugfs_fops);
-	if(unlikely(entry == NULL)){
+	if(unlikely(IS_ERR_OR_NULL(entry))){
 		printk(KERN_ERR "unable to create entry file\n");
 		debugfs_remove(main);
+		main = entry = NULL;
 		ret = -1;
 	}
 	return ret;
@@ -258,7 +222,6 @@ int lktrace_create_debugfs(void *data)
 
 void lktrace_destroy_debugfs(void)
 {
-	struct lktrace_probelist *walker = NULL, *tmp = NULL;
 	if(entry) {
 		debugfs_remove(entry);
 		entry = NULL;
@@ -267,16 +230,4 @@ void lktrace_destroy_debugfs(void)
 		debugfs_remove(main);
 		main = NULL;
 	}
-	mutex_lock(&lktrace_probelist_mutex);
-	list_for_each_entry_safe(walker,
-				tmp,
-				&lktrace_probelist_head,
-				lkpl_list) {
-		if(walker->lkpl_probe.addr)
-			unregister_kprobe(&walker->lkpl_probe);
-		kfree(walker);
-	}
-	mutex_unlock(&lktrace_probelist_mutex);
 }
-
-
@@ -0,0 +1,206 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/ptrace.h>
+
+#include "lktrace.h"
+
+#if defined(CONFIG_X86_64)
+# define LKTRACE_FETCH_MAXARG (6)
+#elif defined(CONFIG_X86_32)
+# define LKTRACE_FETCH_MAXARG (3)
+#else
+# define LKTRACE_FETCH_MAXARG (0)
+#endif
+
+/* read argument n (from 1) according to kernel calling convention */
+unsigned long lktrace_fetch_arg(struct pt_regs *regs, unsigned int n)
+{
+#if defined(CONFIG_X86_64)
+	switch(n) {
+	case 1:	return regs->di;
+	case 2:	return regs->si;
+	case 3:	return regs->dx;
+	case 4:	return regs->cx;
+	case 5:	return regs->r8;
+	case 6:	return regs->r9;
+	}
+#elif defined(CONFIG_X86_32)
+	/* kernel is built with -mregparm=3 */
+	switch(n) {
+	case 1:	return regs->ax;
+	case 2:	return regs->dx;
+	case 3:	return regs->cx;
+	}
+#endif
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lktrace_fetch_arg);
+
+/* reverse of lktrace_fetch_arg, for probes building their own regs */
+void lktrace_fetch_set_arg(struct pt_regs *regs, unsigned int n,
+			unsigned long val)
+{
+#if defined(CONFIG_X86_64)
+	switch(n) {
+	case 1:	regs->di = val; break;
+	case 2:	regs->si = val; break;
+	case 3:	regs->dx = val; break;
+	case 4:	regs->cx = val; break;
+	case 5:	regs->r8 = val; break;
+	case 6:	regs->r9 = val; break;
+	}
+#elif defined(CONFIG_X86_32)
+	switch(n) {
+	case 1:	regs->ax = val; break;
+	case 2:	regs->dx = val; break;
+	case 3:	regs->cx = val; break;
+	}
+#endif
+}
+
+/*
+ * parse a fetch spec:
+ *   argN	: Nth function argument
+ *   %reg	: pt_regs register, as named by regs_query_register_offset
+ */
+int lktrace_fetch_parse(struct lktrace_fetch *f, char const *spec)
+{
+	unsigned long n;
+
+	if(strncmp(spec, "arg", 3) == 0) {
+		if(kstrtoul(spec + 3, 10, &n) || n == 0 ||
+						n > LKTRACE_FETCH_MAXARG) {
+			printk(KERN_ERR "bad argument number in %s\n", spec);
+			return -EINVAL;
+		}
+		f->lkf_kind  = LKTRACE_FETCH_ARG;
+		f->lkf_index = n;
+		return 0;
+	}
+
+	if(spec[0] == '%') {
+		int off = regs_query_register_offset(spec + 1);
+		if(off < 0) {
+			printk(KERN_ERR "unknown register %s\n", spec);
+			return -EINVAL;
+		}
+		f->lkf_kind  = LKTRACE_FETCH_REG;
+		f->lkf_index = off;
+		return 0;
+	}
+
+	printk(KERN_ERR "bad fetch spec %s\n", spec);
+	return -EINVAL;
+}
+
+unsigned long lktrace_fetch_value(struct lktrace_fetch const *f,
+				struct pt_regs *regs)
+{
+	switch(f->lkf_kind) {
+	case LKTRACE_FETCH_ARG:
+		return lktrace_fetch_arg(regs, f->lkf_index);
+	case LKTRACE_FETCH_REG:
+		return regs_get_register(regs, f->lkf_index);
+	default:
+		return 0;
+	}
+}
+
+int lktrace_fetch_print(struct lktrace_fetch const *f, char *buff, size_t len)
+{
+	switch(f->lkf_kind) {
+	case LKTRACE_FETCH_ARG:
+		return scnprintf(buff, len, "arg%u", f->lkf_index);
+	case LKTRACE_FETCH_REG:
+		return scnprintf(buff, len, "%%%s",
+				regs_query_register_name(f->lkf_index));
+	default:
+		return scnprintf(buff, len, "none");
+	}
+}
+
+/*------------------ conditions -----------------------------------*/
+
+static char const *const lktrace_cond_opname[] = {
+	[LKTRACE_COND_EQ]	= "==",
+	[LKTRACE_COND_NE]	= "!=",
+	[LKTRACE_COND_GE]	= ">=",
+	[LKTRACE_COND_LE]	= "<=",
+	[LKTRACE_COND_GT]	= ">",
+	[LKTRACE_COND_LT]	= "<",
+	[LKTRACE_COND_AND]	= "&",
+};
+
+/*
+ * parse <fetch><op><value>, op in == != >= <= > < &
+ * an empty spec gives a condition that always matches
+ */
+int lktrace_cond_parse(struct lktrace_cond *c, char *spec)
+{
+	char *op;
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	if(spec == NULL || *spec == '\0') {
+		return 0;
+	}
+
+	op = strpbrk(spec, "=!<>&");
+	if(op == NULL) {
+		goto bad_cond;
+	}
+	for(i = 0; i < ARRAY_SIZE(lktrace_cond_opname); ++i) {
+		size_t len = strlen(lktrace_cond_opname[i]);
+		if(strncmp(op, lktrace_cond_opname[i], len) == 0) {
+			break;
+		}
+	}
+	if(i == ARRAY_SIZE(lktrace_cond_opname)) {
+		goto bad_cond;
+	}
+	c->lkc_op = i;
+	if(kstrtoul(op + strlen(lktrace_cond_opname[i]), 0,
+							&c->lkc_value)) {
+		goto bad_cond;
+	}
+	*op = '\0';
+	return lktrace_fetch_parse(&c->lkc_fetch, spec);
+
+bad_cond:
+	printk(KERN_ERR "bad condition %s\n", spec);
+	return -EINVAL;
+}
+
+bool lktrace_cond_match(struct lktrace_cond const *c, struct pt_regs *regs)
+{
+	unsigned long v;
+
+	if(c->lkc_fetch.lkf_kind == LKTRACE_FETCH_NONE) {
+		return true;
+	}
+	v = lktrace_fetch_value(&c->lkc_fetch, regs);
+	switch(c->lkc_op) {
+	case LKTRACE_COND_EQ:	return v == c->lkc_value;
+	case LKTRACE_COND_NE:	return v != c->lkc_value;
+	case LKTRACE_COND_GE:	return v >= c->lkc_value;
+	case LKTRACE_COND_LE:	return v <= c->lkc_value;
+	case LKTRACE_COND_GT:	return v >  c->lkc_value;
+	case LKTRACE_COND_LT:	return v <  c->lkc_value;
+	case LKTRACE_COND_AND:	return (v & c->lkc_value) != 0;
+	}
+	return false;
+}
+
+int lktrace_cond_print(struct lktrace_cond const *c, char *buff, size_t len)
+{
+	int ret;
+
+	if(c->lkc_fetch.lkf_kind == LKTRACE_FETCH_NONE) {
+		return 0;
+	}
+	ret  = lktrace_fetch_print(&c->lkc_fetch, buff, len);
+	ret += scnprintf(buff + ret, len - ret, "%s0x%lx",
+				lktrace_cond_opname[c->lkc_op], c->lkc_value);
+	return ret;
+}
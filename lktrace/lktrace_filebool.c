@@ -5,7 +5,9 @@
 #include <linux/kernel.h>
 #include <linux/poll.h>
 #include <linux/rcupdate.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
+
+#include "lktrace.h"
 
 
 static DEFINE_SPINLOCK(bool_lock);
@@ -17,13 +19,19 @@ static int
 lktrace_bool_fops_open (struct inode *inode, struct file *file)
 {
         void *iprivate = inode->i_private;
+        struct lktrace_instance *inst;
     
         /* inode_i_private must have been filled during file_creation*/
         if(unlikely(iprivate == NULL)){
                     BUG_ON(iprivate == NULL);
                     return -EIO;
         }
-        file->private_data = iprivate;
+        /* the flag lives in the instance, keep it while open */
+        inst = lktracefs_file_instance(file);
+        if(inst == NULL){
+                return -ENOENT;
+        }
+        file->private_data = inst;
         return 0;
 }
 
@@ -31,6 +39,7 @@ lktrace_bool_fops_open (struct inode *inode, struct file *file)
 static int
 lktrace_bool_fops_release(struct inode *inode, struct file *file)
 {
+        lktrace_instance_put(file->private_data);
         file->private_data = NULL;
         return 0;
 }
@@ -44,7 +53,7 @@ lktrace_bool_fops_read( struct file *fs,
 {
         char c;
         unsigned long flag;
-        int *ptr = fs->private_data;
+        int *ptr = file_inode(fs)->i_private;
         int ret;
 
         if(size < 1){
@@ -95,7 +104,7 @@ lktrace_bool_fops_write(    struct file *file,
         }
         val = c - '0';
         spin_lock_irqsave(&bool_lock, flag);
-        ptr = file->private_data;
+        ptr = file_inode(file)->i_private;
         if(*ptr != val){
                 *ptr = val;
                 bool_filestate_changed = 1;
@@ -135,15 +144,6 @@ static struct file_operations lktrace_bool_fops = {
 };
 
 
-extern struct dentry*
-lktracefs_create_file(  struct super_block*, 
-                        struct dentry*,
-                        char *const,
-                        struct file_operations*,
-                        int );
-
-
-
 int
 lktracefile_create_enable_file( struct super_block  *sb,
                                 struct dentry       *root,
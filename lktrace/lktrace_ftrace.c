@@ -0,0 +1,119 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/ftrace.h>
+
+#include "lktrace.h"
+
+/*
+ * function entry probes through ftrace instead of a breakpoint.
+ * needs ftrace to hand over pt_regs, so that handlers keep their
+ * kprobe prototype. The handler return value is ignored : regs->ip
+ * can't be redirected from here.
+ */
+#ifdef CONFIG_DYNAMIC_FTRACE_WITH_REGS
+
+struct lktrace_ftrace {
+	struct ftrace_ops	lkft_ops;
+	struct lktrace_site	*lkft_site;
+};
+
+static void notrace lktrace_ftrace_func(unsigned long ip,
+					unsigned long parent_ip,
+					struct ftrace_ops *op,
+					struct ftrace_regs *fregs)
+{
+	struct lktrace_ftrace *ft;
+	struct pt_regs *regs = ftrace_get_regs(fregs);
+
+	/* full regs are only handed over with FTRACE_OPS_FL_SAVE_REGS */
+	if(unlikely(regs == NULL)) {
+		return;
+	}
+	ft = container_of(op, struct lktrace_ftrace, lkft_ops);
+
+	/* kprobe handlers always run with preemption disabled */
+	preempt_disable_notrace();
+	lktrace_site_dispatch(&ft->lkft_site->lks_probe, regs);
+	preempt_enable_notrace();
+}
+
+/*
+ * ftrace call site of the function at addr, 0 if it has none. It may
+ * sit after an endbr or other entry padding, not at addr itself.
+ */
+unsigned long lktrace_ftrace_ip(void const *addr)
+{
+	unsigned long start = (unsigned long)addr;
+
+	return ftrace_location_range(start, start + MCOUNT_INSN_SIZE);
+}
+
+int lktrace_ftrace_attach(struct lktrace_site *site)
+{
+	unsigned long ip = lktrace_ftrace_ip(site->lks_probe.addr);
+	struct lktrace_ftrace *ft;
+	int ret;
+
+	if(ip == 0) {
+		return -ENOENT;
+	}
+	ft = kzalloc(sizeof(*ft), GFP_KERNEL);
+	if(ft == NULL) {
+		return -ENOMEM;
+	}
+	ft->lkft_site	     = site;
+	ft->lkft_ops.func    = lktrace_ftrace_func;
+	/* ftrace guards the callback against recursion */
+	ft->lkft_ops.flags   = FTRACE_OPS_FL_SAVE_REGS |
+			       FTRACE_OPS_FL_RECURSION;
+
+	ret = ftrace_set_filter_ip(&ft->lkft_ops, ip, 0, 0);
+	if(ret) {
+		goto attach_err;
+	}
+	ret = register_ftrace_function(&ft->lkft_ops);
+	if(ret) {
+		ftrace_free_filter(&ft->lkft_ops);
+		goto attach_err;
+	}
+	site->lks_ftrace = ft;
+	return 0;
+
+attach_err:
+	printk(KERN_ERR "can't attach ftrace on %s: cause = %d\n",
+						site->lks_fname, ret);
+	kfree(ft);
+	return ret;
+}
+
+/* unregister_ftrace_function waits for callbacks in flight */
+void lktrace_ftrace_detach(struct lktrace_site *site)
+{
+	struct lktrace_ftrace *ft = site->lks_ftrace;
+
+	if(ft == NULL) {
+		return;
+	}
+	unregister_ftrace_function(&ft->lkft_ops);
+	ftrace_free_filter(&ft->lkft_ops);
+	kfree(ft);
+	site->lks_ftrace = NULL;
+}
+
+#else
+
+unsigned long lktrace_ftrace_ip(void const *addr)
+{
+	return 0;
+}
+
+int lktrace_ftrace_attach(struct lktrace_site *site)
+{
+	return -ENOSYS;
+}
+
+void lktrace_ftrace_detach(struct lktrace_site *site)
+{
+}
+
+#endif
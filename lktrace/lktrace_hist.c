@@ -0,0 +1,333 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
+
+/* linear : underflow slot + steps + overflow slot */
+#define LKTRACE_HIST_LINEAR_MAXSTEPS	(64)
+#define LKTRACE_HIST_NSLOTS		(LKTRACE_HIST_LINEAR_MAXSTEPS + 2)
+#define LKTRACE_HIST_BARLEN		(40)
+
+enum lktrace_hist_type {
+	LKTRACE_HIST_LOG2,
+	LKTRACE_HIST_LINEAR,
+};
+
+struct lktrace_hist_cpu {
+	u64	lkhc_slot[LKTRACE_HIST_NSLOTS];
+};
+
+/*
+ * per probe value histogram
+ * @lkh_type	: log2 or linear buckets
+ * @lkh_fetch	: value source
+ * @lkh_min	: linear lower bound
+ * @lkh_max	: linear upper bound
+ * @lkh_step	: linear bucket width
+ * @lkh_nslots	: number of used slots
+ * @lkh_cpu	: per cpu counters, updated from probe context
+ */
+struct lktrace_hist {
+	enum lktrace_hist_type	lkh_type;
+	struct lktrace_fetch	lkh_fetch;
+	unsigned long		lkh_min;
+	unsigned long		lkh_max;
+	unsigned long		lkh_step;
+	unsigned int		lkh_nslots;
+	struct lktrace_hist_cpu __percpu *lkh_cpu;
+};
+
+static unsigned int lktrace_hist_slot(struct lktrace_hist const *h,
+				unsigned long v)
+{
+	if(h->lkh_type == LKTRACE_HIST_LOG2) {
+		/* 0 -> slot 0, [2^(n-1), 2^n) -> slot n */
+		return fls_long(v);
+	}
+	if(v < h->lkh_min) {
+		return 0;
+	}
+	if(v >= h->lkh_max) {
+		return h->lkh_nslots - 1;
+	}
+	return 1 + (v - h->lkh_min) / h->lkh_step;
+}
+
+static void lktrace_hist_label(struct lktrace_hist const *h,
+				unsigned int i,
+				char *buff,
+				size_t len)
+{
+	unsigned long lo, hi;
+
+	if(h->lkh_type == LKTRACE_HIST_LOG2) {
+		if(i == 0) {
+			snprintf(buff, len, "0");
+		} else if(i == BITS_PER_LONG) {
+			snprintf(buff, len, "[%lu, inf)", 1UL << (i - 1));
+		} else {
+			snprintf(buff, len, "[%lu, %lu)", 1UL << (i - 1),
+								1UL << i);
+		}
+		return;
+	}
+
+	if(i == 0) {
+		snprintf(buff, len, "< %lu", h->lkh_min);
+	} else if(i == h->lkh_nslots - 1) {
+		snprintf(buff, len, ">= %lu", h->lkh_max);
+	} else {
+		lo = h->lkh_min + (i - 1) * h->lkh_step;
+		hi = min(lo + h->lkh_step, h->lkh_max);
+		snprintf(buff, len, "[%lu, %lu)", lo, hi);
+	}
+}
+
+/*
+ * parse histogram spec:
+ *   log2:<fetch>
+ *   linear:<fetch>:<min>:<max>:<step>
+ */
+struct lktrace_hist *lktrace_hist_create(char *spec)
+{
+	struct lktrace_hist *h;
+	char *type, *fetch;
+	unsigned long steps;
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if(h == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	type  = strsep(&spec, ":");
+	fetch = strsep(&spec, ":");
+	if(type == NULL || fetch == NULL) {
+		goto bad_spec;
+	}
+	if(lktrace_fetch_parse(&h->lkh_fetch, fetch)) {
+		goto bad_spec;
+	}
+
+	if(strcmp(type, "log2") == 0) {
+		if(spec != NULL) {
+			goto bad_spec;
+		}
+		h->lkh_type   = LKTRACE_HIST_LOG2;
+		h->lkh_nslots = BITS_PER_LONG + 1;
+	} else if(strcmp(type, "linear") == 0) {
+		if(spec == NULL || sscanf(spec, "%lu:%lu:%lu", &h->lkh_min,
+				&h->lkh_max, &h->lkh_step) != 3) {
+			goto bad_spec;
+		}
+		if(h->lkh_step == 0 || h->lkh_max <= h->lkh_min) {
+			goto bad_spec;
+		}
+		steps = DIV_ROUND_UP(h->lkh_max - h->lkh_min, h->lkh_step);
+		if(steps > LKTRACE_HIST_LINEAR_MAXSTEPS) {
+			printk(KERN_ERR "too many buckets (%lu > %d)\n", steps,
+					LKTRACE_HIST_LINEAR_MAXSTEPS);
+			goto bad_spec;
+		}
+		h->lkh_type   = LKTRACE_HIST_LINEAR;
+		h->lkh_nslots = steps + 2;
+	} else {
+		goto bad_spec;
+	}
+
+	h->lkh_cpu = alloc_percpu(struct lktrace_hist_cpu);
+	if(h->lkh_cpu == NULL) {
+		kfree(h);
+		return ERR_PTR(-ENOMEM);
+	}
+	return h;
+
+bad_spec:
+	printk(KERN_ERR "bad histogram spec\n");
+	kfree(h);
+	return ERR_PTR(-EINVAL);
+}
+
+/* log2 histogram fed by lktrace_hist_add, e.g. latencies */
+struct lktrace_hist *lktrace_hist_create_log2(void)
+{
+	struct lktrace_hist *h = kzalloc(sizeof(*h), GFP_KERNEL);
+
+	if(h == NULL) {
+		return NULL;
+	}
+	h->lkh_type   = LKTRACE_HIST_LOG2;
+	h->lkh_nslots = BITS_PER_LONG + 1;
+	h->lkh_cpu    = alloc_percpu(struct lktrace_hist_cpu);
+	if(h->lkh_cpu == NULL) {
+		kfree(h);
+		return NULL;
+	}
+	return h;
+}
+
+void lktrace_hist_destroy(struct lktrace_hist *h)
+{
+	if(h) {
+		free_percpu(h->lkh_cpu);
+		kfree(h);
+	}
+}
+
+/* probe context : preemption is disabled */
+void lktrace_hist_add(struct lktrace_hist *h, unsigned long v)
+{
+	this_cpu_ptr(h->lkh_cpu)->lkhc_slot[lktrace_hist_slot(h, v)]++;
+}
+
+/* probe context : preemption is disabled */
+void lktrace_hist_update(struct lktrace_hist *h, struct pt_regs *regs)
+{
+	lktrace_hist_add(h, lktrace_fetch_value(&h->lkh_fetch, regs));
+}
+
+int lktrace_hist_print(struct lktrace_hist const *h, char *buff, size_t len)
+{
+	char fetch[16];
+
+	lktrace_fetch_print(&h->lkh_fetch, fetch, sizeof(fetch));
+	if(h->lkh_type == LKTRACE_HIST_LOG2) {
+		return scnprintf(buff, len, "hist=log2:%s", fetch);
+	}
+	return scnprintf(buff, len, "hist=linear:%s:%lu:%lu:%lu", fetch,
+				h->lkh_min, h->lkh_max, h->lkh_step);
+}
+
+void lktrace_hist_clear(struct lktrace_hist *h)
+{
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(h->lkh_cpu, cpu), 0,
+				sizeof(struct lktrace_hist_cpu));
+	}
+}
+
+void lktrace_hist_show(struct seq_file *m, struct lktrace_hist *h)
+{
+	static char const bar[] = "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@";
+	u64 sum[LKTRACE_HIST_NSLOTS] = { 0 };
+	u64 total = 0, maxcount = 0;
+	unsigned int i, first, last;
+	char label[48];
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct lktrace_hist_cpu *c = per_cpu_ptr(h->lkh_cpu, cpu);
+		for(i = 0; i < h->lkh_nslots; ++i) {
+			sum[i] += c->lkhc_slot[i];
+		}
+	}
+
+	first = h->lkh_nslots;
+	last  = 0;
+	for(i = 0; i < h->lkh_nslots; ++i) {
+		if(sum[i] == 0) {
+			continue;
+		}
+		if(first == h->lkh_nslots) {
+			first = i;
+		}
+		last	  = i;
+		total	 += sum[i];
+		maxcount  = max(maxcount, sum[i]);
+	}
+
+	seq_printf(m, "total %llu\n", (unsigned long long)total);
+	if(total == 0) {
+		return;
+	}
+
+	for(i = first; i <= last; ++i) {
+		int len = div64_u64(sum[i] * LKTRACE_HIST_BARLEN, maxcount);
+		lktrace_hist_label(h, i, label, sizeof(label));
+		seq_printf(m, "%28s %12llu |%.*s%*s|\n", label,
+				(unsigned long long)sum[i],
+				len, bar,
+				LKTRACE_HIST_BARLEN - len, "");
+	}
+}
+
+/*------------------ lktracefs hist file --------------------------*/
+
+static int lktrace_hist_show_probe(struct lktrace_probelist *p, void *data)
+{
+	struct seq_file *m = data;
+	struct lktrace_hist *h = p->lkpl_opts ? p->lkpl_opts->lkpo_hist : NULL;
+	char buff[64];
+
+	if(h == NULL) {
+		return 0;
+	}
+	lktrace_hist_print(h, buff, sizeof(buff));
+	seq_printf(m, "%s+0x%lx %s\n", p->lkpl_site->lks_fname,
+				p->lkpl_site->lks_offset, buff);
+	lktrace_hist_show(m, h);
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static int lktrace_hist_clear_probe(struct lktrace_probelist *p, void *data)
+{
+	if(p->lkpl_opts && p->lkpl_opts->lkpo_hist) {
+		lktrace_hist_clear(p->lkpl_opts->lkpo_hist);
+	}
+	return 0;
+}
+
+static int lktrace_hist_fops_show(struct seq_file *m, void *v)
+{
+	return lktrace_for_each_probe(m->private, lktrace_hist_show_probe, m);
+}
+
+static int lktrace_hist_fops_open(struct inode *inode, struct file *file)
+{
+	return lktracefs_single_open(file, lktrace_hist_fops_show);
+}
+
+/* any write resets all histograms */
+static ssize_t lktrace_hist_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct seq_file *m = file->private_data;
+
+	lktrace_for_each_probe(m->private, lktrace_hist_clear_probe, NULL);
+	return size;
+}
+
+static struct file_operations lktrace_hist_fops = {
+	.open		=	lktrace_hist_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_hist_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	lktracefs_single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_hist_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"hist",
+						&lktrace_hist_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
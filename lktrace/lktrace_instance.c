@@ -0,0 +1,147 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
+#include <linux/kref.h>
+
+#include "lktrace.h"
+
+/*
+ * tracing instances. The top level one always exists and backs
+ * lktracefs root and debugfs lktrace/list, others are made by mkdir
+ * under lktracefs instances/.
+ */
+
+static LIST_HEAD(lktrace_instance_head);
+/* nests inside lktrace_probelist_mutex, see lktrace_budget.c */
+static DEFINE_MUTEX(lktrace_instance_mutex);
+
+struct lktrace_instance *lktrace_top_instance;
+
+static struct lktrace_instance *lktrace_instance_find(char const *name)
+{
+	struct lktrace_instance *inst;
+
+	list_for_each_entry(inst, &lktrace_instance_head, lki_list) {
+		if(strcmp(inst->lki_name, name) == 0) {
+			return inst;
+		}
+	}
+	return NULL;
+}
+
+struct lktrace_instance *lktrace_instance_create(char const *name)
+{
+	struct lktrace_instance *inst;
+
+	if(strlen(name) >= LKTRACE_FUNCNAME_MAXLEN) {
+		return ERR_PTR(-ENAMETOOLONG);
+	}
+
+	inst = kzalloc(sizeof(*inst), GFP_KERNEL);
+	if(inst == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	INIT_LIST_HEAD(&inst->lki_list);
+	INIT_LIST_HEAD(&inst->lki_probes);
+	INIT_LIST_HEAD(&inst->lki_switches);
+	INIT_LIST_HEAD(&inst->lki_pairs);
+	kref_init(&inst->lki_ref);
+	strscpy(inst->lki_name, name, sizeof(inst->lki_name));
+
+	inst->lki_buffer = lktrace_buffer_create();
+	if(inst->lki_buffer == NULL) {
+		kfree(inst);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	mutex_lock(&lktrace_instance_mutex);
+	if(lktrace_instance_find(name)) {
+		mutex_unlock(&lktrace_instance_mutex);
+		lktrace_buffer_destroy(inst->lki_buffer);
+		kfree(inst);
+		return ERR_PTR(-EEXIST);
+	}
+	list_add_tail(&inst->lki_list, &lktrace_instance_head);
+	mutex_unlock(&lktrace_instance_mutex);
+	return inst;
+}
+
+static void lktrace_instance_free(struct kref *ref)
+{
+	struct lktrace_instance *inst;
+
+	inst = container_of(ref, struct lktrace_instance, lki_ref);
+	/* again : a list file kept open past rmdir may have added some */
+	lktrace_preset_stop(inst);
+	lktrace_probe_remove(inst, "*", -1, NULL);
+
+	/* once probes are gone nothing reads buffer nor scope */
+	lktrace_scope_destroy(rcu_dereference_protected(inst->lki_scope, 1));
+	lktrace_buffer_destroy(inst->lki_buffer);
+	kfree(inst);
+}
+
+void lktrace_instance_get(struct lktrace_instance *inst)
+{
+	kref_get(&inst->lki_ref);
+}
+
+void lktrace_instance_put(struct lktrace_instance *inst)
+{
+	kref_put(&inst->lki_ref, lktrace_instance_free);
+}
+
+/*
+ * unlist inst and stop its probes now, the rest is freed once the
+ * last of its files is closed
+ */
+void lktrace_instance_destroy(struct lktrace_instance *inst)
+{
+	mutex_lock(&lktrace_instance_mutex);
+	list_del(&inst->lki_list);
+	mutex_unlock(&lktrace_instance_mutex);
+
+	lktrace_preset_stop(inst);
+	lktrace_probe_remove(inst, "*", -1, NULL);
+	lktrace_instance_put(inst);
+}
+
+int lktrace_for_each_instance(int (*fn)(struct lktrace_instance *, void *),
+			void *data)
+{
+	struct lktrace_instance *inst;
+	int ret = 0;
+
+	mutex_lock(&lktrace_instance_mutex);
+	list_for_each_entry(inst, &lktrace_instance_head, lki_list) {
+		ret = fn(inst, data);
+		if(ret) {
+			break;
+		}
+	}
+	mutex_unlock(&lktrace_instance_mutex);
+	return ret;
+}
+
+int lktrace_instance_init(void)
+{
+	struct lktrace_instance *top = lktrace_instance_create("");
+
+	if(IS_ERR(top)) {
+		return PTR_ERR(top);
+	}
+	lktrace_top_instance = top;
+	return 0;
+}
+
+void lktrace_instance_exit(void)
+{
+	struct lktrace_instance *inst, *tmp;
+
+	list_for_each_entry_safe(inst, tmp, &lktrace_instance_head, lki_list) {
+		lktrace_instance_destroy(inst);
+	}
+	lktrace_top_instance = NULL;
+}
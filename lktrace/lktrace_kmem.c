@@ -0,0 +1,282 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
+
+/*
+ * kmalloc call site preset. kmem:kmalloc adds the returned pointer to
+ * a live map with its call site, size and time, kmem:kfree takes it
+ * out. Per call site we keep allocations, matched frees, allocated
+ * bytes and outstanding bytes. Frees of objects allocated before the
+ * preset started, or dropped because the live map was full, are not
+ * counted. A pointer coming back from kmalloc while still live was
+ * freed behind our back (e.g. bulk frees), it is counted freed then.
+ * Live objects older than LKTRACE_KMEM_OLD_SEC are leak suspects,
+ * grouped by call site when the preset file is read.
+ */
+
+#define LKTRACE_KMEM_TOP	(20)
+#define LKTRACE_KMEM_OLD_SEC	(30)
+
+/* ptr -> call site, size, alloc time */
+enum {
+	LKTRACE_KMEM_SITE,
+	LKTRACE_KMEM_SIZE,
+	LKTRACE_KMEM_TS,
+};
+static struct lktrace_map *lktrace_kmem_live;
+
+/*
+ * call site -> allocations, frees, bytes, outstanding bytes
+ * as leak suspects : objects, -, bytes, oldest alloc time
+ */
+enum {
+	LKTRACE_KMEM_ALLOCS,
+	LKTRACE_KMEM_FREES,
+	LKTRACE_KMEM_BYTES,
+	LKTRACE_KMEM_OUT,
+};
+static struct lktrace_map *lktrace_kmem_sites;
+
+/* start of the tables, for rates */
+static u64 lktrace_kmem_since;
+
+static char const *const lktrace_kmem_probes[] = {
+	/* covers kmalloc_node too since 6.1 */
+	"tp:kmem:kmalloc lktrace_kmem_alloc",
+	"tp:kmem:kfree lktrace_kmem_free",
+	NULL,
+};
+
+static void lktrace_kmem_freed(unsigned long site, unsigned long size)
+{
+	struct lktrace_map_ent *e;
+	unsigned long flags;
+
+	e = lktrace_map_lock(lktrace_kmem_sites, site, 0, false, &flags);
+	if(e) {
+		e->lkme_val[LKTRACE_KMEM_FREES]++;
+		e->lkme_val[LKTRACE_KMEM_OUT] -= size;
+		lktrace_map_unlock(lktrace_kmem_sites, e, flags);
+	}
+}
+
+/* kmalloc(call_site, ptr, bytes_req, bytes_alloc, gfp_flags, node) handler */
+int lktrace_kmem_alloc(struct kprobe *kp, struct pt_regs *regs)
+{
+	unsigned long site = lktrace_fetch_arg(regs, 1);
+	unsigned long ptr  = lktrace_fetch_arg(regs, 2);
+	unsigned long size = lktrace_fetch_arg(regs, 4);
+	unsigned long flags, oldsite = 0, oldsize = 0;
+	struct lktrace_map_ent *e;
+	bool live = false;
+
+	if(ZERO_OR_NULL_PTR((void *)ptr)) {
+		return 0;
+	}
+
+	e = lktrace_map_lock(lktrace_kmem_live, ptr, 0, true, &flags);
+	if(e) {
+		if(e->lkme_val[LKTRACE_KMEM_TS]) {
+			oldsite = e->lkme_val[LKTRACE_KMEM_SITE];
+			oldsize = e->lkme_val[LKTRACE_KMEM_SIZE];
+		}
+		e->lkme_val[LKTRACE_KMEM_SITE] = site;
+		e->lkme_val[LKTRACE_KMEM_SIZE] = size;
+		e->lkme_val[LKTRACE_KMEM_TS]   = local_clock();
+		lktrace_map_unlock(lktrace_kmem_live, e, flags);
+		live = true;
+	}
+	if(oldsite) {
+		lktrace_kmem_freed(oldsite, oldsize);
+	}
+
+	e = lktrace_map_lock(lktrace_kmem_sites, site, 0, true, &flags);
+	if(e == NULL) {
+		return 0;
+	}
+	e->lkme_val[LKTRACE_KMEM_ALLOCS]++;
+	e->lkme_val[LKTRACE_KMEM_BYTES] += size;
+	/* only objects we can match a free to are outstanding */
+	if(live) {
+		e->lkme_val[LKTRACE_KMEM_OUT] += size;
+	}
+	lktrace_map_unlock(lktrace_kmem_sites, e, flags);
+	return 0;
+}
+
+/* kfree(call_site, ptr) handler */
+int lktrace_kmem_free(struct kprobe *kp, struct pt_regs *regs)
+{
+	unsigned long ptr = lktrace_fetch_arg(regs, 2);
+	struct lktrace_map_ent *e;
+	unsigned long flags, site, size;
+
+	e = lktrace_map_lock(lktrace_kmem_live, ptr, 0, false, &flags);
+	if(e == NULL) {
+		return 0;
+	}
+	site = e->lkme_val[LKTRACE_KMEM_SITE];
+	size = e->lkme_val[LKTRACE_KMEM_SIZE];
+	lktrace_map_delete(lktrace_kmem_live, e, flags);
+	lktrace_kmem_freed(site, size);
+	return 0;
+}
+
+static void lktrace_kmem_stop(void)
+{
+	lktrace_map_destroy(lktrace_kmem_live);
+	lktrace_map_destroy(lktrace_kmem_sites);
+	lktrace_kmem_live  = NULL;
+	lktrace_kmem_sites = NULL;
+}
+
+static int lktrace_kmem_start(void)
+{
+	lktrace_kmem_live  = lktrace_map_create(9);
+	lktrace_kmem_sites = lktrace_map_create(6);
+	if(lktrace_kmem_live == NULL || lktrace_kmem_sites == NULL) {
+		lktrace_kmem_stop();
+		return -ENOMEM;
+	}
+	lktrace_kmem_since = local_clock();
+	return 0;
+}
+
+static void lktrace_kmem_clear(void)
+{
+	lktrace_map_clear(lktrace_kmem_live);
+	lktrace_map_clear(lktrace_kmem_sites);
+	lktrace_kmem_since = local_clock();
+}
+
+static int lktrace_kmem_cmp_site(void const *a, void const *b)
+{
+	u64 sa = ((struct lktrace_map_ent const *)a)->lkme_key[0];
+	u64 sb = ((struct lktrace_map_ent const *)b)->lkme_key[0];
+
+	return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
+static int lktrace_kmem_cmp_allocs(void const *a, void const *b)
+{
+	u64 ca = ((struct lktrace_map_ent const *)a)->lkme_val[0];
+	u64 cb = ((struct lktrace_map_ent const *)b)->lkme_val[0];
+
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static int lktrace_kmem_cmp_bytes(void const *a, void const *b)
+{
+	u64 ba = ((struct lktrace_map_ent const *)a)->lkme_val[2];
+	u64 bb = ((struct lktrace_map_ent const *)b)->lkme_val[2];
+
+	return ba < bb ? 1 : ba > bb ? -1 : 0;
+}
+
+/*
+ * live objects older than LKTRACE_KMEM_OLD_SEC folded per call site,
+ * in place at the start of live. Returns the number of sites.
+ */
+static size_t lktrace_kmem_suspects(struct lktrace_map_ent *live, size_t n,
+				u64 now)
+{
+	u64 old = (u64)LKTRACE_KMEM_OLD_SEC * NSEC_PER_SEC;
+	struct lktrace_map_ent *s;
+	size_t i, ns = 0;
+	u64 ts;
+
+	for(i = 0; i < n; ++i) {
+		ts = live[i].lkme_val[LKTRACE_KMEM_TS];
+		if(now - ts < old) {
+			continue;
+		}
+		live[ns].lkme_key[0] = live[i].lkme_val[LKTRACE_KMEM_SITE];
+		live[ns].lkme_val[LKTRACE_KMEM_ALLOCS] = 1;
+		live[ns].lkme_val[LKTRACE_KMEM_FREES]  = 0;
+		live[ns].lkme_val[LKTRACE_KMEM_BYTES]  =
+				live[i].lkme_val[LKTRACE_KMEM_SIZE];
+		live[ns].lkme_val[LKTRACE_KMEM_OUT]    = ts;
+		ns++;
+	}
+	sort(live, ns, sizeof(*live), lktrace_kmem_cmp_site, NULL);
+	for(i = 0, n = 0; i < ns; ++i) {
+		s = n ? &live[n - 1] : NULL;
+		if(s && s->lkme_key[0] == live[i].lkme_key[0]) {
+			s->lkme_val[LKTRACE_KMEM_ALLOCS]++;
+			s->lkme_val[LKTRACE_KMEM_BYTES] +=
+				live[i].lkme_val[LKTRACE_KMEM_BYTES];
+			s->lkme_val[LKTRACE_KMEM_OUT] =
+				min(s->lkme_val[LKTRACE_KMEM_OUT],
+				    live[i].lkme_val[LKTRACE_KMEM_OUT]);
+		} else {
+			live[n++] = live[i];
+		}
+	}
+	sort(live, n, sizeof(*live), lktrace_kmem_cmp_bytes, NULL);
+	return n;
+}
+
+static void lktrace_kmem_show(struct seq_file *m)
+{
+	struct lktrace_map_ent *sites, *live, *e;
+	size_t nsites, nlive, i;
+	u64 now = local_clock();
+	u64 secs = max_t(u64, div_u64(now - lktrace_kmem_since,
+						NSEC_PER_SEC), 1);
+
+	nsites = lktrace_map_collect(lktrace_kmem_sites, &sites);
+	nlive  = lktrace_map_collect(lktrace_kmem_live, &live);
+	seq_printf(m, "elapsed %llus live %zu dropped %lu\n", secs, nlive,
+			lktrace_map_dropped(lktrace_kmem_sites) +
+			lktrace_map_dropped(lktrace_kmem_live));
+	if(sites == NULL || live == NULL) {
+		goto end_show;
+	}
+
+	sort(sites, nsites, sizeof(*sites), lktrace_kmem_cmp_allocs, NULL);
+	seq_printf(m, "\nallocators\n%10s %12s %10s %14s  %s\n", "allocs/s",
+			"bytes/s", "live", "outstanding", "call site");
+	for(i = 0; i < nsites && i < LKTRACE_KMEM_TOP; ++i) {
+		e = &sites[i];
+		seq_printf(m, "%10llu %12llu %10llu %14lld  %pS\n",
+			div64_u64(e->lkme_val[LKTRACE_KMEM_ALLOCS], secs),
+			div64_u64(e->lkme_val[LKTRACE_KMEM_BYTES], secs),
+			e->lkme_val[LKTRACE_KMEM_ALLOCS] -
+				e->lkme_val[LKTRACE_KMEM_FREES],
+			(s64)e->lkme_val[LKTRACE_KMEM_OUT],
+			(void *)e->lkme_key[0]);
+	}
+
+	nlive = lktrace_kmem_suspects(live, nlive, now);
+	seq_printf(m, "\nleak suspects, live for more than %us\n"
+			"%10s %14s %10s  %s\n", LKTRACE_KMEM_OLD_SEC,
+			"objects", "bytes", "oldest_s", "call site");
+	for(i = 0; i < nlive && i < LKTRACE_KMEM_TOP; ++i) {
+		e = &live[i];
+		seq_printf(m, "%10llu %14llu %10llu  %pS\n",
+			e->lkme_val[LKTRACE_KMEM_ALLOCS],
+			e->lkme_val[LKTRACE_KMEM_BYTES],
+			div_u64(now - e->lkme_val[LKTRACE_KMEM_OUT],
+							NSEC_PER_SEC),
+			(void *)e->lkme_key[0]);
+	}
+
+end_show:
+	vfree(live);
+	vfree(sites);
+}
+
+struct lktrace_preset lktrace_kmem_preset = {
+	.lkps_name	= "kmem",
+	.lkps_probes	= lktrace_kmem_probes,
+	.lkps_start	= lktrace_kmem_start,
+	.lkps_stop	= lktrace_kmem_stop,
+	.lkps_clear	= lktrace_kmem_clear,
+	.lkps_show	= lktrace_kmem_show,
+};
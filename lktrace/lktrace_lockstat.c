@@ -0,0 +1,297 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/sched.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
+
+/*
+ * lock contention preset. The lock:contention_begin and
+ * lock:contention_end tracepoints wrap the slow paths of mutexes,
+ * rwsems and queued spinlocks; the time between them is the wait.
+ * It is added to the lock, to a log2 histogram of the lock and to
+ * the acquiring call site, which is the interned stack at begin.
+ * A mutex may report contention_begin twice, spinning on the owner
+ * then going to sleep : the wait starts at the first one.
+ *
+ * Our own map locks may contend too : a per cpu flag keeps handlers
+ * from running inside themselves.
+ */
+
+#define LKTRACE_LOCK_TOP	(15)
+#define LKTRACE_LOCK_BARLEN	(30)
+
+/* contention_begin flags, include/trace/events/lock.h */
+#define LKTRACE_LCB_F_SPIN	(1U << 0)
+#define LKTRACE_LCB_F_READ	(1U << 1)
+#define LKTRACE_LCB_F_WRITE	(1U << 2)
+#define LKTRACE_LCB_F_MUTEX	(1U << 5)
+
+/* (task, lock) -> begin time, stack id, flags */
+enum {
+	LKTRACE_LOCK_TS,
+	LKTRACE_LOCK_STACK,
+	LKTRACE_LOCK_FLAGS,
+};
+static struct lktrace_map *lktrace_lock_waits;
+
+/*
+ * (lock, 0) -> wait ns, count, longest wait, flags
+ * (stack id, 0) -> wait ns, count, longest wait, last lock
+ */
+enum {
+	LKTRACE_LOCK_WAIT,
+	LKTRACE_LOCK_COUNT,
+	LKTRACE_LOCK_MAX,
+	LKTRACE_LOCK_INFO,
+};
+static struct lktrace_map *lktrace_lock_locks;
+static struct lktrace_map *lktrace_lock_sites;
+
+/* (lock, log2 slot) -> count */
+static struct lktrace_map *lktrace_lock_hists;
+
+static struct lktrace_stackmap *lktrace_lock_stacks;
+
+static DEFINE_PER_CPU(int, lktrace_lock_busy);
+
+static char const *const lktrace_lock_probes[] = {
+	"tp:lock:contention_begin lktrace_lock_begin",
+	"tp:lock:contention_end lktrace_lock_end",
+	NULL,
+};
+
+static void lktrace_lock_add(struct lktrace_map *map, unsigned long key,
+			u64 wait, u64 info)
+{
+	struct lktrace_map_ent *e;
+	unsigned long flags;
+
+	e = lktrace_map_lock(map, key, 0, true, &flags);
+	if(e == NULL) {
+		return;
+	}
+	e->lkme_val[LKTRACE_LOCK_WAIT] += wait;
+	e->lkme_val[LKTRACE_LOCK_COUNT]++;
+	e->lkme_val[LKTRACE_LOCK_MAX] = max(e->lkme_val[LKTRACE_LOCK_MAX],
+									wait);
+	e->lkme_val[LKTRACE_LOCK_INFO] = info;
+	lktrace_map_unlock(map, e, flags);
+}
+
+/* contention_begin(lock, flags) handler */
+int lktrace_lock_begin(struct kprobe *kp, struct pt_regs *regs)
+{
+	unsigned long lock = lktrace_fetch_arg(regs, 1);
+	struct lktrace_map_ent *e;
+	unsigned long flags;
+	u32 id;
+
+	if(this_cpu_read(lktrace_lock_busy)) {
+		return 0;
+	}
+	this_cpu_write(lktrace_lock_busy, 1);
+	id = lktrace_stackmap_get(lktrace_lock_stacks, NULL);
+	e  = lktrace_map_lock(lktrace_lock_waits, (unsigned long)current, lock,
+							true, &flags);
+	if(e) {
+		if(e->lkme_val[LKTRACE_LOCK_TS] == 0) {
+			e->lkme_val[LKTRACE_LOCK_TS]    = local_clock();
+			e->lkme_val[LKTRACE_LOCK_STACK] = id;
+		}
+		e->lkme_val[LKTRACE_LOCK_FLAGS] |= lktrace_fetch_arg(regs, 2);
+		lktrace_map_unlock(lktrace_lock_waits, e, flags);
+	}
+	this_cpu_write(lktrace_lock_busy, 0);
+	return 0;
+}
+
+/* contention_end(lock, ret) handler */
+int lktrace_lock_end(struct kprobe *kp, struct pt_regs *regs)
+{
+	unsigned long lock = lktrace_fetch_arg(regs, 1);
+	struct lktrace_map_ent *e, w;
+	unsigned long flags, slot;
+	u64 wait;
+
+	if(this_cpu_read(lktrace_lock_busy)) {
+		return 0;
+	}
+	this_cpu_write(lktrace_lock_busy, 1);
+	e = lktrace_map_lock(lktrace_lock_waits, (unsigned long)current, lock,
+							false, &flags);
+	if(e == NULL) {
+		goto end;
+	}
+	w = *e;
+	lktrace_map_delete(lktrace_lock_waits, e, flags);
+
+	wait = local_clock() - w.lkme_val[LKTRACE_LOCK_TS];
+	lktrace_lock_add(lktrace_lock_locks, lock, wait,
+				w.lkme_val[LKTRACE_LOCK_FLAGS]);
+	lktrace_lock_add(lktrace_lock_sites, w.lkme_val[LKTRACE_LOCK_STACK],
+				wait, lock);
+
+	slot = wait ? ilog2(wait) + 1 : 0;
+	e = lktrace_map_lock(lktrace_lock_hists, lock, slot, true, &flags);
+	if(e) {
+		e->lkme_val[0]++;
+		lktrace_map_unlock(lktrace_lock_hists, e, flags);
+	}
+end:
+	this_cpu_write(lktrace_lock_busy, 0);
+	return 0;
+}
+
+static void lktrace_lock_stop(void)
+{
+	lktrace_map_destroy(lktrace_lock_waits);
+	lktrace_map_destroy(lktrace_lock_locks);
+	lktrace_map_destroy(lktrace_lock_sites);
+	lktrace_map_destroy(lktrace_lock_hists);
+	lktrace_stackmap_destroy(lktrace_lock_stacks);
+	lktrace_lock_waits  = NULL;
+	lktrace_lock_locks  = NULL;
+	lktrace_lock_sites  = NULL;
+	lktrace_lock_hists  = NULL;
+	lktrace_lock_stacks = NULL;
+}
+
+static int lktrace_lock_start(void)
+{
+	lktrace_lock_waits  = lktrace_map_create(6);
+	lktrace_lock_locks  = lktrace_map_create(6);
+	lktrace_lock_sites  = lktrace_map_create(6);
+	lktrace_lock_hists  = lktrace_map_create(8);
+	lktrace_lock_stacks = lktrace_stackmap_create(6);
+	if(lktrace_lock_waits == NULL || lktrace_lock_locks == NULL ||
+	   lktrace_lock_sites == NULL || lktrace_lock_hists == NULL ||
+	   lktrace_lock_stacks == NULL) {
+		lktrace_lock_stop();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void lktrace_lock_clear(void)
+{
+	lktrace_map_clear(lktrace_lock_waits);
+	lktrace_map_clear(lktrace_lock_locks);
+	lktrace_map_clear(lktrace_lock_sites);
+	lktrace_map_clear(lktrace_lock_hists);
+	lktrace_stackmap_clear(lktrace_lock_stacks);
+}
+
+static int lktrace_lock_cmp_wait(void const *a, void const *b)
+{
+	u64 wa = ((struct lktrace_map_ent const *)a)->lkme_val[0];
+	u64 wb = ((struct lktrace_map_ent const *)b)->lkme_val[0];
+
+	return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+static char const *lktrace_lock_type(unsigned long flags)
+{
+	if(flags & LKTRACE_LCB_F_MUTEX) {
+		return "mutex";
+	}
+	if(flags & (LKTRACE_LCB_F_READ | LKTRACE_LCB_F_WRITE)) {
+		return flags & LKTRACE_LCB_F_SPIN ? "rwlock" : "rwsem";
+	}
+	return flags & LKTRACE_LCB_F_SPIN ? "spinlock" : "other";
+}
+
+/* log2 wait histogram of one lock, hist entries of every lock */
+static void lktrace_lock_show_hist(struct seq_file *m, unsigned long lock,
+				struct lktrace_map_ent const *hist,
+				size_t nhist)
+{
+	static char const bar[] = "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@";
+	u64 slot[BITS_PER_LONG + 1] = { 0 }, maxcount = 0;
+	unsigned int i, first = BITS_PER_LONG + 1, last = 0;
+	size_t j;
+	int len;
+
+	for(j = 0; j < nhist; ++j) {
+		if(hist[j].lkme_key[0] != lock ||
+		   hist[j].lkme_key[1] > BITS_PER_LONG) {
+			continue;
+		}
+		i = hist[j].lkme_key[1];
+		slot[i] = hist[j].lkme_val[0];
+		first = min(first, i);
+		last  = max(last, i);
+		maxcount = max(maxcount, slot[i]);
+	}
+	for(i = first; i <= last && maxcount; ++i) {
+		len = div64_u64(slot[i] * LKTRACE_LOCK_BARLEN, maxcount);
+		seq_printf(m, "\t\t%12lu ns %10llu |%.*s%*s|\n",
+				i ? 1UL << (i - 1) : 0UL, slot[i],
+				len, bar, LKTRACE_LOCK_BARLEN - len, "");
+	}
+}
+
+static void lktrace_lock_show(struct seq_file *m)
+{
+	struct lktrace_map_ent *locks, *sites, *hist;
+	size_t nlocks, nsites, nhist, i;
+	struct lktrace_map_ent const *e;
+
+	nlocks = lktrace_map_collect(lktrace_lock_locks, &locks);
+	nsites = lktrace_map_collect(lktrace_lock_sites, &sites);
+	nhist  = lktrace_map_collect(lktrace_lock_hists, &hist);
+	seq_printf(m, "dropped %lu\n",
+			lktrace_map_dropped(lktrace_lock_waits) +
+			lktrace_map_dropped(lktrace_lock_locks) +
+			lktrace_map_dropped(lktrace_lock_sites) +
+			lktrace_map_dropped(lktrace_lock_hists));
+	if(locks == NULL || sites == NULL || hist == NULL) {
+		goto end_show;
+	}
+
+	sort(locks, nlocks, sizeof(*locks), lktrace_lock_cmp_wait, NULL);
+	seq_printf(m, "\nlocks\n%-40s %-8s %12s %8s %12s\n", "lock", "type",
+			"wait_us", "count", "max_us");
+	for(i = 0; i < nlocks && i < LKTRACE_LOCK_TOP; ++i) {
+		e = &locks[i];
+		seq_printf(m, "%-40pS %-8s %12llu %8llu %12llu\n",
+			(void *)e->lkme_key[0],
+			lktrace_lock_type(e->lkme_val[LKTRACE_LOCK_INFO]),
+			div_u64(e->lkme_val[LKTRACE_LOCK_WAIT], 1000),
+			e->lkme_val[LKTRACE_LOCK_COUNT],
+			div_u64(e->lkme_val[LKTRACE_LOCK_MAX], 1000));
+		lktrace_lock_show_hist(m, e->lkme_key[0], hist, nhist);
+	}
+
+	sort(sites, nsites, sizeof(*sites), lktrace_lock_cmp_wait, NULL);
+	seq_printf(m, "\ncall sites\n%12s %8s %12s %s\n", "wait_us", "count",
+			"max_us", "last lock");
+	for(i = 0; i < nsites && i < LKTRACE_LOCK_TOP; ++i) {
+		e = &sites[i];
+		seq_printf(m, "%12llu %8llu %12llu %pS\n",
+			div_u64(e->lkme_val[LKTRACE_LOCK_WAIT], 1000),
+			e->lkme_val[LKTRACE_LOCK_COUNT],
+			div_u64(e->lkme_val[LKTRACE_LOCK_MAX], 1000),
+			(void *)(unsigned long)e->lkme_val[LKTRACE_LOCK_INFO]);
+		lktrace_stackmap_show(m, lktrace_lock_stacks, e->lkme_key[0]);
+	}
+
+end_show:
+	vfree(hist);
+	vfree(sites);
+	vfree(locks);
+}
+
+struct lktrace_preset lktrace_lock_preset = {
+	.lkps_name	= "locks",
+	.lkps_probes	= lktrace_lock_probes,
+	.lkps_start	= lktrace_lock_start,
+	.lkps_stop	= lktrace_lock_stop,
+	.lkps_clear	= lktrace_lock_clear,
+	.lkps_show	= lktrace_lock_show,
+};
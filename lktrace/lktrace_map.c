@@ -0,0 +1,386 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/stacktrace.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
+
+/*
+ * aggregation maps for analysis presets, usable from probe context.
+ * Same layout as latency pairs : preallocated shards picked by key
+ * hash, each made of 8 way buckets under a raw spinlock. An insert in
+ * a full bucket fails and is counted as dropped, nothing is evicted.
+ *
+ * Stack maps intern kernel stacks and hand out small ids, so per
+ * stack aggregates only store an id. Stacks are never freed before
+ * the map is cleared.
+ */
+
+#define LKTRACE_MAP_WAYS	(8)
+
+struct lktrace_map_shard {
+	raw_spinlock_t		lkms_lock;
+	unsigned long		lkms_dropped;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * @lkm_shift	: log2 of shard count
+ * @lkm_bbits	: log2 of buckets per shard
+ * @lkm_shards	: locks and drop counts
+ * @lkm_ents	: shard after shard, bucket after bucket
+ */
+struct lktrace_map {
+	unsigned int		lkm_shift;
+	unsigned int		lkm_bbits;
+	struct lktrace_map_shard *lkm_shards;
+	struct lktrace_map_ent	*lkm_ents;
+};
+
+static unsigned int lktrace_map_nshards(void)
+{
+	return roundup_pow_of_two(num_possible_cpus());
+}
+
+/* 2^bbits buckets of LKTRACE_MAP_WAYS entries in each shard */
+struct lktrace_map *lktrace_map_create(unsigned int bbits)
+{
+	struct lktrace_map *m = kzalloc(sizeof(*m), GFP_KERNEL);
+	unsigned int i, nshards = lktrace_map_nshards();
+
+	if(m == NULL) {
+		return NULL;
+	}
+	m->lkm_shift  = ilog2(nshards);
+	m->lkm_bbits  = bbits;
+	m->lkm_shards = vzalloc(nshards * sizeof(*m->lkm_shards));
+	m->lkm_ents   = vzalloc((size_t)nshards * LKTRACE_MAP_WAYS *
+				(1 << bbits) * sizeof(*m->lkm_ents));
+	if(m->lkm_shards == NULL || m->lkm_ents == NULL) {
+		lktrace_map_destroy(m);
+		return NULL;
+	}
+	for(i = 0; i < nshards; ++i) {
+		raw_spin_lock_init(&m->lkm_shards[i].lkms_lock);
+	}
+	return m;
+}
+
+void lktrace_map_destroy(struct lktrace_map *m)
+{
+	if(m == NULL) {
+		return;
+	}
+	vfree(m->lkm_ents);
+	vfree(m->lkm_shards);
+	kfree(m);
+}
+
+static size_t lktrace_map_shard_size(struct lktrace_map const *m)
+{
+	return (size_t)LKTRACE_MAP_WAYS << m->lkm_bbits;
+}
+
+static struct lktrace_map_shard *lktrace_map_shard_of(struct lktrace_map *m,
+					struct lktrace_map_ent const *e)
+{
+	return &m->lkm_shards[(e - m->lkm_ents) / lktrace_map_shard_size(m)];
+}
+
+void lktrace_map_clear(struct lktrace_map *m)
+{
+	struct lktrace_map_shard *sh;
+	size_t per = lktrace_map_shard_size(m);
+	unsigned long flags;
+	unsigned int i;
+
+	for(i = 0; i < (1U << m->lkm_shift); ++i) {
+		sh = &m->lkm_shards[i];
+		raw_spin_lock_irqsave(&sh->lkms_lock, flags);
+		memset(&m->lkm_ents[i * per], 0, per * sizeof(*m->lkm_ents));
+		sh->lkms_dropped = 0;
+		raw_spin_unlock_irqrestore(&sh->lkms_lock, flags);
+	}
+}
+
+/*
+ * probe context. Returns the entry of (k0, k1) with its shard locked,
+ * inserted zeroed if missing and create is set. NULL if not found or
+ * bucket full, the shard is then unlocked.
+ */
+struct lktrace_map_ent *lktrace_map_lock(struct lktrace_map *m,
+					unsigned long k0,
+					unsigned long k1,
+					bool create,
+					unsigned long *flags)
+{
+	u32 h = hash_long(k0 ^ hash_long(k1, BITS_PER_LONG), 32);
+	unsigned int s = h & ((1U << m->lkm_shift) - 1);
+	unsigned int b = (h >> m->lkm_shift) & ((1U << m->lkm_bbits) - 1);
+	struct lktrace_map_shard *sh = &m->lkm_shards[s];
+	struct lktrace_map_ent *e, *free = NULL;
+	unsigned int i;
+
+	e = &m->lkm_ents[s * lktrace_map_shard_size(m) + b * LKTRACE_MAP_WAYS];
+	raw_spin_lock_irqsave(&sh->lkms_lock, *flags);
+	for(i = 0; i < LKTRACE_MAP_WAYS; ++i) {
+		if(!e[i].lkme_used) {
+			free = free ? free : &e[i];
+			continue;
+		}
+		if(e[i].lkme_key[0] == k0 && e[i].lkme_key[1] == k1) {
+			return &e[i];
+		}
+	}
+	if(create && free) {
+		memset(free, 0, sizeof(*free));
+		free->lkme_key[0] = k0;
+		free->lkme_key[1] = k1;
+		free->lkme_used   = 1;
+		return free;
+	}
+	if(create) {
+		sh->lkms_dropped++;
+	}
+	raw_spin_unlock_irqrestore(&sh->lkms_lock, *flags);
+	return NULL;
+}
+
+void lktrace_map_unlock(struct lktrace_map *m, struct lktrace_map_ent *e,
+			unsigned long flags)
+{
+	raw_spin_unlock_irqrestore(&lktrace_map_shard_of(m, e)->lkms_lock,
+									flags);
+}
+
+/* frees a locked entry and unlocks its shard */
+void lktrace_map_delete(struct lktrace_map *m, struct lktrace_map_ent *e,
+			unsigned long flags)
+{
+	e->lkme_used = 0;
+	lktrace_map_unlock(m, e, flags);
+}
+
+/* copy of every used entry in a vmalloc'ed *out, to vfree */
+size_t lktrace_map_collect(struct lktrace_map *m, struct lktrace_map_ent **out)
+{
+	struct lktrace_map_shard *sh;
+	struct lktrace_map_ent *all, *e;
+	size_t per = lktrace_map_shard_size(m), n = 0, j;
+	unsigned long flags;
+	unsigned int i;
+
+	all = vmalloc((per << m->lkm_shift) * sizeof(*all));
+	*out = all;
+	if(all == NULL) {
+		return 0;
+	}
+	for(i = 0; i < (1U << m->lkm_shift); ++i) {
+		sh = &m->lkm_shards[i];
+		e  = &m->lkm_ents[i * per];
+		raw_spin_lock_irqsave(&sh->lkms_lock, flags);
+		for(j = 0; j < per; ++j) {
+			if(e[j].lkme_used) {
+				all[n++] = e[j];
+			}
+		}
+		raw_spin_unlock_irqrestore(&sh->lkms_lock, flags);
+	}
+	return n;
+}
+
+unsigned long lktrace_map_dropped(struct lktrace_map *m)
+{
+	unsigned long dropped = 0;
+	unsigned int i;
+
+	for(i = 0; i < (1U << m->lkm_shift); ++i) {
+		dropped += READ_ONCE(m->lkm_shards[i].lkms_dropped);
+	}
+	return dropped;
+}
+
+/*------------------ stack maps -----------------------------------*/
+
+/* lkst_nr is set last, an entry with lkst_nr 0 is free */
+struct lktrace_stack {
+	u32		lkst_hash;
+	u32		lkst_nr;
+	unsigned long	lkst_ip[LKTRACE_STACK_DEPTH];
+};
+
+/*
+ * @lksm_shift	: log2 of shard count
+ * @lksm_bbits	: log2 of buckets per shard
+ * @lksm_shards	: locks and drop counts
+ * @lksm_stacks	: id N is lksm_stacks[N - 1]
+ */
+struct lktrace_stackmap {
+	unsigned int		lksm_shift;
+	unsigned int		lksm_bbits;
+	struct lktrace_map_shard *lksm_shards;
+	struct lktrace_stack	*lksm_stacks;
+};
+
+struct lktrace_stackmap *lktrace_stackmap_create(unsigned int bbits)
+{
+	struct lktrace_stackmap *sm = kzalloc(sizeof(*sm), GFP_KERNEL);
+	unsigned int i, nshards = lktrace_map_nshards();
+
+	if(sm == NULL) {
+		return NULL;
+	}
+	/* stacks from regs come out empty without it */
+	lktrace_stack_init();
+	sm->lksm_shift  = ilog2(nshards);
+	sm->lksm_bbits  = bbits;
+	sm->lksm_shards = vzalloc(nshards * sizeof(*sm->lksm_shards));
+	sm->lksm_stacks = vzalloc((size_t)nshards * LKTRACE_MAP_WAYS *
+				(1 << bbits) * sizeof(*sm->lksm_stacks));
+	if(sm->lksm_shards == NULL || sm->lksm_stacks == NULL) {
+		lktrace_stackmap_destroy(sm);
+		return NULL;
+	}
+	for(i = 0; i < nshards; ++i) {
+		raw_spin_lock_init(&sm->lksm_shards[i].lkms_lock);
+	}
+	return sm;
+}
+
+void lktrace_stackmap_destroy(struct lktrace_stackmap *sm)
+{
+	if(sm == NULL) {
+		return;
+	}
+	vfree(sm->lksm_stacks);
+	vfree(sm->lksm_shards);
+	kfree(sm);
+}
+
+/* ids handed out before are stale afterwards */
+void lktrace_stackmap_clear(struct lktrace_stackmap *sm)
+{
+	size_t per = (size_t)LKTRACE_MAP_WAYS << sm->lksm_bbits;
+	struct lktrace_map_shard *sh;
+	unsigned long flags;
+	unsigned int i;
+
+	for(i = 0; i < (1U << sm->lksm_shift); ++i) {
+		sh = &sm->lksm_shards[i];
+		raw_spin_lock_irqsave(&sh->lkms_lock, flags);
+		memset(&sm->lksm_stacks[i * per], 0,
+				per * sizeof(*sm->lksm_stacks));
+		sh->lkms_dropped = 0;
+		raw_spin_unlock_irqrestore(&sh->lkms_lock, flags);
+	}
+}
+
+/* stack_trace_save_regs is not exported, see lktrace_stack_init */
+static unsigned int (*lktrace_stack_save_regs)(struct pt_regs *,
+				unsigned long *, unsigned int, unsigned int);
+
+/* process context, before any stack is taken from regs */
+int lktrace_stack_init(void)
+{
+	if(lktrace_stack_save_regs == NULL) {
+		lktrace_stack_save_regs = (void *)
+			lktrace_lookup_name("stack_trace_save_regs");
+	}
+	return lktrace_stack_save_regs ? 0 : -ENOSYS;
+}
+
+/*
+ * the stack seen by a probe : from regs when they come from a real
+ * trap, else from here with our own frames left out. At most max
+ * entries, max <= LKTRACE_STACK_DEPTH.
+ */
+unsigned int lktrace_stack_save(unsigned long *ip, unsigned int max,
+				struct pt_regs *regs)
+{
+	unsigned long self[LKTRACE_STACK_DEPTH + 8];
+	unsigned int i, nr;
+
+	if(regs) {
+		return lktrace_stack_save_regs ?
+			lktrace_stack_save_regs(regs, ip, max, 0) : 0;
+	}
+	nr = stack_trace_save(self, ARRAY_SIZE(self), 0);
+	i = 0;
+	while(i < nr && __module_text_address(self[i]) == THIS_MODULE) {
+		++i;
+	}
+	nr = min(nr - i, max);
+	memcpy(ip, self + i, nr * sizeof(*ip));
+	return nr;
+}
+
+/*
+ * probe context, preemption disabled. Id of the current stack, or of
+ * the one at regs, 0 if it could not be stored.
+ */
+u32 lktrace_stackmap_get(struct lktrace_stackmap *sm, struct pt_regs *regs)
+{
+	unsigned long ip[LKTRACE_STACK_DEPTH];
+	unsigned int nr = lktrace_stack_save(ip, LKTRACE_STACK_DEPTH, regs);
+	u32 h = jhash(ip, nr * sizeof(ip[0]), nr);
+	unsigned int s = h & ((1U << sm->lksm_shift) - 1);
+	unsigned int b = (h >> sm->lksm_shift) & ((1U << sm->lksm_bbits) - 1);
+	struct lktrace_map_shard *sh = &sm->lksm_shards[s];
+	struct lktrace_stack *st;
+	unsigned long flags;
+	size_t base;
+	u32 id = 0;
+	unsigned int i;
+
+	if(nr == 0) {
+		return 0;
+	}
+	base = (((size_t)s << sm->lksm_bbits) + b) * LKTRACE_MAP_WAYS;
+	st   = &sm->lksm_stacks[base];
+
+	raw_spin_lock_irqsave(&sh->lkms_lock, flags);
+	for(i = 0; i < LKTRACE_MAP_WAYS; ++i) {
+		if(st[i].lkst_nr == 0) {
+			st[i].lkst_hash = h;
+			memcpy(st[i].lkst_ip, ip, nr * sizeof(ip[0]));
+			smp_wmb();
+			st[i].lkst_nr = nr;
+			id = base + i + 1;
+			break;
+		}
+		if(st[i].lkst_hash == h && st[i].lkst_nr == nr &&
+		   memcmp(st[i].lkst_ip, ip, nr * sizeof(ip[0])) == 0) {
+			id = base + i + 1;
+			break;
+		}
+	}
+	if(id == 0) {
+		sh->lkms_dropped++;
+	}
+	raw_spin_unlock_irqrestore(&sh->lkms_lock, flags);
+	return id;
+}
+
+/* one "<indent>sym+off/size" line per frame */
+void lktrace_stackmap_show(struct seq_file *m, struct lktrace_stackmap *sm,
+			u32 id)
+{
+	struct lktrace_stack *st;
+	unsigned int i, nr;
+
+	if(id == 0) {
+		seq_printf(m, "\t\t<lost>\n");
+		return;
+	}
+	st = &sm->lksm_stacks[id - 1];
+	nr = READ_ONCE(st->lkst_nr);
+	smp_rmb();
+	for(i = 0; i < nr; ++i) {
+		seq_printf(m, "\t\t%pS\n", (void *)st->lkst_ip[i]);
+	}
+}
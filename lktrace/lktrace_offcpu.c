@@ -0,0 +1,275 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kprobes.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
+
+/*
+ * off-cpu preset. At sched_switch a blocked task leaves with its
+ * kernel stack interned, a later sched_wakeup stamps it, and when it
+ * is switched in again the time spent blocked (switch out to wakeup)
+ * and waiting for a cpu (wakeup to switch in) is added to its entry
+ * for that stack. Preempted tasks are not tracked. A task switched in
+ * without a wakeup seen counts as blocked until then.
+ */
+
+#define LKTRACE_OFFCPU_TOP	(20)
+
+/* sched_switch(bool preempt, prev, next, unsigned int prev_state) */
+#define LKTRACE_OFFCPU_PREV	(2)
+#define LKTRACE_OFFCPU_STATE	(4)
+
+/* task pointer -> switch out time, stack id, wakeup time, pid */
+enum {
+	LKTRACE_OFFCPU_OUT,
+	LKTRACE_OFFCPU_STACK,
+	LKTRACE_OFFCPU_WAKE,
+	LKTRACE_OFFCPU_PID,
+};
+static struct lktrace_map *lktrace_offcpu_tasks;
+
+/* (pid, stack id) -> blocked ns, run queue ns, switches, longest block */
+enum {
+	LKTRACE_OFFCPU_BLOCKED,
+	LKTRACE_OFFCPU_RUNQ,
+	LKTRACE_OFFCPU_COUNT,
+	LKTRACE_OFFCPU_MAX,
+};
+static struct lktrace_map *lktrace_offcpu_agg;
+
+static struct lktrace_stackmap *lktrace_offcpu_stacks;
+
+static char const *const lktrace_offcpu_probes[] = {
+	"tp:sched:sched_switch lktrace_offcpu_switch",
+	"tp:sched:sched_wakeup lktrace_offcpu_wakeup",
+	"tp:sched:sched_process_exit lktrace_offcpu_exit",
+	NULL,
+};
+
+static bool lktrace_offcpu_blocked(struct pt_regs *regs)
+{
+	if(lktrace_fetch_arg(regs, 1)) {
+		return false;
+	}
+	return (unsigned int)lktrace_fetch_arg(regs, LKTRACE_OFFCPU_STATE) !=
+								TASK_RUNNING;
+}
+
+static void lktrace_offcpu_account(struct lktrace_map_ent const *t, u64 now)
+{
+	u64 out  = t->lkme_val[LKTRACE_OFFCPU_OUT];
+	u64 wake = t->lkme_val[LKTRACE_OFFCPU_WAKE];
+	u64 blocked = (wake ? wake : now) - out;
+	struct lktrace_map_ent *a;
+	unsigned long flags;
+
+	a = lktrace_map_lock(lktrace_offcpu_agg,
+				t->lkme_val[LKTRACE_OFFCPU_PID],
+				t->lkme_val[LKTRACE_OFFCPU_STACK], true, &flags);
+	if(a == NULL) {
+		return;
+	}
+	a->lkme_val[LKTRACE_OFFCPU_BLOCKED] += blocked;
+	a->lkme_val[LKTRACE_OFFCPU_RUNQ]    += wake ? now - wake : 0;
+	a->lkme_val[LKTRACE_OFFCPU_COUNT]++;
+	a->lkme_val[LKTRACE_OFFCPU_MAX] =
+			max(a->lkme_val[LKTRACE_OFFCPU_MAX], blocked);
+	lktrace_map_unlock(lktrace_offcpu_agg, a, flags);
+}
+
+/* sched_switch handler, current is prev */
+int lktrace_offcpu_switch(struct kprobe *kp, struct pt_regs *regs)
+{
+	struct task_struct *prev, *next;
+	struct lktrace_map_ent *e, t;
+	unsigned long flags;
+	u64 now = local_clock();
+
+	prev = (void *)lktrace_fetch_arg(regs, LKTRACE_OFFCPU_PREV);
+	next = (void *)lktrace_fetch_arg(regs, LKTRACE_OFFCPU_PREV + 1);
+
+	if(prev->pid && lktrace_offcpu_blocked(regs)) {
+		u32 id = lktrace_stackmap_get(lktrace_offcpu_stacks, NULL);
+
+		e = lktrace_map_lock(lktrace_offcpu_tasks, (unsigned long)prev,
+							0, true, &flags);
+		if(e) {
+			e->lkme_val[LKTRACE_OFFCPU_OUT]   = now;
+			e->lkme_val[LKTRACE_OFFCPU_STACK] = id;
+			e->lkme_val[LKTRACE_OFFCPU_WAKE]  = 0;
+			e->lkme_val[LKTRACE_OFFCPU_PID]   = prev->pid;
+			lktrace_map_unlock(lktrace_offcpu_tasks, e, flags);
+		}
+	}
+
+	e = lktrace_map_lock(lktrace_offcpu_tasks, (unsigned long)next, 0,
+							false, &flags);
+	if(e == NULL) {
+		return 0;
+	}
+	t = *e;
+	lktrace_map_delete(lktrace_offcpu_tasks, e, flags);
+	lktrace_offcpu_account(&t, now);
+	return 0;
+}
+
+/* sched_wakeup handler */
+int lktrace_offcpu_wakeup(struct kprobe *kp, struct pt_regs *regs)
+{
+	unsigned long p = lktrace_fetch_arg(regs, 1);
+	struct lktrace_map_ent *e;
+	unsigned long flags;
+
+	e = lktrace_map_lock(lktrace_offcpu_tasks, p, 0, false, &flags);
+	if(e == NULL) {
+		return 0;
+	}
+	if(e->lkme_val[LKTRACE_OFFCPU_WAKE] == 0) {
+		e->lkme_val[LKTRACE_OFFCPU_WAKE] = local_clock();
+	}
+	lktrace_map_unlock(lktrace_offcpu_tasks, e, flags);
+	return 0;
+}
+
+/* sched_process_exit handler, the task pointer may be reused */
+int lktrace_offcpu_exit(struct kprobe *kp, struct pt_regs *regs)
+{
+	unsigned long p = lktrace_fetch_arg(regs, 1);
+	struct lktrace_map_ent *e;
+	unsigned long flags;
+
+	e = lktrace_map_lock(lktrace_offcpu_tasks, p, 0, false, &flags);
+	if(e) {
+		lktrace_map_delete(lktrace_offcpu_tasks, e, flags);
+	}
+	return 0;
+}
+
+static void lktrace_offcpu_stop(void)
+{
+	lktrace_map_destroy(lktrace_offcpu_tasks);
+	lktrace_map_destroy(lktrace_offcpu_agg);
+	lktrace_stackmap_destroy(lktrace_offcpu_stacks);
+	lktrace_offcpu_tasks  = NULL;
+	lktrace_offcpu_agg    = NULL;
+	lktrace_offcpu_stacks = NULL;
+}
+
+static int lktrace_offcpu_start(void)
+{
+	lktrace_offcpu_tasks  = lktrace_map_create(7);
+	lktrace_offcpu_agg    = lktrace_map_create(7);
+	lktrace_offcpu_stacks = lktrace_stackmap_create(7);
+	if(lktrace_offcpu_tasks == NULL || lktrace_offcpu_agg == NULL ||
+	   lktrace_offcpu_stacks == NULL) {
+		lktrace_offcpu_stop();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void lktrace_offcpu_clear(void)
+{
+	lktrace_map_clear(lktrace_offcpu_tasks);
+	lktrace_map_clear(lktrace_offcpu_agg);
+	lktrace_stackmap_clear(lktrace_offcpu_stacks);
+}
+
+static int lktrace_offcpu_cmp_pid(void const *a, void const *b)
+{
+	unsigned long pa = ((struct lktrace_map_ent const *)a)->lkme_key[0];
+	unsigned long pb = ((struct lktrace_map_ent const *)b)->lkme_key[0];
+
+	return pa < pb ? -1 : pa > pb ? 1 : 0;
+}
+
+static int lktrace_offcpu_cmp_blocked(void const *a, void const *b)
+{
+	u64 ba = ((struct lktrace_map_ent const *)a)->lkme_val[0];
+	u64 bb = ((struct lktrace_map_ent const *)b)->lkme_val[0];
+
+	return ba < bb ? 1 : ba > bb ? -1 : 0;
+}
+
+static void lktrace_offcpu_show_entry(struct seq_file *m,
+				struct lktrace_map_ent const *e)
+{
+	char comm[TASK_COMM_LEN];
+
+	lktrace_preset_comm(e->lkme_key[0], comm);
+	seq_printf(m, "%8lu %-16s %12llu %12llu %8llu %12llu\n",
+			e->lkme_key[0], comm,
+			div_u64(e->lkme_val[LKTRACE_OFFCPU_BLOCKED], 1000),
+			div_u64(e->lkme_val[LKTRACE_OFFCPU_RUNQ], 1000),
+			e->lkme_val[LKTRACE_OFFCPU_COUNT],
+			div_u64(e->lkme_val[LKTRACE_OFFCPU_MAX], 1000));
+}
+
+/* per task totals, then heaviest task and stack couples */
+static void lktrace_offcpu_show(struct seq_file *m)
+{
+	struct lktrace_map_ent *all, *tasks, *t;
+	size_t n, ntasks = 0, i;
+
+	n = lktrace_map_collect(lktrace_offcpu_agg, &all);
+	seq_printf(m, "dropped %lu\n",
+			lktrace_map_dropped(lktrace_offcpu_tasks) +
+			lktrace_map_dropped(lktrace_offcpu_agg));
+	if(all == NULL) {
+		return;
+	}
+	tasks = vmalloc(max_t(size_t, n, 1) * sizeof(*tasks));
+	if(tasks == NULL) {
+		vfree(all);
+		return;
+	}
+
+	sort(all, n, sizeof(*all), lktrace_offcpu_cmp_pid, NULL);
+	for(i = 0; i < n; ++i) {
+		t = ntasks ? &tasks[ntasks - 1] : NULL;
+		if(t && t->lkme_key[0] == all[i].lkme_key[0]) {
+			t->lkme_val[LKTRACE_OFFCPU_BLOCKED] +=
+				all[i].lkme_val[LKTRACE_OFFCPU_BLOCKED];
+			t->lkme_val[LKTRACE_OFFCPU_RUNQ] +=
+				all[i].lkme_val[LKTRACE_OFFCPU_RUNQ];
+			t->lkme_val[LKTRACE_OFFCPU_COUNT] +=
+				all[i].lkme_val[LKTRACE_OFFCPU_COUNT];
+			t->lkme_val[LKTRACE_OFFCPU_MAX] =
+				max(t->lkme_val[LKTRACE_OFFCPU_MAX],
+				    all[i].lkme_val[LKTRACE_OFFCPU_MAX]);
+		} else {
+			tasks[ntasks++] = all[i];
+		}
+	}
+	sort(tasks, ntasks, sizeof(*tasks), lktrace_offcpu_cmp_blocked, NULL);
+	sort(all, n, sizeof(*all), lktrace_offcpu_cmp_blocked, NULL);
+
+	seq_printf(m, "\ntasks\n%8s %-16s %12s %12s %8s %12s\n", "pid", "comm",
+			"blocked_us", "runq_us", "count", "max_us");
+	for(i = 0; i < ntasks && i < LKTRACE_OFFCPU_TOP; ++i) {
+		lktrace_offcpu_show_entry(m, &tasks[i]);
+	}
+
+	seq_printf(m, "\nstacks\n%8s %-16s %12s %12s %8s %12s\n", "pid", "comm",
+			"blocked_us", "runq_us", "count", "max_us");
+	for(i = 0; i < n && i < LKTRACE_OFFCPU_TOP; ++i) {
+		lktrace_offcpu_show_entry(m, &all[i]);
+		lktrace_stackmap_show(m, lktrace_offcpu_stacks,
+					all[i].lkme_key[1]);
+	}
+	vfree(tasks);
+	vfree(all);
+}
+
+struct lktrace_preset lktrace_offcpu_preset = {
+	.lkps_name	= "offcpu",
+	.lkps_probes	= lktrace_offcpu_probes,
+	.lkps_start	= lktrace_offcpu_start,
+	.lkps_stop	= lktrace_offcpu_stop,
+	.lkps_clear	= lktrace_offcpu_clear,
+	.lkps_show	= lktrace_offcpu_show,
+};
@@ -0,0 +1,485 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+#include <linux/uaccess.h>
+
+#include "lktrace.h"
+
+/*
+ * latency pairing. A probe with begin=<pair>:<fetch> stores the hit
+ * time under the fetched key, a probe with end=<pair>:<fetch> looks
+ * the same key up and feeds the delta (ns) to the pair histogram.
+ * Keys are usually pointers, e.g. a request or an urb.
+ *
+ * The key table is preallocated and split in shards picked by key
+ * hash, each one a set of 8 way buckets under its own lock, so hits
+ * on different cpus seldom share a lock and probe context never
+ * allocates. An entry older than the pair expiry is stale : it is
+ * reused by begin and ignored by end. When a bucket is full of live
+ * entries the oldest is dropped and counted as lost.
+ *
+ * Both ends may run on different cpus, hit time is local_clock().
+ */
+
+#define LKTRACE_PAIR_WAYS	(8)
+#define LKTRACE_PAIR_BUCKETBITS	(6)
+#define LKTRACE_PAIR_BUCKETS	(1 << LKTRACE_PAIR_BUCKETBITS)
+#define LKTRACE_PAIR_EXPIRE_MS	(1000)
+
+/* ts 0 is a free slot */
+struct lktrace_pair_slot {
+	unsigned long	lkps_key;
+	u64		lkps_ts;
+};
+
+/*
+ * @lkpsh_lock		: taken from probe context
+ * @lkpsh_matched	: end found its begin
+ * @lkpsh_unmatched	: end found nothing
+ * @lkpsh_expired	: stale entries dropped
+ * @lkpsh_lost		: live entries evicted by a full bucket
+ */
+struct lktrace_pair_shard {
+	raw_spinlock_t		lkpsh_lock;
+	unsigned long		lkpsh_matched;
+	unsigned long		lkpsh_unmatched;
+	unsigned long		lkpsh_expired;
+	unsigned long		lkpsh_lost;
+	struct lktrace_pair_slot lkpsh_slot[LKTRACE_PAIR_BUCKETS]
+					   [LKTRACE_PAIR_WAYS];
+} ____cacheline_aligned_in_smp;
+
+/*
+ * @lkp_list	: link in instance lki_pairs
+ * @lkp_users	: begin/end actions referencing the pair
+ * @lkp_expire	: entry lifetime, ns
+ * @lkp_hist	: log2 latency histogram, ns
+ * @lkp_shift	: log2 of shard count
+ * @lkp_shards	: key table
+ * @lkp_name	: name given in options
+ */
+struct lktrace_pair {
+	struct list_head	lkp_list;
+	unsigned int		lkp_users;
+	u64			lkp_expire;
+	struct lktrace_hist	*lkp_hist;
+	unsigned int		lkp_shift;
+	struct lktrace_pair_shard *lkp_shards;
+	char			lkp_name[LKTRACE_FUNCNAME_MAXLEN];
+};
+
+/*
+ * actions of one probe, either may be NULL
+ * @lkpg_begin	: pair the hit starts
+ * @lkpg_bkey	: begin key
+ * @lkpg_end	: pair the hit ends
+ * @lkpg_ekey	: end key
+ */
+struct lktrace_pairing {
+	struct lktrace_pair	*lkpg_begin;
+	struct lktrace_fetch	lkpg_bkey;
+	struct lktrace_pair	*lkpg_end;
+	struct lktrace_fetch	lkpg_ekey;
+};
+
+/* protects every instance lki_pairs and lkp_users */
+static DEFINE_MUTEX(lktrace_pair_mutex);
+
+static void lktrace_pair_free(struct lktrace_pair *p)
+{
+	lktrace_hist_destroy(p->lkp_hist);
+	vfree(p->lkp_shards);
+	kfree(p);
+}
+
+static struct lktrace_pair *lktrace_pair_alloc(char const *name)
+{
+	struct lktrace_pair *p;
+	unsigned int i, nshards;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if(p == NULL) {
+		return NULL;
+	}
+	nshards = roundup_pow_of_two(num_possible_cpus());
+	p->lkp_shift  = ilog2(nshards);
+	p->lkp_expire = LKTRACE_PAIR_EXPIRE_MS * NSEC_PER_MSEC;
+	p->lkp_hist   = lktrace_hist_create_log2();
+	p->lkp_shards = vzalloc(nshards * sizeof(*p->lkp_shards));
+	if(p->lkp_hist == NULL || p->lkp_shards == NULL) {
+		lktrace_pair_free(p);
+		return NULL;
+	}
+	for(i = 0; i < nshards; ++i) {
+		raw_spin_lock_init(&p->lkp_shards[i].lkpsh_lock);
+	}
+	strscpy(p->lkp_name, name, sizeof(p->lkp_name));
+	return p;
+}
+
+static struct lktrace_pair *lktrace_pair_get(struct lktrace_instance *inst,
+					char const *name)
+{
+	struct lktrace_pair *p;
+
+	if(*name == '\0' || strlen(name) >= LKTRACE_FUNCNAME_MAXLEN) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	mutex_lock(&lktrace_pair_mutex);
+	list_for_each_entry(p, &inst->lki_pairs, lkp_list) {
+		if(strcmp(p->lkp_name, name) == 0) {
+			p->lkp_users++;
+			goto end_get;
+		}
+	}
+	p = lktrace_pair_alloc(name);
+	if(p == NULL) {
+		p = ERR_PTR(-ENOMEM);
+		goto end_get;
+	}
+	p->lkp_users = 1;
+	list_add_tail(&p->lkp_list, &inst->lki_pairs);
+
+end_get:
+	mutex_unlock(&lktrace_pair_mutex);
+	return p;
+}
+
+/* no probe may still be running with p */
+static void lktrace_pair_put(struct lktrace_pair *p)
+{
+	if(p == NULL) {
+		return;
+	}
+	mutex_lock(&lktrace_pair_mutex);
+	if(--p->lkp_users == 0) {
+		list_del(&p->lkp_list);
+		lktrace_pair_free(p);
+	}
+	mutex_unlock(&lktrace_pair_mutex);
+}
+
+static struct lktrace_pair_slot *lktrace_pair_bucket(struct lktrace_pair *p,
+					unsigned long key,
+					struct lktrace_pair_shard **shard)
+{
+	u32 h = hash_long(key, 32);
+
+	*shard = &p->lkp_shards[h & ((1U << p->lkp_shift) - 1)];
+	return (*shard)->lkpsh_slot[(h >> p->lkp_shift) &
+					(LKTRACE_PAIR_BUCKETS - 1)];
+}
+
+/* probe context */
+static void lktrace_pair_begin(struct lktrace_pair *p, unsigned long key,
+				u64 now)
+{
+	struct lktrace_pair_shard *sh;
+	struct lktrace_pair_slot *b = lktrace_pair_bucket(p, key, &sh);
+	struct lktrace_pair_slot *victim = NULL;
+	unsigned long flags;
+	unsigned int i;
+
+	raw_spin_lock_irqsave(&sh->lkpsh_lock, flags);
+	for(i = 0; i < LKTRACE_PAIR_WAYS; ++i) {
+		if(b[i].lkps_ts && b[i].lkps_key == key) {
+			/* restarted before it ended */
+			victim = &b[i];
+			goto store;
+		}
+	}
+	for(i = 0; i < LKTRACE_PAIR_WAYS; ++i) {
+		if(b[i].lkps_ts == 0) {
+			victim = &b[i];
+			goto store;
+		}
+		if(now - b[i].lkps_ts > p->lkp_expire) {
+			sh->lkpsh_expired++;
+			victim = &b[i];
+			goto store;
+		}
+		if(victim == NULL || b[i].lkps_ts < victim->lkps_ts) {
+			victim = &b[i];
+		}
+	}
+	sh->lkpsh_lost++;
+store:
+	victim->lkps_key = key;
+	victim->lkps_ts  = now;
+	raw_spin_unlock_irqrestore(&sh->lkpsh_lock, flags);
+}
+
+/* probe context */
+static void lktrace_pair_end(struct lktrace_pair *p, unsigned long key,
+				u64 now)
+{
+	struct lktrace_pair_shard *sh;
+	struct lktrace_pair_slot *b = lktrace_pair_bucket(p, key, &sh);
+	unsigned long flags;
+	unsigned int i;
+	u64 ts = 0;
+
+	raw_spin_lock_irqsave(&sh->lkpsh_lock, flags);
+	for(i = 0; i < LKTRACE_PAIR_WAYS; ++i) {
+		if(b[i].lkps_ts && b[i].lkps_key == key) {
+			ts = b[i].lkps_ts;
+			b[i].lkps_ts = 0;
+			break;
+		}
+	}
+	if(ts == 0) {
+		sh->lkpsh_unmatched++;
+	} else if(now - ts > p->lkp_expire && (s64)(now - ts) > 0) {
+		sh->lkpsh_expired++;
+		ts = 0;
+	} else {
+		sh->lkpsh_matched++;
+	}
+	raw_spin_unlock_irqrestore(&sh->lkpsh_lock, flags);
+
+	if(ts) {
+		/* clocks of two cpus may be slightly apart */
+		lktrace_hist_add(p->lkp_hist,
+				(s64)(now - ts) > 0 ? now - ts : 0);
+	}
+}
+
+/* probe context, end first so one probe may close and reopen a pair */
+void lktrace_pair_hit(struct lktrace_pairing const *pg, struct pt_regs *regs)
+{
+	u64 now = local_clock();
+
+	if(pg->lkpg_end) {
+		lktrace_pair_end(pg->lkpg_end,
+			lktrace_fetch_value(&pg->lkpg_ekey, regs), now);
+	}
+	if(pg->lkpg_begin) {
+		lktrace_pair_begin(pg->lkpg_begin,
+			lktrace_fetch_value(&pg->lkpg_bkey, regs), now);
+	}
+}
+
+int lktrace_pair_is_option(char const *opt)
+{
+	return strncmp(opt, "begin=", 6) == 0 ||
+		strncmp(opt, "end=", 4) == 0;
+}
+
+/*
+ * pairing options:
+ *   begin=<pair>:<fetch>	: hit starts pair under fetched key
+ *   end=<pair>:<fetch>	: hit ends pair under fetched key
+ * *pairing is allocated on first option
+ */
+int lktrace_pair_parse(struct lktrace_instance *inst,
+			struct lktrace_pairing **pairing,
+			char *opt)
+{
+	struct lktrace_pairing *pg = *pairing;
+	struct lktrace_pair **pp, *p;
+	struct lktrace_fetch *key;
+	char *name, *fetch;
+
+	if(pg == NULL) {
+		pg = kzalloc(sizeof(*pg), GFP_KERNEL);
+		if(pg == NULL) {
+			return -ENOMEM;
+		}
+		*pairing = pg;
+	}
+
+	if(strncmp(opt, "begin=", 6) == 0) {
+		pp   = &pg->lkpg_begin;
+		key  = &pg->lkpg_bkey;
+		name = opt + 6;
+	} else if(strncmp(opt, "end=", 4) == 0) {
+		pp   = &pg->lkpg_end;
+		key  = &pg->lkpg_ekey;
+		name = opt + 4;
+	} else {
+		return -EINVAL;
+	}
+
+	fetch = strchr(name, ':');
+	if(fetch == NULL) {
+		return -EINVAL;
+	}
+	*fetch++ = '\0';
+	if(lktrace_fetch_parse(key, fetch)) {
+		return -EINVAL;
+	}
+	p = lktrace_pair_get(inst, name);
+	if(IS_ERR(p)) {
+		return PTR_ERR(p);
+	}
+	lktrace_pair_put(*pp);
+	*pp = p;
+	return 0;
+}
+
+void lktrace_pair_destroy(struct lktrace_pairing *pg)
+{
+	if(pg == NULL) {
+		return;
+	}
+	lktrace_pair_put(pg->lkpg_begin);
+	lktrace_pair_put(pg->lkpg_end);
+	kfree(pg);
+}
+
+int lktrace_pair_print(struct lktrace_pairing const *pg, char *buff, size_t len)
+{
+	char fetch[LKTRACE_FUNCNAME_MAXLEN];
+	int ret = 0;
+
+	if(pg == NULL) {
+		return 0;
+	}
+	if(pg->lkpg_begin) {
+		lktrace_fetch_print(&pg->lkpg_bkey, fetch, sizeof(fetch));
+		ret += scnprintf(buff + ret, len - ret, " begin=%s:%s",
+					pg->lkpg_begin->lkp_name, fetch);
+	}
+	if(pg->lkpg_end) {
+		lktrace_fetch_print(&pg->lkpg_ekey, fetch, sizeof(fetch));
+		ret += scnprintf(buff + ret, len - ret, " end=%s:%s",
+					pg->lkpg_end->lkp_name, fetch);
+	}
+	return ret;
+}
+
+/*------------------ lktracefs latency file -----------------------*/
+
+static void lktrace_pair_show(struct seq_file *m, struct lktrace_pair *p)
+{
+	unsigned long matched = 0, unmatched = 0, expired = 0, lost = 0;
+	struct lktrace_pair_shard *sh;
+	unsigned int i;
+
+	for(i = 0; i < (1U << p->lkp_shift); ++i) {
+		sh = &p->lkp_shards[i];
+		matched   += READ_ONCE(sh->lkpsh_matched);
+		unmatched += READ_ONCE(sh->lkpsh_unmatched);
+		expired   += READ_ONCE(sh->lkpsh_expired);
+		lost      += READ_ONCE(sh->lkpsh_lost);
+	}
+	seq_printf(m, "%s expire=%llums matched %lu unmatched %lu "
+			"expired %lu lost %lu\n", p->lkp_name,
+			div_u64(p->lkp_expire, NSEC_PER_MSEC),
+			matched, unmatched, expired, lost);
+	lktrace_hist_show(m, p->lkp_hist);
+}
+
+static void lktrace_pair_reset(struct lktrace_pair *p)
+{
+	struct lktrace_pair_shard *sh;
+	unsigned long flags;
+	unsigned int i;
+
+	for(i = 0; i < (1U << p->lkp_shift); ++i) {
+		sh = &p->lkp_shards[i];
+		raw_spin_lock_irqsave(&sh->lkpsh_lock, flags);
+		memset(sh->lkpsh_slot, 0, sizeof(sh->lkpsh_slot));
+		sh->lkpsh_matched   = 0;
+		sh->lkpsh_unmatched = 0;
+		sh->lkpsh_expired   = 0;
+		sh->lkpsh_lost      = 0;
+		raw_spin_unlock_irqrestore(&sh->lkpsh_lock, flags);
+	}
+	lktrace_hist_clear(p->lkp_hist);
+}
+
+static int lktrace_pair_fops_show(struct seq_file *m, void *v)
+{
+	struct lktrace_instance *inst = m->private;
+	struct lktrace_pair *p;
+
+	mutex_lock(&lktrace_pair_mutex);
+	list_for_each_entry(p, &inst->lki_pairs, lkp_list) {
+		lktrace_pair_show(m, p);
+	}
+	mutex_unlock(&lktrace_pair_mutex);
+	return 0;
+}
+
+static int lktrace_pair_fops_open(struct inode *inode, struct file *file)
+{
+	return lktracefs_single_open(file, lktrace_pair_fops_show);
+}
+
+/*
+ * "<pair> expire=<ms>" sets a pair expiry, any other write clears
+ * every pair of the instance
+ */
+static ssize_t lktrace_pair_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct lktrace_instance *inst;
+	struct lktrace_pair *p;
+	char buff[LKTRACE_FUNCNAME_MAXLEN + 32];
+	char name[LKTRACE_FUNCNAME_MAXLEN];
+	size_t len = min(size, sizeof(buff) - 1);
+	unsigned long ms;
+	int ret = 0;
+
+	inst = ((struct seq_file *)file->private_data)->private;
+	if(copy_from_user(buff, ubuff, len)) {
+		return -EFAULT;
+	}
+	buff[len] = '\0';
+
+	mutex_lock(&lktrace_pair_mutex);
+	if(sscanf(buff, "%31s expire=%lu", name, &ms) == 2) {
+		ret = ms ? -ENOENT : -EINVAL;
+		list_for_each_entry(p, &inst->lki_pairs, lkp_list) {
+			if(ms && strcmp(p->lkp_name, name) == 0) {
+				p->lkp_expire = (u64)ms * NSEC_PER_MSEC;
+				ret = 0;
+				break;
+			}
+		}
+	} else {
+		list_for_each_entry(p, &inst->lki_pairs, lkp_list) {
+			lktrace_pair_reset(p);
+		}
+	}
+	mutex_unlock(&lktrace_pair_mutex);
+	return ret ? ret : size;
+}
+
+static struct file_operations lktrace_pair_fops = {
+	.open		=	lktrace_pair_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_pair_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	lktracefs_single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_latency_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"latency",
+						&lktrace_pair_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
@@ -0,0 +1,241 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/pid.h>
+#include <linux/rcupdate.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "lktrace.h"
+
+/*
+ * analysis presets. Writing a preset name to an instance preset file
+ * adds the preset probes to that instance, their handlers live in
+ * this module and feed the preset tables. Probes show in the list
+ * file like any other, and instance scope and overhead budget apply.
+ * Handlers do not know their instance, so a preset runs in a single
+ * instance at a time.
+ */
+
+static struct lktrace_preset *const lktrace_presets[] = {
+	&lktrace_offcpu_preset,
+	&lktrace_lock_preset,
+	&lktrace_kmem_preset,
+};
+
+/* protects every instance lki_preset and preset lkps_owner */
+static DEFINE_MUTEX(lktrace_preset_mutex);
+
+static struct lktrace_preset *lktrace_preset_find(char const *name)
+{
+	unsigned int i;
+
+	for(i = 0; i < ARRAY_SIZE(lktrace_presets); ++i) {
+		if(strcmp(lktrace_presets[i]->lkps_name, name) == 0) {
+			return lktrace_presets[i];
+		}
+	}
+	return NULL;
+}
+
+/* words of a preset line, too big for the stack, under the mutex */
+static char lktrace_preset_word[3][KSYM_NAME_LEN];
+
+/*
+ * "fname off handler ..." or "tp:sub:event handler ..." : only the
+ * probe carrying the preset handler goes, user probes on the same
+ * site stay
+ */
+static void lktrace_preset_remove_probe(struct lktrace_instance *inst,
+					char const *line)
+{
+	char (*w)[KSYM_NAME_LEN] = lktrace_preset_word;
+	char const *handler = NULL;
+	unsigned long off = 0;
+	char fmt[32];
+	int n;
+
+	snprintf(fmt, sizeof(fmt), "%%%us %%%us %%%us", KSYM_NAME_LEN - 1,
+				KSYM_NAME_LEN - 1, KSYM_NAME_LEN - 1);
+	n = sscanf(line, fmt, w[0], w[1], w[2]);
+	if(n >= 2 && lktrace_tp_is_spec(w[0])) {
+		handler = w[1];
+	} else if(n == 3 && kstrtoul(w[1], 16, &off) == 0) {
+		handler = w[2];
+	}
+	if(handler) {
+		lktrace_probe_remove(inst, w[0], off, handler);
+	}
+}
+
+/* lktrace_preset_mutex held, first n probes of p were added */
+static void lktrace_preset_teardown(struct lktrace_instance *inst,
+				struct lktrace_preset *p,
+				unsigned int n)
+{
+	while(n--) {
+		lktrace_preset_remove_probe(inst, p->lkps_probes[n]);
+	}
+	/* probe removal waited for handlers in flight */
+	p->lkps_stop();
+}
+
+/* lktrace_preset_mutex held */
+static int lktrace_preset_start(struct lktrace_instance *inst,
+				struct lktrace_preset *p)
+{
+	unsigned int n;
+	char *line;
+	int ret;
+
+	if(inst->lki_preset) {
+		return -EBUSY;
+	}
+	if(p->lkps_owner) {
+		printk(KERN_ERR "preset %s already runs in another instance\n",
+							p->lkps_name);
+		return -EBUSY;
+	}
+	ret = p->lkps_start();
+	if(ret) {
+		return ret;
+	}
+	for(n = 0; p->lkps_probes[n]; ++n) {
+		/* lktrace_probe_add cuts the line */
+		line = kstrdup(p->lkps_probes[n], GFP_KERNEL);
+		ret = line ? lktrace_probe_add(inst, line) : -ENOMEM;
+		kfree(line);
+		if(ret) {
+			printk(KERN_ERR "preset %s : can't add %s\n",
+					p->lkps_name, p->lkps_probes[n]);
+			lktrace_preset_teardown(inst, p, n);
+			return ret;
+		}
+	}
+	inst->lki_preset = p;
+	p->lkps_owner    = inst;
+	return 0;
+}
+
+void lktrace_preset_stop(struct lktrace_instance *inst)
+{
+	struct lktrace_preset *p;
+	unsigned int n;
+
+	mutex_lock(&lktrace_preset_mutex);
+	p = inst->lki_preset;
+	if(p) {
+		for(n = 0; p->lkps_probes[n]; ++n) {
+		}
+		lktrace_preset_teardown(inst, p, n);
+		inst->lki_preset = NULL;
+		p->lkps_owner    = NULL;
+	}
+	mutex_unlock(&lktrace_preset_mutex);
+}
+
+/* comm of a pid for preset tables, buff holds TASK_COMM_LEN */
+void lktrace_preset_comm(pid_t pid, char *buff)
+{
+	struct task_struct *task;
+
+	rcu_read_lock();
+	task = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+	strscpy(buff, task ? task->comm : "<exited>", TASK_COMM_LEN);
+	rcu_read_unlock();
+}
+
+/*------------------ lktracefs preset file ------------------------*/
+
+static int lktrace_preset_fops_show(struct seq_file *m, void *v)
+{
+	struct lktrace_instance *inst = m->private;
+	unsigned int i;
+
+	mutex_lock(&lktrace_preset_mutex);
+	if(inst->lki_preset) {
+		seq_printf(m, "%s\n", inst->lki_preset->lkps_name);
+		inst->lki_preset->lkps_show(m);
+	} else {
+		seq_printf(m, "none, available :");
+		for(i = 0; i < ARRAY_SIZE(lktrace_presets); ++i) {
+			seq_printf(m, " %s", lktrace_presets[i]->lkps_name);
+		}
+		seq_printf(m, "\n");
+	}
+	mutex_unlock(&lktrace_preset_mutex);
+	return 0;
+}
+
+static int lktrace_preset_fops_open(struct inode *inode, struct file *file)
+{
+	return lktracefs_single_open(file, lktrace_preset_fops_show);
+}
+
+/*
+ * "<preset>" starts a preset, "clear" empties its tables and "none"
+ * stops it, removing its probes
+ */
+static ssize_t lktrace_preset_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct lktrace_instance *inst;
+	struct lktrace_preset *p;
+	char buff[LKTRACE_FUNCNAME_MAXLEN], *name;
+	size_t len = min(size, sizeof(buff) - 1);
+	int ret = 0;
+
+	inst = ((struct seq_file *)file->private_data)->private;
+	if(copy_from_user(buff, ubuff, len)) {
+		return -EFAULT;
+	}
+	buff[len] = '\0';
+	name = strim(buff);
+
+	if(strcmp(name, "none") == 0) {
+		lktrace_preset_stop(inst);
+		return size;
+	}
+
+	mutex_lock(&lktrace_preset_mutex);
+	if(strcmp(name, "clear") == 0) {
+		if(inst->lki_preset) {
+			inst->lki_preset->lkps_clear();
+		}
+	} else {
+		p = lktrace_preset_find(name);
+		ret = p ? lktrace_preset_start(inst, p) : -ENOENT;
+	}
+	mutex_unlock(&lktrace_preset_mutex);
+	return ret ? ret : size;
+}
+
+static struct file_operations lktrace_preset_fops = {
+	.open		=	lktrace_preset_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_preset_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	lktracefs_single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_preset_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"preset",
+						&lktrace_preset_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
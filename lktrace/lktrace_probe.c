@@ -0,0 +1,1018 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kallsyms.h>
+#include <linux/kprobes.h>
+#include <linux/slab.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/err.h>
+#include <linux/hashtable.h>
+#include <linux/hash.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
+
+/*
+ * probe registry. A site is one probed address, attached once through
+ * kprobe or ftrace. Every instance probing that address hangs its own
+ * lktrace_probelist on the site, a hit walks them all.
+ */
+
+#define LKTRACE_SITE_HASHBITS	(12)
+
+static LIST_HEAD(lktrace_site_head);
+static DEFINE_HASHTABLE(lktrace_site_hash, LKTRACE_SITE_HASHBITS);
+static unsigned int lktrace_nsites;
+static unsigned int lktrace_nprobes;
+DEFINE_MUTEX(lktrace_probelist_mutex);
+
+static struct kmem_cache *lktrace_site_cache;
+static struct kmem_cache *lktrace_probe_cache;
+
+/* lktrace actions of one instance's probe, then its user handler */
+static int lktrace_probe_actions(struct lktrace_probelist *ptr,
+				struct kprobe *kp,
+				unsigned long ip,
+				struct pt_regs *regs)
+{
+	struct lktrace_instance *inst = ptr->lkpl_instance;
+	struct lktrace_probe_opts const *o = ptr->lkpl_opts;
+
+	/* drop uninteresting hits before paying for anything else */
+	if(o && (!lktrace_trigger_gate(o->lkpo_trigger) ||
+		 !lktrace_scope_match(o->lkpo_scope))) {
+		return 0;
+	}
+	if(!lktrace_scope_match(rcu_dereference_sched(inst->lki_scope))) {
+		return 0;
+	}
+	if(o && o->lkpo_hist) {
+		lktrace_hist_update(o->lkpo_hist, regs);
+	}
+	if(o && o->lkpo_pairing) {
+		lktrace_pair_hit(o->lkpo_pairing, regs);
+	}
+	if(inst->lki_enabled) {
+		lktrace_buffer_record(inst->lki_buffer, ptr->lkpl_id, ip, regs);
+	}
+	if(o && o->lkpo_snapshot && lktrace_cond_match(o->lkpo_snapshot, regs)) {
+		lktrace_buffer_freeze(inst->lki_buffer);
+	}
+	if(o && o->lkpo_trigger) {
+		lktrace_trigger_fire(o->lkpo_trigger, inst);
+	}
+	if(ptr->lkpl_handler) {
+		return ptr->lkpl_handler(kp, regs);
+	}
+	return 0;
+}
+
+/*
+ * every hit is counted, throttled probes skip their actions, the
+ * others are timed for the overhead budget
+ */
+static int lktrace_probe_dispatch(struct lktrace_probelist *ptr,
+				struct kprobe *kp,
+				unsigned long ip,
+				struct pt_regs *regs)
+{
+	struct lktrace_probe_cost *c;
+	unsigned int every;
+	u64 start;
+	int ret;
+
+	if(ptr->lkpl_state != LKTRACE_PROBE_ARMED) {
+		return 0;
+	}
+	c = lktrace_budget_this_cost(&ptr->lkpl_budget);
+	c->lkpc_hits++;
+	every = READ_ONCE(ptr->lkpl_budget.lkpb_every);
+	if(unlikely(every) &&
+	   (every == LKTRACE_BUDGET_OFF || c->lkpc_hits % every)) {
+		return 0;
+	}
+	start = local_clock();
+	ret = lktrace_probe_actions(ptr, kp, ip, regs);
+	c->lkpc_ns += local_clock() - start;
+	return ret;
+}
+
+/*
+ * hit on a site, from any attach mechanism. ip is what goes into
+ * records : the probed address, or the user address for uprobes.
+ * Preemption is disabled, which is the sched RCU read side protecting
+ * lks_probes.
+ */
+int lktrace_site_hit(struct lktrace_site *site,
+		unsigned long ip,
+		struct pt_regs *regs)
+{
+	struct lktrace_probelist *ptr;
+	int ret = 0;
+
+	list_for_each_entry_rcu(ptr, &site->lks_probes, lkpl_site_list) {
+		ret |= lktrace_probe_dispatch(ptr, &site->lks_probe, ip, regs);
+	}
+	return ret;
+}
+
+/* kprobe pre_handler of every lktrace site, also called through ftrace */
+int lktrace_site_dispatch(struct kprobe *kp, struct pt_regs *regs)
+{
+	struct lktrace_site *site;
+
+	site = container_of(kp, struct lktrace_site, lks_probe);
+	return lktrace_site_hit(site, (unsigned long)kp->addr, regs);
+}
+
+static struct module *lktrace_addr_module(void const *addr)
+{
+	struct module *mod;
+	preempt_disable();
+	mod = __module_text_address((unsigned long)addr);
+	preempt_enable();
+	return mod;
+}
+
+/*------------------ symbols --------------------------------------*/
+
+/* kallsyms_lookup_name is no longer exported, a kprobe tells us where */
+static unsigned long (*lktrace_kallsyms_lookup)(char const *);
+
+unsigned long lktrace_lookup_name(char const *name)
+{
+	return lktrace_kallsyms_lookup(name);
+}
+
+/* offset of addr in its symbol, 0 if unknown */
+unsigned long lktrace_symbol_offset(unsigned long addr)
+{
+	char sym[KSYM_SYMBOL_LEN];
+	unsigned long off;
+	char *plus;
+
+	/* "name+0xoff/0xsize [module]" */
+	sprint_symbol(sym, addr);
+	plus = strchr(sym, '+');
+	if(plus == NULL || sscanf(plus + 1, "%lx", &off) != 1) {
+		return 0;
+	}
+	return off;
+}
+
+static int lktrace_lookup_init(void)
+{
+	struct kprobe kp = { .symbol_name = "kallsyms_lookup_name" };
+	unsigned long addr;
+	int ret;
+
+	ret = register_kprobe(&kp);
+	if(ret < 0) {
+		printk(KERN_ERR "can't find kallsyms_lookup_name: %d\n", ret);
+		return ret;
+	}
+	addr = (unsigned long)kp.addr;
+	unregister_kprobe(&kp);
+
+	/* the kprobe may sit past an endbr, an indirect call needs it */
+	addr -= lktrace_symbol_offset(addr);
+	lktrace_kallsyms_lookup = (void *)addr;
+	return 0;
+}
+
+/*------------------ sites ----------------------------------------*/
+
+/* names are interned, same name means same pointer */
+static u32 lktrace_site_key(char const *fname, off_t off)
+{
+	return hash_ptr((void *)fname, 32) ^ (u32)off;
+}
+
+static struct lktrace_site *lktrace_site_find(char const *fname, off_t off)
+{
+	struct lktrace_site *site;
+
+	hash_for_each_possible(lktrace_site_hash, site, lks_hnode,
+				lktrace_site_key(fname, off)) {
+		if(site->lks_fname == fname && site->lks_offset == off) {
+			return site;
+		}
+	}
+	return NULL;
+}
+
+/* takes a reference on interned fname */
+static struct lktrace_site *lktrace_site_alloc(char const *fname, off_t off)
+{
+	struct lktrace_site *site;
+
+	site = kmem_cache_zalloc(lktrace_site_cache, GFP_KERNEL);
+	if(site) {
+		INIT_LIST_HEAD(&site->lks_list);
+		INIT_LIST_HEAD(&site->lks_probes);
+		site->lks_fname  = lktrace_str_get(fname);
+		site->lks_offset = off;
+	}
+	return site;
+}
+
+static void lktrace_site_free(struct lktrace_site *site)
+{
+	lktrace_str_put(site->lks_fname);
+	kmem_cache_free(lktrace_site_cache, site);
+}
+
+/*
+ * resolve probed function, fill a fresh kprobe
+ * return -ENOENT if symbol is missing, module may not be loaded yet.
+ * Silent then : each module load retries every pending site.
+ */
+static int lktrace_site_resolve(struct lktrace_site *const site)
+{
+	kprobe_opcode_t *addr;
+
+	if(lktrace_uprobe_is_spec(site->lks_fname)) {
+		/* binary and symbol are looked up on attach */
+		memset(&site->lks_probe, 0, sizeof(site->lks_probe));
+		site->lks_mech	 = LKTRACE_MECH_UPROBE;
+		site->lks_module = NULL;
+		return 0;
+	}
+	if(lktrace_tp_is_spec(site->lks_fname)) {
+		memset(&site->lks_probe, 0, sizeof(site->lks_probe));
+		site->lks_mech	 = LKTRACE_MECH_TRACEPOINT;
+		site->lks_module = NULL;
+		return 0;
+	}
+
+	addr = (kprobe_opcode_t*)lktrace_lookup_name(site->lks_fname);
+	if(addr == NULL) {
+		pr_debug("can't resolv %s func yet\n", site->lks_fname);
+		return -ENOENT;
+	}
+	/* tens of thousands of sites must not flood the log */
+	pr_debug("ok, we resolv %s func at %p addr\n", site->lks_fname, addr);
+
+	/* a kprobe can't be registered twice without being reset */
+	memset(&site->lks_probe, 0, sizeof(site->lks_probe));
+	site->lks_probe.addr	    = addr + site->lks_offset;
+	site->lks_probe.pre_handler = lktrace_site_dispatch;
+	site->lks_module	    = lktrace_addr_module(addr);
+
+	/* function entry can go through ftrace, much cheaper than int3 */
+	if(site->lks_offset == 0 && lktrace_ftrace_ip(addr)) {
+		site->lks_mech = LKTRACE_MECH_FTRACE;
+	} else {
+		site->lks_mech = LKTRACE_MECH_KPROBE;
+	}
+	return 0;
+}
+
+static int lktrace_site_attach(struct lktrace_site *const site)
+{
+	if(site->lks_mech == LKTRACE_MECH_UPROBE) {
+		return lktrace_uprobe_attach(site);
+	}
+	if(site->lks_mech == LKTRACE_MECH_TRACEPOINT) {
+		return lktrace_tp_attach(site);
+	}
+	if(site->lks_mech == LKTRACE_MECH_FTRACE) {
+		if(lktrace_ftrace_attach(site) == 0) {
+			return 0;
+		}
+		site->lks_mech = LKTRACE_MECH_KPROBE;
+	}
+	return register_kprobe(&site->lks_probe);
+}
+
+static void lktrace_site_detach(struct lktrace_site *const site)
+{
+	if(site->lks_mech == LKTRACE_MECH_FTRACE) {
+		lktrace_ftrace_detach(site);
+	} else if(site->lks_mech == LKTRACE_MECH_UPROBE) {
+		lktrace_uprobe_detach(site);
+	} else if(site->lks_mech == LKTRACE_MECH_TRACEPOINT) {
+		lktrace_tp_detach(site);
+	} else {
+		unregister_kprobe(&site->lks_probe);
+	}
+}
+
+/* called with lktrace_probelist_mutex held */
+static int lktrace_site_arm(struct lktrace_site *const site)
+{
+	int ret;
+
+	ret = lktrace_site_resolve(site);
+	if(ret == -ENOENT) {
+		/* armed later by lktrace_module_notify */
+		printk(KERN_ERR "error, can't resolv %s func\n",
+							site->lks_fname);
+		printk("%s+0x%lx parked until its module is loaded\n",
+					site->lks_fname, site->lks_offset);
+		site->lks_state = LKTRACE_PROBE_PENDING;
+		return 0;
+	}
+
+	ret = lktrace_site_attach(site);
+	if(ret < 0) {
+		printk("can't register kprobe: cause = %d\n", ret);
+		return ret;
+	}
+	site->lks_state = LKTRACE_PROBE_ARMED;
+	return 0;
+}
+
+static int lktrace_count_sites(void)
+{
+	return lktrace_nsites;
+}
+
+/*------------------ probes ---------------------------------------*/
+
+/* return -ENOENT if handler module is not loaded yet */
+static int lktrace_probe_resolve_handler(struct lktrace_probelist *const ptr)
+{
+	kprobe_pre_handler_t handler = NULL;
+
+	if(strcmp(ptr->lkpl_cbname, LKTRACE_NOHANDLER) != 0) {
+		handler = (kprobe_pre_handler_t )
+				lktrace_lookup_name(ptr->lkpl_cbname);
+
+		if(handler == NULL) {
+			/* silent, retried on each module load */
+			pr_debug("can't resolv %s handler yet\n",
+							ptr->lkpl_cbname);
+			ptr->lkpl_state = LKTRACE_PROBE_PENDING;
+			return -ENOENT;
+		}
+		pr_debug("ok we resolv %s func at %p addr\n",
+						ptr->lkpl_cbname, handler);
+	}
+	ptr->lkpl_handler  = handler;
+	ptr->lkpl_cbmodule = handler ? lktrace_addr_module((void *)handler)
+				     : NULL;
+	/* handler must be visible before the probe is */
+	smp_wmb();
+	ptr->lkpl_state = LKTRACE_PROBE_ARMED;
+	return 0;
+}
+
+/*
+ * probe options, written after handler name:
+ *   hist=<spec>	: value histogram, see lktrace_hist_create
+ *   snapshot[=<cond>]	: freeze trace buffers on hit, see lktrace_cond_parse
+ *   pid=, cpu=, cgroup=	: probe scope, see lktrace_scope_parse
+ *   when=, on=, off=,	: gate and trigger actions, see lktrace_trigger_parse
+ *   start, stop
+ *   begin=, end=	: latency pairing, see lktrace_pair_parse
+ */
+static int lktrace_parse_probe_option(struct lktrace_probelist *const ptr,
+					char *opt)
+{
+	struct lktrace_probe_opts *o = ptr->lkpl_opts;
+
+	if(o == NULL) {
+		o = kzalloc(sizeof(*o), GFP_KERNEL);
+		if(o == NULL) {
+			return -ENOMEM;
+		}
+		ptr->lkpl_opts = o;
+	}
+
+	if(strncmp(opt, "hist=", 5) == 0) {
+		struct lktrace_hist *h = lktrace_hist_create(opt + 5);
+		if(IS_ERR(h)) {
+			return PTR_ERR(h);
+		}
+		lktrace_hist_destroy(o->lkpo_hist);
+		o->lkpo_hist = h;
+		return 0;
+	}
+
+	if(strcmp(opt, "snapshot") == 0 || strncmp(opt, "snapshot=", 9) == 0) {
+		int ret;
+		struct lktrace_cond *c = kzalloc(sizeof(*c), GFP_KERNEL);
+		if(c == NULL) {
+			return -ENOMEM;
+		}
+		ret = lktrace_cond_parse(c, opt[8] == '=' ? opt + 9 : NULL);
+		if(ret) {
+			kfree(c);
+			return ret;
+		}
+		kfree(o->lkpo_snapshot);
+		o->lkpo_snapshot = c;
+		return 0;
+	}
+
+	if(lktrace_scope_is_option(opt)) {
+		return lktrace_scope_parse(&o->lkpo_scope, opt);
+	}
+
+	if(lktrace_trigger_is_option(opt)) {
+		return lktrace_trigger_parse(ptr->lkpl_instance,
+					&o->lkpo_trigger, opt);
+	}
+
+	if(lktrace_pair_is_option(opt)) {
+		return lktrace_pair_parse(ptr->lkpl_instance,
+					&o->lkpo_pairing, opt);
+	}
+
+	printk(KERN_ERR "unknown probe option %s\n", opt);
+	return -EINVAL;
+}
+
+static int lktrace_parse_probe_options(struct lktrace_probelist *const ptr,
+					char *opts)
+{
+	char *opt;
+	int ret;
+
+	while((opt = strsep(&opts, " \t\n")) != NULL) {
+		if(*opt == '\0') {
+			continue;
+		}
+		if(*opt == '#') {
+			/* comment, as printed by list read */
+			break;
+		}
+		ret = lktrace_parse_probe_option(ptr, opt);
+		if(ret) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* "fname+off handler options # attach state", off in hex */
+int lktrace_probe_print(struct lktrace_probelist const *ptr,
+			char *buff,
+			size_t len)
+{
+	struct lktrace_site const *site = ptr->lkpl_site;
+	struct lktrace_probe_opts const *o = ptr->lkpl_opts;
+	int ret;
+
+	ret = scnprintf(buff, len, "%s+0x%lx %s", site->lks_fname,
+				site->lks_offset, ptr->lkpl_cbname);
+	if(o && o->lkpo_hist) {
+		ret += scnprintf(buff + ret, len - ret, " ");
+		ret += lktrace_hist_print(o->lkpo_hist, buff + ret, len - ret);
+	}
+	if(o && o->lkpo_snapshot) {
+		ret += scnprintf(buff + ret, len - ret, " snapshot");
+		if(o->lkpo_snapshot->lkc_fetch.lkf_kind != LKTRACE_FETCH_NONE) {
+			ret += scnprintf(buff + ret, len - ret, "=");
+			ret += lktrace_cond_print(o->lkpo_snapshot,
+						buff + ret, len - ret);
+		}
+	}
+	if(o) {
+		ret += lktrace_scope_print(o->lkpo_scope, buff + ret,
+								len - ret);
+		ret += lktrace_trigger_print(o->lkpo_trigger, buff + ret,
+								len - ret);
+		ret += lktrace_pair_print(o->lkpo_pairing, buff + ret,
+								len - ret);
+	}
+	if(site->lks_state == LKTRACE_PROBE_PENDING ||
+	   ptr->lkpl_state == LKTRACE_PROBE_PENDING) {
+		ret += scnprintf(buff + ret, len - ret, " # pending");
+	} else if(site->lks_mech == LKTRACE_MECH_FTRACE) {
+		ret += scnprintf(buff + ret, len - ret, " # ftrace");
+	} else if(site->lks_mech == LKTRACE_MECH_UPROBE) {
+		ret += scnprintf(buff + ret, len - ret, " # uprobe");
+	} else if(site->lks_mech == LKTRACE_MECH_TRACEPOINT) {
+		ret += scnprintf(buff + ret, len - ret, " # tracepoint");
+	} else {
+		ret += scnprintf(buff + ret, len - ret, " # kprobe");
+	}
+	ret += lktrace_budget_print(&ptr->lkpl_budget, buff + ret, len - ret);
+	return ret;
+}
+
+static struct lktrace_probelist* lktrace_alloc_new_probelist_elem(void)
+{
+	struct lktrace_probelist *ret;
+
+	ret = kmem_cache_zalloc(lktrace_probe_cache, GFP_KERNEL);
+	if(ret == NULL) {
+		return NULL;
+	}
+	if(lktrace_budget_slot_alloc(&ret->lkpl_budget)) {
+		kmem_cache_free(lktrace_probe_cache, ret);
+		return NULL;
+	}
+	INIT_LIST_HEAD( &ret->lkpl_list );
+	INIT_LIST_HEAD( &ret->lkpl_site_list );
+	return ret;
+}
+
+static void lktrace_free_probelist_elem(struct lktrace_probelist *ptr)
+{
+	struct lktrace_probe_opts *o = ptr->lkpl_opts;
+
+	if(o) {
+		lktrace_hist_destroy(o->lkpo_hist);
+		kfree(o->lkpo_snapshot);
+		lktrace_scope_destroy(o->lkpo_scope);
+		lktrace_trigger_destroy(o->lkpo_trigger);
+		lktrace_pair_destroy(o->lkpo_pairing);
+		kfree(o);
+	}
+	lktrace_str_put(ptr->lkpl_cbname);
+	lktrace_budget_slot_free(&ptr->lkpl_budget);
+	kmem_cache_free(lktrace_probe_cache, ptr);
+}
+
+/* next blank separated word of *cur, NULL at end of line */
+static char *lktrace_next_word(char **cur)
+{
+	char *word;
+
+	while((word = strsep(cur, " \t\n")) != NULL) {
+		if(*word != '\0') {
+			return word;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * "fname off handler [options]", names of any length
+ * "fname+off handler [options]" as the list file prints it
+ * "u:/path/to/binary:symbol[+off] handler [options]" for uprobes
+ * "tp:subsystem:event handler [options]" for tracepoints
+ * offsets are in hex everywhere, with or without 0x
+ */
+int lktrace_probe_add(struct lktrace_instance *inst, char *line)
+{
+	char *fname, *offstr, *cbname, *cur = line;
+	char const *name;
+	struct lktrace_probelist *ptr;
+	struct lktrace_site *site;
+	int ret, newsite = 0;
+	unsigned long off;
+
+	fname = lktrace_next_word(&cur);
+	if(fname && lktrace_uprobe_is_spec(fname)) {
+		cbname = lktrace_next_word(&cur);
+		ret = lktrace_uprobe_parse(fname, &off);
+	} else if(fname && lktrace_tp_is_spec(fname)) {
+		cbname = lktrace_next_word(&cur);
+		ret = lktrace_tp_parse(fname);
+		off = 0;
+	} else if(fname && (offstr = strchr(fname, '+')) != NULL) {
+		*offstr++ = '\0';
+		cbname = lktrace_next_word(&cur);
+		ret = kstrtoul(offstr, 16, &off);
+	} else {
+		offstr = lktrace_next_word(&cur);
+		cbname = lktrace_next_word(&cur);
+		ret = cbname ? kstrtoul(offstr, 16, &off) : -EINVAL;
+	}
+	if(cbname == NULL || ret) {
+		printk(KERN_ERR "bad probe line, expect"
+				" \"fname off handler [options]\"\n");
+		return -EIO;
+	}
+
+	ptr = lktrace_alloc_new_probelist_elem();
+	if(ptr == NULL) {
+		return -ENOMEM;
+	}
+	ptr->lkpl_instance = inst;
+	/* options must be set before the probe is visible to hits */
+	ret = cur ? lktrace_parse_probe_options(ptr, cur) : 0;
+	if(ret) {
+		lktrace_free_probelist_elem(ptr);
+		return ret;
+	}
+	ptr->lkpl_cbname = lktrace_str_get(cbname);
+	name = lktrace_str_get(fname);
+	if(ptr->lkpl_cbname == NULL || name == NULL) {
+		lktrace_str_put(name);
+		lktrace_free_probelist_elem(ptr);
+		return -ENOMEM;
+	}
+
+	/* no module can come or go between resolv and list_add */
+	mutex_lock(&lktrace_probelist_mutex);
+	if(lktrace_probe_resolve_handler(ptr) == -ENOENT) {
+		printk(KERN_ERR "error, can't resolv %s handler\n", cbname);
+		printk("%s handler parked until its module is loaded\n",
+								cbname);
+	}
+
+	site = lktrace_site_find(name, off);
+	if(site == NULL) {
+		site = lktrace_site_alloc(name, off);
+		if(site == NULL) {
+			ret = -ENOMEM;
+			goto add_err;
+		}
+		newsite = 1;
+	}
+
+	ptr->lkpl_site = site;
+	ptr->lkpl_id   = ++inst->lki_next_id;
+	list_add_tail_rcu(&ptr->lkpl_site_list, &site->lks_probes);
+	if(newsite) {
+		ret = lktrace_site_arm(site);
+		if(ret) {
+			/* never armed, no reader to wait for */
+			lktrace_site_free(site);
+			goto add_err;
+		}
+		list_add(&site->lks_list, &lktrace_site_head);
+		hash_add(lktrace_site_hash, &site->lks_hnode,
+				lktrace_site_key(site->lks_fname, off));
+		lktrace_nsites++;
+	}
+	list_add_tail(&ptr->lkpl_list, &inst->lki_probes);
+	lktrace_nprobes++;
+	mutex_unlock(&lktrace_probelist_mutex);
+	lktrace_str_put(name);
+	return 0;
+
+add_err:
+	mutex_unlock(&lktrace_probelist_mutex);
+	lktrace_str_put(name);
+	lktrace_free_probelist_elem(ptr);
+	return ret;
+}
+
+/* shell like glob, '*' and '?' only */
+static int lktrace_glob_match(char const *pat, char const *str)
+{
+	char const *star = NULL, *back = NULL;
+
+	while(*str) {
+		if(*pat == '*') {
+			star = ++pat;
+			back = str;
+			continue;
+		}
+		if(*pat == '?' || *pat == *str) {
+			++pat;
+			++str;
+			continue;
+		}
+		if(star == NULL) {
+			return 0;
+		}
+		pat = star;
+		str = ++back;
+	}
+	while(*pat == '*') {
+		++pat;
+	}
+	return *pat == '\0';
+}
+
+/*
+ * remove instance probes whose function matches glob, at offset off
+ * if off >= 0, with handler cbname if not NULL. Sites left without probes are unregistered in one
+ * batch, so a single grace period is paid however many probes go
+ * away. ftrace sites are detached one by one, unregister_ftrace_function
+ * has no batched form.
+ */
+int lktrace_probe_remove(struct lktrace_instance *inst,
+			char const *glob,
+			long off,
+			char const *cbname)
+{
+	struct lktrace_probelist *ptr, *tmp;
+	struct lktrace_site *site, *stmp;
+	struct kprobe **kps;
+	LIST_HEAD(dead_probes);
+	LIST_HEAD(dead_sites);
+	int n = 0, removed = 0;
+
+	mutex_lock(&lktrace_probelist_mutex);
+	kps = kcalloc(lktrace_count_sites(), sizeof(*kps), GFP_KERNEL);
+
+	list_for_each_entry_safe(ptr, tmp, &inst->lki_probes, lkpl_list) {
+		site = ptr->lkpl_site;
+		if(!lktrace_glob_match(glob, site->lks_fname)) {
+			continue;
+		}
+		if(off >= 0 && site->lks_offset != off) {
+			continue;
+		}
+		if(cbname && strcmp(ptr->lkpl_cbname, cbname) != 0) {
+			continue;
+		}
+		list_del_rcu(&ptr->lkpl_site_list);
+		list_move(&ptr->lkpl_list, &dead_probes);
+		lktrace_nprobes--;
+		++removed;
+
+		if(!list_empty(&site->lks_probes)) {
+			/* still used by another probe */
+			continue;
+		}
+		list_move(&site->lks_list, &dead_sites);
+		hash_del(&site->lks_hnode);
+		lktrace_nsites--;
+		if(site->lks_state != LKTRACE_PROBE_ARMED) {
+			continue;
+		}
+		if(site->lks_mech == LKTRACE_MECH_KPROBE && kps) {
+			kps[n++] = &site->lks_probe;
+		} else {
+			lktrace_site_detach(site);
+		}
+	}
+	if(n) {
+		/* waits for every handler in flight, not only these ones */
+		unregister_kprobes(kps, n);
+	} else if(removed) {
+		synchronize_rcu();
+	}
+	mutex_unlock(&lktrace_probelist_mutex);
+	kfree(kps);
+
+	list_for_each_entry_safe(ptr, tmp, &dead_probes, lkpl_list) {
+		list_del(&ptr->lkpl_list);
+		lktrace_free_probelist_elem(ptr);
+	}
+	list_for_each_entry_safe(site, stmp, &dead_sites, lks_list) {
+		list_del(&site->lks_list);
+		lktrace_site_free(site);
+	}
+	return removed;
+}
+
+int lktrace_for_each_probe(struct lktrace_instance *inst,
+			int (*fn)(struct lktrace_probelist *, void *),
+			void *data)
+{
+	struct lktrace_probelist *walker;
+	int ret = 0;
+
+	mutex_lock(&lktrace_probelist_mutex);
+	list_for_each_entry(walker, &inst->lki_probes, lkpl_list) {
+		ret = fn(walker, data);
+		if(ret) {
+			break;
+		}
+	}
+	mutex_unlock(&lktrace_probelist_mutex);
+	return ret;
+}
+
+/*------------------ module notifier ------------------------------*/
+
+/* "mod:sym" names can only be resolved once mod is loaded */
+static int lktrace_name_wants_module(char const *name, struct module *mod)
+{
+	char const *sep = strchr(name, ':');
+	if(sep == NULL) {
+		return 1;
+	}
+	return strlen(mod->name) == sep - name &&
+		strncmp(name, mod->name, sep - name) == 0;
+}
+
+/* resolve pending handlers and sites against the coming module */
+static void lktrace_arm_module_probes(struct module *mod)
+{
+	struct lktrace_site *site;
+	struct lktrace_probelist *ptr;
+	struct kprobe **kps;
+	int i, n = 0, ret;
+
+	mutex_lock(&lktrace_probelist_mutex);
+
+	/* handlers first, so that the first hit on a new site sees them */
+	list_for_each_entry(site, &lktrace_site_head, lks_list) {
+		list_for_each_entry(ptr, &site->lks_probes, lkpl_site_list) {
+			if(ptr->lkpl_state == LKTRACE_PROBE_PENDING &&
+			   lktrace_name_wants_module(ptr->lkpl_cbname, mod)) {
+				lktrace_probe_resolve_handler(ptr);
+			}
+		}
+	}
+
+	kps = kcalloc(lktrace_count_sites(), sizeof(*kps), GFP_KERNEL);
+	if(kps == NULL) {
+		goto end_arm;
+	}
+
+	list_for_each_entry(site, &lktrace_site_head, lks_list) {
+		if(site->lks_state != LKTRACE_PROBE_PENDING) {
+			continue;
+		}
+		if(!lktrace_name_wants_module(site->lks_fname, mod)) {
+			continue;
+		}
+		if(lktrace_site_resolve(site)) {
+			continue;
+		}
+		if(site->lks_mech == LKTRACE_MECH_FTRACE &&
+		   lktrace_site_attach(site) == 0) {
+			site->lks_state = LKTRACE_PROBE_ARMED;
+			continue;
+		}
+		kps[n++] = &site->lks_probe;
+	}
+	if(n == 0) {
+		goto end_arm;
+	}
+
+	ret = register_kprobes(kps, n);
+	if(ret < 0) {
+		/* a single bad site fails the batch, retry one by one */
+		printk(KERN_ERR "batch arm for %s failed (%d)\n",
+							mod->name, ret);
+		for(i = 0; i < n; ++i) {
+			site = container_of(kps[i], struct lktrace_site,
+								lks_probe);
+			/* reset the kprobe, but keep the kprobe fallback */
+			lktrace_site_resolve(site);
+			site->lks_mech = LKTRACE_MECH_KPROBE;
+			if(register_kprobe(kps[i]) == 0) {
+				site->lks_state = LKTRACE_PROBE_ARMED;
+			}
+		}
+		goto end_arm;
+	}
+	for(i = 0; i < n; ++i) {
+		site = container_of(kps[i], struct lktrace_site, lks_probe);
+		site->lks_state = LKTRACE_PROBE_ARMED;
+	}
+	printk("%d probes armed in %s\n", n, mod->name);
+
+end_arm:
+	mutex_unlock(&lktrace_probelist_mutex);
+	kfree(kps);
+}
+
+/* park sites living in, and probes handled by, the going module */
+static void lktrace_park_module_probes(struct module *mod)
+{
+	struct lktrace_site *site;
+	struct lktrace_probelist *ptr;
+	struct kprobe **kps;
+	int n = 0, parked = 0;
+
+	mutex_lock(&lktrace_probelist_mutex);
+	kps = kcalloc(lktrace_count_sites(), sizeof(*kps), GFP_KERNEL);
+	if(kps == NULL) {
+		goto end_park;
+	}
+
+	list_for_each_entry(site, &lktrace_site_head, lks_list) {
+		list_for_each_entry(ptr, &site->lks_probes, lkpl_site_list) {
+			if(ptr->lkpl_state == LKTRACE_PROBE_ARMED &&
+			   ptr->lkpl_cbmodule == mod) {
+				ptr->lkpl_state = LKTRACE_PROBE_PENDING;
+				++parked;
+			}
+		}
+
+		if(site->lks_state != LKTRACE_PROBE_ARMED ||
+		   site->lks_module != mod) {
+			continue;
+		}
+		site->lks_state = LKTRACE_PROBE_PENDING;
+		if(site->lks_mech == LKTRACE_MECH_FTRACE) {
+			lktrace_site_detach(site);
+			continue;
+		}
+		kps[n++] = &site->lks_probe;
+	}
+	if(n) {
+		unregister_kprobes(kps, n);
+		printk("%d probes parked with %s\n", n, mod->name);
+	} else if(parked) {
+		/* no handler of mod may still run when it is freed */
+		synchronize_rcu();
+	}
+
+end_park:
+	mutex_unlock(&lktrace_probelist_mutex);
+	kfree(kps);
+}
+
+static int lktrace_module_notify(struct notifier_block *nb,
+				unsigned long action,
+				void *data)
+{
+	struct module *mod = data;
+
+	switch(action) {
+	case MODULE_STATE_COMING:
+		lktrace_arm_module_probes(mod);
+		break;
+	case MODULE_STATE_GOING:
+		lktrace_park_module_probes(mod);
+		break;
+	}
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block lktrace_module_nb = {
+	.notifier_call	=	lktrace_module_notify,
+};
+
+int lktrace_probe_init(void)
+{
+	int ret;
+
+	ret = lktrace_lookup_init();
+	if(ret) {
+		return ret;
+	}
+	lktrace_site_cache  = KMEM_CACHE(lktrace_site, 0);
+	lktrace_probe_cache = KMEM_CACHE(lktrace_probelist, 0);
+	if(lktrace_site_cache == NULL || lktrace_probe_cache == NULL) {
+		ret = -ENOMEM;
+		goto init_err;
+	}
+	ret = register_module_notifier(&lktrace_module_nb);
+	if(ret == 0) {
+		return 0;
+	}
+
+init_err:
+	if(lktrace_site_cache) {
+		kmem_cache_destroy(lktrace_site_cache);
+	}
+	if(lktrace_probe_cache) {
+		kmem_cache_destroy(lktrace_probe_cache);
+	}
+	return ret;
+}
+
+/* instances must have removed their probes */
+void lktrace_probe_exit(void)
+{
+	unregister_module_notifier(&lktrace_module_nb);
+	kmem_cache_destroy(lktrace_probe_cache);
+	kmem_cache_destroy(lktrace_site_cache);
+	/* last, probes hit it until they are all gone */
+	lktrace_budget_pool_destroy();
+}
+
+/*------------------ lktracefs registry file ----------------------*/
+
+/*
+ * memory taken by the registry : sites and probes from their caches,
+ * interned names with their slab rounding, per cpu budget costs of
+ * the probes by whole chunks. Optional probe actions (histograms,
+ * scopes, ...) are not counted.
+ */
+static int lktrace_registry_fops_show(struct seq_file *m, void *v)
+{
+	unsigned int nsites, nprobes, nstr, nslots;
+	size_t site_sz = kmem_cache_size(lktrace_site_cache);
+	size_t probe_sz = kmem_cache_size(lktrace_probe_cache);
+	size_t str_bytes, budget_bytes, total;
+
+	mutex_lock(&lktrace_probelist_mutex);
+	nsites  = lktrace_nsites;
+	nprobes = lktrace_nprobes;
+	mutex_unlock(&lktrace_probelist_mutex);
+	lktrace_str_stats(&nstr, &str_bytes);
+	lktrace_budget_pool_stats(&nslots, &budget_bytes);
+
+	total = nsites * site_sz + nprobes * probe_sz + str_bytes +
+		budget_bytes;
+	seq_printf(m, "sites  %8u x %4zu bytes\n", nsites, site_sz);
+	seq_printf(m, "probes %8u x %4zu bytes\n", nprobes, probe_sz);
+	seq_printf(m, "names  %8u   %8zu bytes\n", nstr, str_bytes);
+	seq_printf(m, "budget %8u   %8zu bytes\n", nslots, budget_bytes);
+	seq_printf(m, "total  %zu bytes, %zu per probe\n", total,
+				nprobes ? total / nprobes : 0);
+	return 0;
+}
+
+static int lktrace_registry_fops_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lktrace_registry_fops_show, NULL);
+}
+
+static struct file_operations lktrace_registry_fops = {
+	.open		=	lktrace_registry_fops_open,
+	.read		=	seq_read,
+	.llseek		=	seq_lseek,
+	.release	=	single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_registry_file(struct super_block *sb,
+				struct dentry *root)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"registry",
+						&lktrace_registry_fops,
+						S_IFREG | 0444);
+	return file ? 0 : -1;
+}
@@ -0,0 +1,37 @@
+#ifndef LKTRACE_RAW_H
+#define LKTRACE_RAW_H
+
+/*
+ * layout of lktracefs snapshot_raw, shared with userspace tools.
+ * For each possible cpu, one chunk header followed by lkrc_nrec
+ * records of lkrc_recsize bytes, oldest first, in kernel byte order.
+ * Records layout is described by the instance metadata file.
+ */
+
+#include <linux/types.h>
+
+#define LKTRACE_RAW_MAGIC	(0x6c6b7472)	/* "lktr" */
+
+/*
+ * @lkrc_magic		: LKTRACE_RAW_MAGIC
+ * @lkrc_cpu		: cpu the records were taken on
+ * @lkrc_recsize	: size of one record
+ * @lkrc_idoff		: offset of the probe event id in a record
+ * @lkrc_nrec		: number of records following
+ * @lkrc_lost		: records overwritten, or dropped by a buffer
+ *			  resize, before the freeze
+ * @lkrc_ts_begin	: timestamp of first record, 0 if none
+ * @lkrc_ts_end		: timestamp of last record, 0 if none
+ */
+struct lktrace_raw_chunk {
+	__u32	lkrc_magic;
+	__u32	lkrc_cpu;
+	__u32	lkrc_recsize;
+	__u32	lkrc_idoff;
+	__u64	lkrc_nrec;
+	__u64	lkrc_lost;
+	__u64	lkrc_ts_begin;
+	__u64	lkrc_ts_end;
+};
+
+#endif
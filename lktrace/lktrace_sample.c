@@ -0,0 +1,437 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/seqlock.h>
+#include <linux/sort.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <asm/irq_regs.h>
+#include <linux/uaccess.h>
+
+#include "lktrace.h"
+
+/*
+ * sampling profiler. A pinned hrtimer per online cpu looks at the
+ * interrupted context at a given rate and counts the kernel ip, or
+ * the whole kernel stack, in a per cpu table. Nothing is symbolized
+ * in timer context : the profile file merges the cpu tables, folds
+ * ips into their function and prints the hottest entries. It is a
+ * cheap first pass to decide where real probes are worth placing.
+ * The profile file may be read while sampling : a per cpu seqcount
+ * lets it copy entries the timer is not in the middle of writing.
+ *
+ * Cpus coming online while sampling are not sampled.
+ */
+
+#define LKTRACE_SAMPLE_SLOTBITS	(10)
+#define LKTRACE_SAMPLE_SLOTS	(1 << LKTRACE_SAMPLE_SLOTBITS)
+#define LKTRACE_SAMPLE_PROBES	(8)
+#define LKTRACE_SAMPLE_DEPTH	LKTRACE_STACK_DEPTH
+#define LKTRACE_SAMPLE_MAXHZ	(10000)
+
+/*
+ * one ip, or one stack, count 0 is a free slot
+ * @lkse_count	: samples
+ * @lkse_hash	: hash of lkse_ip
+ * @lkse_nr	: used entries of lkse_ip, 1 without stacks
+ * @lkse_ip	: innermost first
+ */
+struct lktrace_sample_ent {
+	unsigned long	lkse_count;
+	u32		lkse_hash;
+	u32		lkse_nr;
+	unsigned long	lkse_ip[LKTRACE_SAMPLE_DEPTH];
+};
+
+/*
+ * @lksc_timer	: pinned sampling timer
+ * @lksc_seq	: odd while the timer updates lksc_tab
+ * @lksc_samples: timer ticks
+ * @lksc_user	: ticks that interrupted user mode
+ * @lksc_dropped: kernel ticks that found no free slot
+ * @lksc_tab	: open addressing table, LKTRACE_SAMPLE_SLOTS entries
+ */
+struct lktrace_sample_cpu {
+	struct hrtimer		lksc_timer;
+	seqcount_t		lksc_seq;
+	unsigned long		lksc_samples;
+	unsigned long		lksc_user;
+	unsigned long		lksc_dropped;
+	struct lktrace_sample_ent *lksc_tab;
+};
+
+static struct lktrace_sample_cpu __percpu *lktrace_sample_cpu;
+
+/* serializes start, stop and reads of the profile */
+static DEFINE_MUTEX(lktrace_sample_mutex);
+
+static int lktrace_sample_running;
+static unsigned int lktrace_sample_hz = 99;
+static unsigned int lktrace_sample_top = 30;
+static int lktrace_sample_stack;
+static ktime_t lktrace_sample_period;
+
+static u32 lktrace_sample_hash(unsigned long const *ip, unsigned int nr)
+{
+	return jhash(ip, nr * sizeof(*ip), 0);
+}
+
+/* timer context */
+static void lktrace_sample_account(struct lktrace_sample_cpu *sc,
+				unsigned long const *ip, unsigned int nr)
+{
+	u32 hash = lktrace_sample_hash(ip, nr);
+	unsigned int i, slot = hash_32(hash, LKTRACE_SAMPLE_SLOTBITS);
+	struct lktrace_sample_ent *e;
+
+	for(i = 0; i < LKTRACE_SAMPLE_PROBES; ++i) {
+		e = &sc->lksc_tab[(slot + i) & (LKTRACE_SAMPLE_SLOTS - 1)];
+		if(e->lkse_count == 0) {
+			e->lkse_hash = hash;
+			e->lkse_nr   = nr;
+			memcpy(e->lkse_ip, ip, nr * sizeof(*ip));
+			e->lkse_count = 1;
+			return;
+		}
+		if(e->lkse_hash == hash && e->lkse_nr == nr &&
+		   memcmp(e->lkse_ip, ip, nr * sizeof(*ip)) == 0) {
+			e->lkse_count++;
+			return;
+		}
+	}
+	sc->lksc_dropped++;
+}
+
+static enum hrtimer_restart lktrace_sample_tick(struct hrtimer *timer)
+{
+	struct lktrace_sample_cpu *sc = this_cpu_ptr(lktrace_sample_cpu);
+	struct pt_regs *regs = get_irq_regs();
+	unsigned long ip[LKTRACE_SAMPLE_DEPTH];
+	unsigned int nr;
+
+	if(!READ_ONCE(lktrace_sample_running)) {
+		return HRTIMER_NORESTART;
+	}
+	sc->lksc_samples++;
+	if(regs == NULL || user_mode(regs)) {
+		sc->lksc_user++;
+		goto forward;
+	}
+	nr = 0;
+	if(lktrace_sample_stack) {
+		nr = lktrace_stack_save(ip, LKTRACE_SAMPLE_DEPTH, regs);
+	}
+	if(nr == 0) {
+		ip[nr++] = instruction_pointer(regs);
+	}
+	write_seqcount_begin(&sc->lksc_seq);
+	lktrace_sample_account(sc, ip, nr);
+	write_seqcount_end(&sc->lksc_seq);
+
+forward:
+	hrtimer_forward_now(timer, lktrace_sample_period);
+	return HRTIMER_RESTART;
+}
+
+static void lktrace_sample_start_cpu(void *unused)
+{
+	struct lktrace_sample_cpu *sc = this_cpu_ptr(lktrace_sample_cpu);
+
+	hrtimer_start(&sc->lksc_timer, lktrace_sample_period,
+					HRTIMER_MODE_REL_PINNED);
+}
+
+static void lktrace_sample_free(void)
+{
+	int cpu;
+
+	if(lktrace_sample_cpu == NULL) {
+		return;
+	}
+	for_each_possible_cpu(cpu) {
+		vfree(per_cpu_ptr(lktrace_sample_cpu, cpu)->lksc_tab);
+	}
+	free_percpu(lktrace_sample_cpu);
+	lktrace_sample_cpu = NULL;
+}
+
+/* lktrace_sample_mutex held */
+static void lktrace_sample_stop(void)
+{
+	int cpu;
+
+	if(!lktrace_sample_running) {
+		return;
+	}
+	WRITE_ONCE(lktrace_sample_running, 0);
+	for_each_possible_cpu(cpu) {
+		hrtimer_cancel(&per_cpu_ptr(lktrace_sample_cpu,
+						cpu)->lksc_timer);
+	}
+}
+
+/* lktrace_sample_mutex held, previous samples are dropped */
+static int lktrace_sample_start(void)
+{
+	struct lktrace_sample_cpu *sc;
+	int cpu;
+
+	lktrace_sample_stop();
+	lktrace_sample_free();
+
+	if(lktrace_sample_stack && lktrace_stack_init()) {
+		printk(KERN_ERR "can't walk stacks, sampling ips only\n");
+	}
+	lktrace_sample_cpu = alloc_percpu(struct lktrace_sample_cpu);
+	if(lktrace_sample_cpu == NULL) {
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(lktrace_sample_cpu, cpu);
+		sc->lksc_tab = vzalloc_node(LKTRACE_SAMPLE_SLOTS *
+					sizeof(*sc->lksc_tab), cpu_to_node(cpu));
+		if(sc->lksc_tab == NULL) {
+			lktrace_sample_free();
+			return -ENOMEM;
+		}
+		seqcount_init(&sc->lksc_seq);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+		hrtimer_setup(&sc->lksc_timer, lktrace_sample_tick,
+				CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+#else
+		hrtimer_init(&sc->lksc_timer, CLOCK_MONOTONIC,
+					HRTIMER_MODE_REL_PINNED);
+		sc->lksc_timer.function = lktrace_sample_tick;
+#endif
+	}
+
+	lktrace_sample_period = ns_to_ktime(NSEC_PER_SEC / lktrace_sample_hz);
+	lktrace_sample_running = 1;
+	on_each_cpu(lktrace_sample_start_cpu, NULL, 1);
+	return 0;
+}
+
+void lktrace_sample_exit(void)
+{
+	mutex_lock(&lktrace_sample_mutex);
+	lktrace_sample_stop();
+	lktrace_sample_free();
+	mutex_unlock(&lktrace_sample_mutex);
+}
+
+/*------------------ lktracefs profile file -----------------------*/
+
+static int lktrace_sample_cmp_count(void const *a, void const *b)
+{
+	unsigned long ca = ((struct lktrace_sample_ent const *)a)->lkse_count;
+	unsigned long cb = ((struct lktrace_sample_ent const *)b)->lkse_count;
+
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static int lktrace_sample_cmp_key(void const *a, void const *b)
+{
+	struct lktrace_sample_ent const *ea = a, *eb = b;
+
+	if(ea->lkse_hash != eb->lkse_hash) {
+		return ea->lkse_hash < eb->lkse_hash ? -1 : 1;
+	}
+	if(ea->lkse_nr != eb->lkse_nr) {
+		return ea->lkse_nr < eb->lkse_nr ? -1 : 1;
+	}
+	return memcmp(ea->lkse_ip, eb->lkse_ip,
+			ea->lkse_nr * sizeof(ea->lkse_ip[0]));
+}
+
+/*
+ * gather every cpu table in one array, fold ips into function starts
+ * when not sampling stacks, merge equal keys and sort by count.
+ * Returns the number of entries left in *out.
+ */
+static size_t lktrace_sample_collect(struct lktrace_sample_ent **out)
+{
+	struct lktrace_sample_cpu *sc;
+	struct lktrace_sample_ent *all;
+	size_t n = 0, i, j;
+	unsigned int seq;
+	int cpu;
+
+	all = vmalloc(num_possible_cpus() * LKTRACE_SAMPLE_SLOTS *
+						sizeof(*all));
+	if(all == NULL) {
+		return 0;
+	}
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(lktrace_sample_cpu, cpu);
+		for(i = 0; i < LKTRACE_SAMPLE_SLOTS; ++i) {
+			do {
+				seq = read_seqcount_begin(&sc->lksc_seq);
+				all[n] = sc->lksc_tab[i];
+			} while(read_seqcount_retry(&sc->lksc_seq, seq));
+			if(all[n].lkse_count == 0) {
+				continue;
+			}
+			if(!lktrace_sample_stack) {
+				all[n].lkse_ip[0] -= lktrace_symbol_offset(
+							all[n].lkse_ip[0]);
+				all[n].lkse_hash = lktrace_sample_hash(
+							all[n].lkse_ip, 1);
+			}
+			n++;
+		}
+	}
+
+	sort(all, n, sizeof(*all), lktrace_sample_cmp_key, NULL);
+	for(i = 0, j = 0; i < n; ++i) {
+		if(j && lktrace_sample_cmp_key(&all[j - 1], &all[i]) == 0) {
+			all[j - 1].lkse_count += all[i].lkse_count;
+		} else {
+			all[j++] = all[i];
+		}
+	}
+	sort(all, j, sizeof(*all), lktrace_sample_cmp_count, NULL);
+	*out = all;
+	return j;
+}
+
+static int lktrace_sample_fops_show(struct seq_file *m, void *v)
+{
+	unsigned long samples = 0, user = 0, dropped = 0, kernel;
+	struct lktrace_sample_cpu *sc;
+	struct lktrace_sample_ent *all = NULL;
+	size_t n, i, k;
+	int cpu;
+
+	mutex_lock(&lktrace_sample_mutex);
+	seq_printf(m, "%s hz=%u top=%u%s\n",
+			lktrace_sample_running ? "running" : "stopped",
+			lktrace_sample_hz, lktrace_sample_top,
+			lktrace_sample_stack ? " stack" : "");
+	if(lktrace_sample_cpu == NULL) {
+		goto end_show;
+	}
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(lktrace_sample_cpu, cpu);
+		samples += READ_ONCE(sc->lksc_samples);
+		user    += READ_ONCE(sc->lksc_user);
+		dropped += READ_ONCE(sc->lksc_dropped);
+	}
+	kernel = samples - user;
+	seq_printf(m, "samples %lu kernel %lu user %lu dropped %lu\n",
+				samples, kernel, user, dropped);
+
+	n = lktrace_sample_collect(&all);
+	for(i = 0; i < n && i < lktrace_sample_top; ++i) {
+		unsigned long pm = kernel ?
+			all[i].lkse_count * 1000 / kernel : 0;
+
+		if(lktrace_sample_stack) {
+			seq_printf(m, "%12lu %3lu.%lu%%\n", all[i].lkse_count,
+							pm / 10, pm % 10);
+			for(k = 0; k < all[i].lkse_nr; ++k) {
+				seq_printf(m, "\t%pS\n",
+					(void *)all[i].lkse_ip[k]);
+			}
+		} else {
+			seq_printf(m, "%12lu %3lu.%lu%% %ps\n",
+					all[i].lkse_count, pm / 10, pm % 10,
+					(void *)all[i].lkse_ip[0]);
+		}
+	}
+	vfree(all);
+
+end_show:
+	mutex_unlock(&lktrace_sample_mutex);
+	return 0;
+}
+
+static int lktrace_sample_fops_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lktrace_sample_fops_show, NULL);
+}
+
+/*
+ * "start [hz=<n>] [top=<n>] [stack]" (re)starts sampling from an empty
+ * profile, "stop" freezes it, "top=<n>" only changes the table length
+ */
+static ssize_t lktrace_sample_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	char buff[64], *cur, *opt;
+	size_t len = min(size, sizeof(buff) - 1);
+	unsigned int hz = lktrace_sample_hz, top = lktrace_sample_top;
+	int start = 0, stop = 0, stack = 0, ret = 0;
+	unsigned long val;
+
+	if(copy_from_user(buff, ubuff, len)) {
+		return -EFAULT;
+	}
+	buff[len] = '\0';
+
+	cur = buff;
+	while((opt = strsep(&cur, " \t\n")) != NULL) {
+		if(*opt == '\0') {
+			continue;
+		}
+		if(strcmp(opt, "start") == 0) {
+			start = 1;
+		} else if(strcmp(opt, "stop") == 0) {
+			stop = 1;
+		} else if(strcmp(opt, "stack") == 0) {
+			stack = 1;
+		} else if(strncmp(opt, "hz=", 3) == 0 &&
+			  !kstrtoul(opt + 3, 10, &val) &&
+			  val && val <= LKTRACE_SAMPLE_MAXHZ) {
+			hz = val;
+		} else if(strncmp(opt, "top=", 4) == 0 &&
+			  !kstrtoul(opt + 4, 10, &val) && val) {
+			top = val;
+		} else {
+			return -EINVAL;
+		}
+	}
+	if(start && stop) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&lktrace_sample_mutex);
+	lktrace_sample_top = top;
+	if(stop) {
+		lktrace_sample_stop();
+	} else if(start) {
+		lktrace_sample_hz    = hz;
+		lktrace_sample_stack = stack;
+		ret = lktrace_sample_start();
+	}
+	mutex_unlock(&lktrace_sample_mutex);
+	return ret ? ret : size;
+}
+
+static struct file_operations lktrace_sample_fops = {
+	.open		=	lktrace_sample_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_sample_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_profile_file(struct super_block *sb,
+				struct dentry *root)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"profile",
+						&lktrace_sample_fops,
+						S_IFREG | 0600);
+	return file ? 0 : -1;
+}
@@ -0,0 +1,350 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/hash.h>
+#include <linux/cgroup.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "lktrace.h"
+
+#ifdef CONFIG_CGROUPS
+# define LKTRACE_HAVE_CGROUP_SCOPE
+#endif
+
+/* open addressing pid set, kept at most half full */
+#define LKTRACE_SCOPE_PIDBITS	(6)
+#define LKTRACE_SCOPE_PIDSLOTS	(1 << LKTRACE_SCOPE_PIDBITS)
+#define LKTRACE_SCOPE_MAXPIDS	(LKTRACE_SCOPE_PIDSLOTS / 2)
+
+enum lktrace_scope_flags {
+	LKTRACE_SCOPE_CPU	= 1 << 0,
+	LKTRACE_SCOPE_PID	= 1 << 1,
+	LKTRACE_SCOPE_CGROUP	= 1 << 2,
+};
+
+/*
+ * which hits a probe, or a whole instance, cares about
+ * @lks_flags	: enabled checks
+ * @lks_cpus	: allowed cpus
+ * @lks_pids	: allowed pids or tgids, 0 is a free slot
+ * @lks_npids	: used slots in lks_pids
+ * @lks_cgrp	: allowed cgroup subtree
+ * @lks_cgpath	: cgroup path as written by user
+ */
+struct lktrace_scope {
+	unsigned int	lks_flags;
+	struct cpumask	lks_cpus;
+	pid_t		lks_pids[LKTRACE_SCOPE_PIDSLOTS];
+	unsigned int	lks_npids;
+	struct cgroup	*lks_cgrp;
+	char		*lks_cgpath;
+};
+
+/* serializes instance scope swaps */
+static DEFINE_MUTEX(lktrace_scope_mutex);
+
+static bool lktrace_scope_has_pid(struct lktrace_scope const *s, pid_t pid)
+{
+	unsigned int i = hash_32(pid, LKTRACE_SCOPE_PIDBITS);
+
+	while(s->lks_pids[i]) {
+		if(s->lks_pids[i] == pid) {
+			return true;
+		}
+		i = (i + 1) & (LKTRACE_SCOPE_PIDSLOTS - 1);
+	}
+	return false;
+}
+
+static int lktrace_scope_add_pid(struct lktrace_scope *s, pid_t pid)
+{
+	unsigned int i = hash_32(pid, LKTRACE_SCOPE_PIDBITS);
+
+	if(pid <= 0) {
+		return -EINVAL;
+	}
+	if(lktrace_scope_has_pid(s, pid)) {
+		return 0;
+	}
+	if(s->lks_npids == LKTRACE_SCOPE_MAXPIDS) {
+		printk(KERN_ERR "too many pids in scope (max %d)\n",
+						LKTRACE_SCOPE_MAXPIDS);
+		return -ENOSPC;
+	}
+	while(s->lks_pids[i]) {
+		i = (i + 1) & (LKTRACE_SCOPE_PIDSLOTS - 1);
+	}
+	s->lks_pids[i] = pid;
+	s->lks_npids++;
+	return 0;
+}
+
+/* probe context, runs before any other lktrace action */
+bool lktrace_scope_match(struct lktrace_scope const *s)
+{
+	if(s == NULL) {
+		return true;
+	}
+	if((s->lks_flags & LKTRACE_SCOPE_CPU) &&
+	   !cpumask_test_cpu(smp_processor_id(), &s->lks_cpus)) {
+		return false;
+	}
+	if((s->lks_flags & LKTRACE_SCOPE_PID) &&
+	   !lktrace_scope_has_pid(s, current->tgid) &&
+	   !lktrace_scope_has_pid(s, current->pid)) {
+		return false;
+	}
+#ifdef LKTRACE_HAVE_CGROUP_SCOPE
+	if(s->lks_flags & LKTRACE_SCOPE_CGROUP) {
+		bool in;
+
+		/* task_css_set wants rcu_read_lock, not just no preemption */
+		rcu_read_lock();
+		in = task_under_cgroup_hierarchy(current, s->lks_cgrp);
+		rcu_read_unlock();
+		if(!in) {
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+
+int lktrace_scope_is_option(char const *opt)
+{
+	return strncmp(opt, "pid=", 4) == 0 ||
+		strncmp(opt, "cpu=", 4) == 0 ||
+		strncmp(opt, "cgroup=", 7) == 0;
+}
+
+static int lktrace_scope_set_cgroup(struct lktrace_scope *s, char const *path)
+{
+#ifdef LKTRACE_HAVE_CGROUP_SCOPE
+	struct cgroup *cgrp = cgroup_get_from_path(path);
+	char *cgpath;
+
+	if(IS_ERR(cgrp)) {
+		printk(KERN_ERR "can't find cgroup %s\n", path);
+		return PTR_ERR(cgrp);
+	}
+	cgpath = kstrdup(path, GFP_KERNEL);
+	if(cgpath == NULL) {
+		cgroup_put(cgrp);
+		return -ENOMEM;
+	}
+	/* last cgroup= wins */
+	if(s->lks_cgrp) {
+		cgroup_put(s->lks_cgrp);
+	}
+	kfree(s->lks_cgpath);
+	s->lks_cgpath = cgpath;
+	s->lks_cgrp   = cgrp;
+	s->lks_flags |= LKTRACE_SCOPE_CGROUP;
+	return 0;
+#else
+	printk(KERN_ERR "cgroup scope not supported by this kernel\n");
+	return -ENOSYS;
+#endif
+}
+
+/*
+ * scope options:
+ *   pid=<pid>[,<pid>...]	: current pid or tgid in set
+ *   cpu=<cpulist>		: current cpu in list, e.g 0-3,8
+ *   cgroup=<path>		: current in cgroup subtree (default hierarchy)
+ * *scope is allocated on first option
+ */
+int lktrace_scope_parse(struct lktrace_scope **scope, char *opt)
+{
+	struct lktrace_scope *s = *scope;
+	unsigned long pid;
+	char *tok;
+	int ret;
+
+	if(s == NULL) {
+		s = kzalloc(sizeof(*s), GFP_KERNEL);
+		if(s == NULL) {
+			return -ENOMEM;
+		}
+		*scope = s;
+	}
+
+	if(strncmp(opt, "pid=", 4) == 0) {
+		opt += 4;
+		while((tok = strsep(&opt, ",")) != NULL) {
+			if(kstrtoul(tok, 10, &pid)) {
+				return -EINVAL;
+			}
+			ret = lktrace_scope_add_pid(s, pid);
+			if(ret) {
+				return ret;
+			}
+		}
+		s->lks_flags |= LKTRACE_SCOPE_PID;
+		return 0;
+	}
+
+	if(strncmp(opt, "cpu=", 4) == 0) {
+		ret = cpulist_parse(opt + 4, &s->lks_cpus);
+		if(ret) {
+			return ret;
+		}
+		s->lks_flags |= LKTRACE_SCOPE_CPU;
+		return 0;
+	}
+
+	if(strncmp(opt, "cgroup=", 7) == 0) {
+		return lktrace_scope_set_cgroup(s, opt + 7);
+	}
+
+	return -EINVAL;
+}
+
+void lktrace_scope_destroy(struct lktrace_scope *s)
+{
+	if(s == NULL) {
+		return;
+	}
+#ifdef LKTRACE_HAVE_CGROUP_SCOPE
+	if(s->lks_cgrp) {
+		cgroup_put(s->lks_cgrp);
+	}
+#endif
+	kfree(s->lks_cgpath);
+	kfree(s);
+}
+
+int lktrace_scope_print(struct lktrace_scope const *s, char *buff, size_t len)
+{
+	int i, ret = 0;
+	char sep = '=';
+
+	if(s == NULL) {
+		return 0;
+	}
+	if(s->lks_flags & LKTRACE_SCOPE_PID) {
+		ret += scnprintf(buff + ret, len - ret, " pid");
+		for(i = 0; i < LKTRACE_SCOPE_PIDSLOTS; ++i) {
+			if(s->lks_pids[i] == 0) {
+				continue;
+			}
+			ret += scnprintf(buff + ret, len - ret, "%c%d", sep,
+							s->lks_pids[i]);
+			sep = ',';
+		}
+	}
+	if(s->lks_flags & LKTRACE_SCOPE_CPU) {
+		ret += scnprintf(buff + ret, len - ret, " cpu=%*pbl",
+					cpumask_pr_args(&s->lks_cpus));
+	}
+	if(s->lks_flags & LKTRACE_SCOPE_CGROUP) {
+		ret += scnprintf(buff + ret, len - ret, " cgroup=%s",
+							s->lks_cgpath);
+	}
+	return ret;
+}
+
+/*------------------ lktracefs scope file -------------------------*/
+
+static int lktrace_scope_fops_show(struct seq_file *m, void *v)
+{
+	struct lktrace_instance *inst = m->private;
+	char buff[512];
+	struct lktrace_scope *s;
+
+	mutex_lock(&lktrace_scope_mutex);
+	s = rcu_dereference_protected(inst->lki_scope,
+				lockdep_is_held(&lktrace_scope_mutex));
+	lktrace_scope_print(s, buff, sizeof(buff));
+	mutex_unlock(&lktrace_scope_mutex);
+
+	/* skip leading blank */
+	seq_printf(m, "%s\n", s ? buff + 1 : "all");
+	return 0;
+}
+
+static int lktrace_scope_fops_open(struct inode *inode, struct file *file)
+{
+	return lktracefs_single_open(file, lktrace_scope_fops_show);
+}
+
+/* whole instance scope is replaced, an empty line removes it */
+static ssize_t lktrace_scope_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct lktrace_instance *inst;
+	struct lktrace_scope *s = NULL, *old;
+	char *buff, *cur, *opt;
+	int ret = 0;
+
+	inst = ((struct seq_file *)file->private_data)->private;
+	buff = kzalloc(size + 1, GFP_KERNEL);
+	if(buff == NULL) {
+		return -ENOMEM;
+	}
+	if(copy_from_user(buff, ubuff, size)) {
+		kfree(buff);
+		return -EFAULT;
+	}
+
+	cur = buff;
+	while((opt = strsep(&cur, " \t\n")) != NULL) {
+		if(*opt == '\0') {
+			continue;
+		}
+		ret = lktrace_scope_is_option(opt) ?
+			lktrace_scope_parse(&s, opt) : -EINVAL;
+		if(ret) {
+			break;
+		}
+	}
+	kfree(buff);
+	if(ret) {
+		lktrace_scope_destroy(s);
+		return ret;
+	}
+
+	mutex_lock(&lktrace_scope_mutex);
+	old = rcu_dereference_protected(inst->lki_scope,
+				lockdep_is_held(&lktrace_scope_mutex));
+	rcu_assign_pointer(inst->lki_scope, s);
+	mutex_unlock(&lktrace_scope_mutex);
+
+	/* probes read the scope with preemption disabled */
+	synchronize_rcu();
+	lktrace_scope_destroy(old);
+	return size;
+}
+
+static struct file_operations lktrace_scope_fops = {
+	.open		=	lktrace_scope_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_scope_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	lktracefs_single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_scope_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"scope",
+						&lktrace_scope_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+#include <linux/mutex.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+
+#include "lktrace.h"
+
+/*
+ * interned names. Sites and probes of many instances name the same
+ * functions and handlers over and over, each distinct name is stored
+ * once, with no length limit, and refcounted.
+ */
+
+#define LKTRACE_STRTAB_BITS	(12)
+
+/*
+ * @lkstr_node	: link in lktrace_strtab
+ * @lkstr_hash	: jhash of lkstr_name
+ * @lkstr_refs	: holders of lkstr_name
+ * @lkstr_name	: NUL terminated name
+ */
+struct lktrace_str {
+	struct hlist_node	lkstr_node;
+	u32			lkstr_hash;
+	unsigned int		lkstr_refs;
+	char			lkstr_name[];
+};
+
+static DEFINE_HASHTABLE(lktrace_strtab, LKTRACE_STRTAB_BITS);
+static DEFINE_MUTEX(lktrace_strtab_mutex);
+static unsigned int lktrace_strtab_count;
+static size_t lktrace_strtab_bytes;
+
+/* return interned copy of name, NULL on allocation failure */
+char const *lktrace_str_get(char const *name)
+{
+	size_t len = strlen(name);
+	u32 hash = jhash(name, len, 0);
+	struct lktrace_str *str;
+
+	mutex_lock(&lktrace_strtab_mutex);
+	hash_for_each_possible(lktrace_strtab, str, lkstr_node, hash) {
+		if(str->lkstr_hash == hash &&
+		   strcmp(str->lkstr_name, name) == 0) {
+			str->lkstr_refs++;
+			goto end_get;
+		}
+	}
+
+	str = kmalloc(struct_size(str, lkstr_name, len + 1), GFP_KERNEL);
+	if(str == NULL) {
+		mutex_unlock(&lktrace_strtab_mutex);
+		return NULL;
+	}
+	str->lkstr_hash = hash;
+	str->lkstr_refs = 1;
+	memcpy(str->lkstr_name, name, len + 1);
+	hash_add(lktrace_strtab, &str->lkstr_node, hash);
+	lktrace_strtab_count++;
+	lktrace_strtab_bytes += ksize(str);
+
+end_get:
+	mutex_unlock(&lktrace_strtab_mutex);
+	return str->lkstr_name;
+}
+
+void lktrace_str_put(char const *name)
+{
+	struct lktrace_str *str;
+
+	if(name == NULL) {
+		return;
+	}
+	str = container_of(name, struct lktrace_str, lkstr_name[0]);
+
+	mutex_lock(&lktrace_strtab_mutex);
+	if(--str->lkstr_refs == 0) {
+		hash_del(&str->lkstr_node);
+		lktrace_strtab_count--;
+		lktrace_strtab_bytes -= ksize(str);
+		kfree(str);
+	}
+	mutex_unlock(&lktrace_strtab_mutex);
+}
+
+/* number of distinct names and memory they take, slab rounding included */
+void lktrace_str_stats(unsigned int *count, size_t *bytes)
+{
+	mutex_lock(&lktrace_strtab_mutex);
+	*count = lktrace_strtab_count;
+	*bytes = lktrace_strtab_bytes;
+	mutex_unlock(&lktrace_strtab_mutex);
+}
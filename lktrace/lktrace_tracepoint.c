@@ -0,0 +1,210 @@
+#include <linux/kernel.h>
+#include <linux/tracepoint.h>
+#include <linux/interrupt.h>
+#include <trace/events/sched.h>
+#include <trace/events/lock.h>
+#include <trace/events/kmem.h>
+#include <trace/events/irq.h>
+
+#include "lktrace.h"
+
+/*
+ * static tracepoints. A "tp:subsystem:event" site registers a probe
+ * on the built-in tracepoint named event, the subsystem part only
+ * documents the spec. A tracepoint calls its probes with its own
+ * prototype, and kCFI checks it, so only the events below are
+ * supported, each with a probe of the exact prototype. The arguments
+ * are laid in a pt_regs where argN fetches find them, so handlers,
+ * filters and records work unchanged. Other registers read as 0, and
+ * 64 bit arguments keep their low word on 32 bit. The ip of a hit is
+ * the address of the tracepoint, __tracepoint_<event> : the probe is
+ * called from __traceiter_<event>, its return address is the same
+ * for every hit and walking further costs a stack unwind per hit.
+ */
+
+#define LKTRACE_TP_PREFIX	"tp:"
+
+int lktrace_tp_is_spec(char const *name)
+{
+	return strncmp(name, LKTRACE_TP_PREFIX,
+			sizeof(LKTRACE_TP_PREFIX) - 1) == 0;
+}
+
+/* "tp:subsystem:event[+0]", "+0x0" comes back from list reads */
+int lktrace_tp_parse(char *spec)
+{
+	char *sub = spec + sizeof(LKTRACE_TP_PREFIX) - 1;
+	char *event = strchr(sub, ':');
+	unsigned long off;
+	char *plus;
+
+	if(event == NULL || event == sub || event[1] == '\0') {
+		printk(KERN_ERR "bad tracepoint spec %s,"
+				" expect tp:subsystem:event\n", spec);
+		return -EINVAL;
+	}
+	plus = strchr(event, '+');
+	if(plus) {
+		if(kstrtoul(plus + 1, 16, &off) || off != 0) {
+			return -EINVAL;
+		}
+		*plus = '\0';
+	}
+	return 0;
+}
+
+static char const *lktrace_tp_event(struct lktrace_site const *site)
+{
+	return strchr(site->lks_fname + sizeof(LKTRACE_TP_PREFIX) - 1, ':')
+		+ 1;
+}
+
+/* tracepoint context : preemption is already disabled */
+static void notrace lktrace_tp_hit(struct lktrace_site *site,
+				unsigned long const *args, unsigned int n)
+{
+	unsigned long ip = (unsigned long)READ_ONCE(site->lks_tp);
+	struct pt_regs regs;
+	unsigned int i;
+
+	memset(&regs, 0, sizeof(regs));
+	for(i = 0; i < n; ++i) {
+		lktrace_fetch_set_arg(&regs, i + 1, args[i]);
+	}
+	instruction_pointer_set(&regs, ip);
+	lktrace_site_hit(site, ip, &regs);
+}
+
+/*
+ * probe of tracepoint event, proto is its parenthesized prototype,
+ * then its arguments as longs. The kernel header checks proto.
+ */
+#define LKTRACE_TP_PROBE(event, proto, ...)				\
+static void notrace lktrace_tp_##event(void *data, PARAMS proto)	\
+{									\
+	unsigned long const args[] = { __VA_ARGS__ };			\
+									\
+	check_trace_callback_type_##event(lktrace_tp_##event);		\
+	lktrace_tp_hit(data, args, ARRAY_SIZE(args));			\
+}
+
+LKTRACE_TP_PROBE(sched_switch,
+		(bool preempt, struct task_struct *prev,
+		 struct task_struct *next, unsigned int prev_state),
+		preempt, (unsigned long)prev, (unsigned long)next, prev_state)
+LKTRACE_TP_PROBE(sched_wakeup, (struct task_struct *p), (unsigned long)p)
+LKTRACE_TP_PROBE(sched_wakeup_new, (struct task_struct *p), (unsigned long)p)
+LKTRACE_TP_PROBE(sched_process_fork,
+		(struct task_struct *parent, struct task_struct *child),
+		(unsigned long)parent, (unsigned long)child)
+LKTRACE_TP_PROBE(sched_process_exit, (struct task_struct *p),
+		(unsigned long)p)
+LKTRACE_TP_PROBE(contention_begin, (void *lock, unsigned int flags),
+		(unsigned long)lock, flags)
+LKTRACE_TP_PROBE(contention_end, (void *lock, int ret),
+		(unsigned long)lock, ret)
+LKTRACE_TP_PROBE(kmalloc,
+		(unsigned long call_site, const void *ptr, size_t bytes_req,
+		 size_t bytes_alloc, gfp_t gfp_flags, int node),
+		call_site, (unsigned long)ptr, bytes_req, bytes_alloc,
+		(__force unsigned long)gfp_flags, node)
+LKTRACE_TP_PROBE(kfree, (unsigned long call_site, const void *ptr),
+		call_site, (unsigned long)ptr)
+LKTRACE_TP_PROBE(irq_handler_entry, (int irq, struct irqaction *action),
+		irq, (unsigned long)action)
+LKTRACE_TP_PROBE(irq_handler_exit,
+		(int irq, struct irqaction *action, int ret),
+		irq, (unsigned long)action, ret)
+
+struct lktrace_tp_probe {
+	char const	*lktp_event;
+	void		*lktp_probe;
+};
+
+#define LKTRACE_TP_ENTRY(event)	{ #event, lktrace_tp_##event }
+
+static struct lktrace_tp_probe const lktrace_tp_probes[] = {
+	LKTRACE_TP_ENTRY(sched_switch),
+	LKTRACE_TP_ENTRY(sched_wakeup),
+	LKTRACE_TP_ENTRY(sched_wakeup_new),
+	LKTRACE_TP_ENTRY(sched_process_fork),
+	LKTRACE_TP_ENTRY(sched_process_exit),
+	LKTRACE_TP_ENTRY(contention_begin),
+	LKTRACE_TP_ENTRY(contention_end),
+	LKTRACE_TP_ENTRY(kmalloc),
+	LKTRACE_TP_ENTRY(kfree),
+	LKTRACE_TP_ENTRY(irq_handler_entry),
+	LKTRACE_TP_ENTRY(irq_handler_exit),
+};
+
+static void *lktrace_tp_find_probe(char const *event)
+{
+	unsigned int i;
+
+	for(i = 0; i < ARRAY_SIZE(lktrace_tp_probes); ++i) {
+		if(strcmp(lktrace_tp_probes[i].lktp_event, event) == 0) {
+			return lktrace_tp_probes[i].lktp_probe;
+		}
+	}
+	return NULL;
+}
+
+struct lktrace_tp_lookup {
+	char const		*lktl_name;
+	struct tracepoint	*lktl_tp;
+};
+
+static void lktrace_tp_match(struct tracepoint *tp, void *priv)
+{
+	struct lktrace_tp_lookup *l = priv;
+
+	if(strcmp(tp->name, l->lktl_name) == 0) {
+		l->lktl_tp = tp;
+	}
+}
+
+/* only built-in tracepoints are looked up, not module ones */
+int lktrace_tp_attach(struct lktrace_site *site)
+{
+	struct lktrace_tp_lookup l = {
+		.lktl_name = lktrace_tp_event(site),
+	};
+	void *probe = lktrace_tp_find_probe(l.lktl_name);
+	int ret;
+
+	if(probe == NULL) {
+		printk(KERN_ERR "tracepoint %s is not supported\n",
+							l.lktl_name);
+		return -EOPNOTSUPP;
+	}
+	for_each_kernel_tracepoint(lktrace_tp_match, &l);
+	if(l.lktl_tp == NULL) {
+		printk(KERN_ERR "no tracepoint %s\n", l.lktl_name);
+		return -ENOENT;
+	}
+	/* first hits may come before register returns */
+	site->lks_tp = l.lktl_tp;
+	ret = tracepoint_probe_register(l.lktl_tp, probe, site);
+	if(ret) {
+		printk(KERN_ERR "can't attach tracepoint %s: cause = %d\n",
+						l.lktl_name, ret);
+		site->lks_tp = NULL;
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * tracepoint probes run under sched RCU, the grace period paid by
+ * lktrace_probe_remove before freeing the site covers them
+ */
+void lktrace_tp_detach(struct lktrace_site *site)
+{
+	if(site->lks_tp == NULL) {
+		return;
+	}
+	tracepoint_probe_unregister(site->lks_tp,
+				lktrace_tp_find_probe(lktrace_tp_event(site)),
+				site);
+	site->lks_tp = NULL;
+}
@@ -0,0 +1,349 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+#include <linux/uaccess.h>
+
+#include "lktrace.h"
+
+/*
+ * trigger chains. Probes are gated by named switches of their
+ * instance : a probe with when=<sw> does nothing while sw is off.
+ * Other probes turn switches on and off from their hits, and may
+ * start or stop recording of the instance. Switches are plain ints,
+ * flipped with a single store from probe context.
+ */
+
+#define LKTRACE_TRIGGER_MAXSW	(4)
+
+enum lktrace_trigger_flags {
+	LKTRACE_TRIGGER_START	= 1 << 0,
+	LKTRACE_TRIGGER_STOP	= 1 << 1,
+};
+
+/*
+ * @lksw_list	: link in instance lki_switches
+ * @lksw_on	: probes gated by this switch run
+ * @lksw_users	: triggers referencing the switch
+ * @lksw_name	: name given in options
+ */
+struct lktrace_switch {
+	struct list_head	lksw_list;
+	int			lksw_on;
+	unsigned int		lksw_users;
+	char			lksw_name[LKTRACE_FUNCNAME_MAXLEN];
+};
+
+/*
+ * @lkt_flags	: lktrace_trigger_flags
+ * @lkt_gate	: switch gating the probe, NULL if always on
+ * @lkt_on	: switches turned on by a hit
+ * @lkt_off	: switches turned off by a hit
+ */
+struct lktrace_trigger {
+	unsigned int		lkt_flags;
+	struct lktrace_switch	*lkt_gate;
+	struct lktrace_switch	*lkt_on[LKTRACE_TRIGGER_MAXSW];
+	struct lktrace_switch	*lkt_off[LKTRACE_TRIGGER_MAXSW];
+	unsigned int		lkt_non;
+	unsigned int		lkt_noff;
+};
+
+/* protects every instance lki_switches and lksw_users */
+static DEFINE_MUTEX(lktrace_switch_mutex);
+
+static struct lktrace_switch *lktrace_switch_get(struct lktrace_instance *inst,
+						char const *name)
+{
+	struct lktrace_switch *sw;
+
+	if(*name == '\0' || strlen(name) >= LKTRACE_FUNCNAME_MAXLEN) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	mutex_lock(&lktrace_switch_mutex);
+	list_for_each_entry(sw, &inst->lki_switches, lksw_list) {
+		if(strcmp(sw->lksw_name, name) == 0) {
+			sw->lksw_users++;
+			goto end_get;
+		}
+	}
+	sw = kzalloc(sizeof(*sw), GFP_KERNEL);
+	if(sw == NULL) {
+		sw = ERR_PTR(-ENOMEM);
+		goto end_get;
+	}
+	strscpy(sw->lksw_name, name, sizeof(sw->lksw_name));
+	sw->lksw_users = 1;
+	list_add_tail(&sw->lksw_list, &inst->lki_switches);
+
+end_get:
+	mutex_unlock(&lktrace_switch_mutex);
+	return sw;
+}
+
+/* no probe may still be running with sw */
+static void lktrace_switch_put(struct lktrace_switch *sw)
+{
+	if(sw == NULL) {
+		return;
+	}
+	mutex_lock(&lktrace_switch_mutex);
+	if(--sw->lksw_users == 0) {
+		list_del(&sw->lksw_list);
+		kfree(sw);
+	}
+	mutex_unlock(&lktrace_switch_mutex);
+}
+
+int lktrace_trigger_is_option(char const *opt)
+{
+	return strncmp(opt, "when=", 5) == 0 ||
+		strncmp(opt, "on=", 3) == 0 ||
+		strncmp(opt, "off=", 4) == 0 ||
+		strcmp(opt, "start") == 0 ||
+		strcmp(opt, "stop") == 0;
+}
+
+static int lktrace_trigger_add_switches(struct lktrace_instance *inst,
+					struct lktrace_switch **sws,
+					unsigned int *n,
+					char *names)
+{
+	struct lktrace_switch *sw;
+	char *name;
+
+	while((name = strsep(&names, ",")) != NULL) {
+		if(*n == LKTRACE_TRIGGER_MAXSW) {
+			printk(KERN_ERR "too many switches (max %d)\n",
+						LKTRACE_TRIGGER_MAXSW);
+			return -ENOSPC;
+		}
+		sw = lktrace_switch_get(inst, name);
+		if(IS_ERR(sw)) {
+			return PTR_ERR(sw);
+		}
+		sws[(*n)++] = sw;
+	}
+	return 0;
+}
+
+/*
+ * trigger options:
+ *   when=<sw>		: probe only runs while sw is on
+ *   on=<sw>[,<sw>...]	: hit turns switches on
+ *   off=<sw>[,<sw>...]	: hit turns switches off
+ *   start, stop		: hit starts or stops instance recording
+ * *trigger is allocated on first option
+ */
+int lktrace_trigger_parse(struct lktrace_instance *inst,
+			struct lktrace_trigger **trigger,
+			char *opt)
+{
+	struct lktrace_trigger *t = *trigger;
+	struct lktrace_switch *sw;
+
+	if(t == NULL) {
+		t = kzalloc(sizeof(*t), GFP_KERNEL);
+		if(t == NULL) {
+			return -ENOMEM;
+		}
+		*trigger = t;
+	}
+
+	if(strncmp(opt, "when=", 5) == 0) {
+		sw = lktrace_switch_get(inst, opt + 5);
+		if(IS_ERR(sw)) {
+			return PTR_ERR(sw);
+		}
+		lktrace_switch_put(t->lkt_gate);
+		t->lkt_gate = sw;
+		return 0;
+	}
+	if(strncmp(opt, "on=", 3) == 0) {
+		return lktrace_trigger_add_switches(inst, t->lkt_on,
+						&t->lkt_non, opt + 3);
+	}
+	if(strncmp(opt, "off=", 4) == 0) {
+		return lktrace_trigger_add_switches(inst, t->lkt_off,
+						&t->lkt_noff, opt + 4);
+	}
+	if(strcmp(opt, "start") == 0) {
+		t->lkt_flags |= LKTRACE_TRIGGER_START;
+		return 0;
+	}
+	if(strcmp(opt, "stop") == 0) {
+		t->lkt_flags |= LKTRACE_TRIGGER_STOP;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+void lktrace_trigger_destroy(struct lktrace_trigger *t)
+{
+	unsigned int i;
+
+	if(t == NULL) {
+		return;
+	}
+	lktrace_switch_put(t->lkt_gate);
+	for(i = 0; i < t->lkt_non; ++i) {
+		lktrace_switch_put(t->lkt_on[i]);
+	}
+	for(i = 0; i < t->lkt_noff; ++i) {
+		lktrace_switch_put(t->lkt_off[i]);
+	}
+	kfree(t);
+}
+
+/* probe context, first check of a hit */
+bool lktrace_trigger_gate(struct lktrace_trigger const *t)
+{
+	return t == NULL || t->lkt_gate == NULL ||
+		READ_ONCE(t->lkt_gate->lksw_on);
+}
+
+/* probe context, after the hit was recorded */
+void lktrace_trigger_fire(struct lktrace_trigger const *t,
+			struct lktrace_instance *inst)
+{
+	unsigned int i;
+
+	for(i = 0; i < t->lkt_noff; ++i) {
+		WRITE_ONCE(t->lkt_off[i]->lksw_on, 0);
+	}
+	for(i = 0; i < t->lkt_non; ++i) {
+		WRITE_ONCE(t->lkt_on[i]->lksw_on, 1);
+	}
+	if(t->lkt_flags & LKTRACE_TRIGGER_STOP) {
+		WRITE_ONCE(inst->lki_enabled, 0);
+	}
+	if(t->lkt_flags & LKTRACE_TRIGGER_START) {
+		WRITE_ONCE(inst->lki_enabled, 1);
+	}
+}
+
+static int lktrace_trigger_print_switches(struct lktrace_switch *const *sws,
+					unsigned int n,
+					char const *opt,
+					char *buff,
+					size_t len)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for(i = 0; i < n; ++i) {
+		ret += scnprintf(buff + ret, len - ret, "%s%s",
+				i ? "," : opt, sws[i]->lksw_name);
+	}
+	return ret;
+}
+
+int lktrace_trigger_print(struct lktrace_trigger const *t,
+			char *buff,
+			size_t len)
+{
+	int ret = 0;
+
+	if(t == NULL) {
+		return 0;
+	}
+	if(t->lkt_gate) {
+		ret += scnprintf(buff + ret, len - ret, " when=%s",
+					t->lkt_gate->lksw_name);
+	}
+	ret += lktrace_trigger_print_switches(t->lkt_on, t->lkt_non,
+					" on=", buff + ret, len - ret);
+	ret += lktrace_trigger_print_switches(t->lkt_off, t->lkt_noff,
+					" off=", buff + ret, len - ret);
+	if(t->lkt_flags & LKTRACE_TRIGGER_START) {
+		ret += scnprintf(buff + ret, len - ret, " start");
+	}
+	if(t->lkt_flags & LKTRACE_TRIGGER_STOP) {
+		ret += scnprintf(buff + ret, len - ret, " stop");
+	}
+	return ret;
+}
+
+/*------------------ lktracefs switches file ----------------------*/
+
+static int lktrace_switch_fops_show(struct seq_file *m, void *v)
+{
+	struct lktrace_instance *inst = m->private;
+	struct lktrace_switch *sw;
+
+	mutex_lock(&lktrace_switch_mutex);
+	list_for_each_entry(sw, &inst->lki_switches, lksw_list) {
+		seq_printf(m, "%s %d\n", sw->lksw_name,
+					READ_ONCE(sw->lksw_on));
+	}
+	mutex_unlock(&lktrace_switch_mutex);
+	return 0;
+}
+
+static int lktrace_switch_fops_open(struct inode *inode, struct file *file)
+{
+	return lktracefs_single_open(file, lktrace_switch_fops_show);
+}
+
+/* "<sw> 0|1" flips a switch by hand, e.g. to reset a window */
+static ssize_t lktrace_switch_fops_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct lktrace_instance *inst;
+	struct lktrace_switch *sw;
+	char buff[LKTRACE_FUNCNAME_MAXLEN + 8];
+	char name[LKTRACE_FUNCNAME_MAXLEN];
+	size_t len = min(size, sizeof(buff) - 1);
+	int on, ret = -ENOENT;
+
+	inst = ((struct seq_file *)file->private_data)->private;
+	if(copy_from_user(buff, ubuff, len)) {
+		return -EFAULT;
+	}
+	buff[len] = '\0';
+	if(sscanf(buff, "%31s %d", name, &on) != 2) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&lktrace_switch_mutex);
+	list_for_each_entry(sw, &inst->lki_switches, lksw_list) {
+		if(strcmp(sw->lksw_name, name) == 0) {
+			WRITE_ONCE(sw->lksw_on, !!on);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&lktrace_switch_mutex);
+	return ret ? ret : size;
+}
+
+static struct file_operations lktrace_switch_fops = {
+	.open		=	lktrace_switch_fops_open,
+	.read		=	seq_read,
+	.write		=	lktrace_switch_fops_write,
+	.llseek		=	seq_lseek,
+	.release	=	lktracefs_single_release,
+	.owner		=	THIS_MODULE,
+};
+
+int lktracefile_create_switches_file(struct super_block *sb,
+				struct dentry *root,
+				struct lktrace_instance *inst)
+{
+	struct dentry *file = lktracefs_create_file(sb,
+						root,
+						"switches",
+						&lktrace_switch_fops,
+						S_IFREG | 0644);
+	if(file == NULL) {
+		return -1;
+	}
+	file->d_inode->i_private = inst;
+	return 0;
+}
@@ -0,0 +1,329 @@
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/fs.h>
+#include <linux/elf.h>
+#include <linux/err.h>
+#include <linux/ctype.h>
+#include <linux/uprobes.h>
+
+#include "lktrace.h"
+
+/*
+ * userspace probes. A "u:/path/to/binary:symbol" site is attached as a
+ * uprobe on the binary inode, at the file offset of symbol found in
+ * its ELF symbol tables. A symbol starting with a digit is a file
+ * offset, in hex like "+off" and every offset lktrace prints. Hits go through the same dispatch, buffers and clock as
+ * kernel probes, records hold the user instruction pointer.
+ */
+
+#define LKTRACE_UPROBE_PREFIX	"u:"
+#define LKTRACE_ELF_MAXSECT	(4096)
+#define LKTRACE_ELF_SYMCHUNK	(256)
+
+int lktrace_uprobe_is_spec(char const *name)
+{
+	return strncmp(name, LKTRACE_UPROBE_PREFIX,
+			sizeof(LKTRACE_UPROBE_PREFIX) - 1) == 0;
+}
+
+/* "u:/path:sym[+off]" : check it and cut off "+off" (hex) into *off */
+int lktrace_uprobe_parse(char *spec, unsigned long *off)
+{
+	char *path = spec + sizeof(LKTRACE_UPROBE_PREFIX) - 1;
+	char *sym = strrchr(path, ':');
+	char *plus;
+
+	if(*path != '/' || sym == NULL || sym[1] == '\0') {
+		printk(KERN_ERR "bad uprobe spec %s,"
+				" expect u:/path/to/binary:symbol[+off]\n",
+				spec);
+		return -EINVAL;
+	}
+	*off = 0;
+	plus = strchr(sym, '+');
+	if(plus) {
+		*plus = '\0';
+		return kstrtoul(plus + 1, 16, off);
+	}
+	return 0;
+}
+
+#ifdef CONFIG_UPROBES
+
+#if ELF_CLASS == ELFCLASS32
+typedef Elf32_Sym lktrace_elf_sym;
+#else
+typedef Elf64_Sym lktrace_elf_sym;
+#endif
+
+/* 6.13 consumers get a per hit cookie for session probes, unused here */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+# define LKTRACE_UPROBE_DATA	, __u64 *data
+#else
+# define LKTRACE_UPROBE_DATA
+#endif
+
+/*
+ * @lkup_consumer	: registered uprobe consumer
+ * @lkup_site		: site dispatched on hits
+ * @lkup_inode		: probed binary, held while registered
+ * @lkup_offset		: probed file offset
+ * @lkup_uprobe		: uprobe handle, 6.12 and later
+ */
+struct lktrace_uprobe {
+	struct uprobe_consumer	lkup_consumer;
+	struct lktrace_site	*lkup_site;
+	struct inode		*lkup_inode;
+	loff_t			lkup_offset;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+	struct uprobe		*lkup_uprobe;
+#endif
+};
+
+static int lktrace_elf_read(struct file *f, loff_t off, void *buf, size_t len)
+{
+	ssize_t ret = kernel_read(f, buf, len, &off);
+
+	if(ret < 0) {
+		return ret;
+	}
+	return ret == len ? 0 : -EIO;
+}
+
+/* look sym up in one symbol table, return its virtual address or 0 */
+static unsigned long lktrace_elf_symtab_lookup(struct file *f,
+					elf_shdr const *symsh,
+					elf_shdr const *strsh,
+					char const *sym)
+{
+	lktrace_elf_sym *syms;
+	char *strtab;
+	size_t nsym = symsh->sh_size / sizeof(*syms), i, n;
+	size_t symlen = strlen(sym) + 1;
+	unsigned long vaddr = 0;
+
+	strtab = vmalloc(strsh->sh_size);
+	syms = kmalloc(LKTRACE_ELF_SYMCHUNK * sizeof(*syms), GFP_KERNEL);
+	if(strtab == NULL || syms == NULL ||
+	   lktrace_elf_read(f, strsh->sh_offset, strtab, strsh->sh_size)) {
+		goto end_lookup;
+	}
+
+	for(i = 0; i < nsym && vaddr == 0; i += n) {
+		size_t j;
+
+		n = min_t(size_t, nsym - i, LKTRACE_ELF_SYMCHUNK);
+		if(lktrace_elf_read(f, symsh->sh_offset + i * sizeof(*syms),
+					syms, n * sizeof(*syms))) {
+			break;
+		}
+		for(j = 0; j < n; ++j) {
+			if(syms[j].st_shndx == SHN_UNDEF ||
+			   ELF_ST_TYPE(syms[j].st_info) != STT_FUNC ||
+			   syms[j].st_name + symlen > strsh->sh_size) {
+				continue;
+			}
+			if(memcmp(strtab + syms[j].st_name, sym, symlen) == 0) {
+				vaddr = syms[j].st_value;
+				break;
+			}
+		}
+	}
+
+end_lookup:
+	kfree(syms);
+	vfree(strtab);
+	return vaddr;
+}
+
+/* virtual address to file offset, through PT_LOAD segments */
+static int lktrace_elf_vaddr_to_offset(struct file *f, elfhdr const *eh,
+				unsigned long vaddr, loff_t *foff)
+{
+	elf_phdr *ph;
+	int i, ret = -ENOENT;
+
+	ph = kcalloc(eh->e_phnum, sizeof(*ph), GFP_KERNEL);
+	if(ph == NULL) {
+		return -ENOMEM;
+	}
+	if(lktrace_elf_read(f, eh->e_phoff, ph, eh->e_phnum * sizeof(*ph))) {
+		ret = -EIO;
+		goto end_offset;
+	}
+	for(i = 0; i < eh->e_phnum; ++i) {
+		if(ph[i].p_type == PT_LOAD && vaddr >= ph[i].p_vaddr &&
+		   vaddr < ph[i].p_vaddr + ph[i].p_filesz) {
+			*foff = vaddr - ph[i].p_vaddr + ph[i].p_offset;
+			ret = 0;
+			break;
+		}
+	}
+
+end_offset:
+	kfree(ph);
+	return ret;
+}
+
+/* file offset of function sym, .symtab first then .dynsym */
+static int lktrace_elf_sym_offset(struct file *f, char const *sym,
+				loff_t *foff)
+{
+	static const int types[] = { SHT_SYMTAB, SHT_DYNSYM };
+	elfhdr eh;
+	elf_shdr *sh;
+	unsigned long vaddr = 0;
+	int i, t, ret;
+
+	ret = lktrace_elf_read(f, 0, &eh, sizeof(eh));
+	if(ret) {
+		return ret;
+	}
+	if(memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+	   eh.e_ident[EI_CLASS] != ELF_CLASS ||
+	   eh.e_shentsize != sizeof(elf_shdr) ||
+	   eh.e_phentsize != sizeof(elf_phdr) ||
+	   eh.e_shnum > LKTRACE_ELF_MAXSECT) {
+		return -ENOEXEC;
+	}
+
+	sh = kcalloc(eh.e_shnum, sizeof(*sh), GFP_KERNEL);
+	if(sh == NULL) {
+		return -ENOMEM;
+	}
+	ret = lktrace_elf_read(f, eh.e_shoff, sh, eh.e_shnum * sizeof(*sh));
+	if(ret) {
+		goto end_sym;
+	}
+
+	for(t = 0; t < ARRAY_SIZE(types) && vaddr == 0; ++t) {
+		for(i = 0; i < eh.e_shnum && vaddr == 0; ++i) {
+			if(sh[i].sh_type != types[t] ||
+			   sh[i].sh_link >= eh.e_shnum) {
+				continue;
+			}
+			vaddr = lktrace_elf_symtab_lookup(f, &sh[i],
+						&sh[sh[i].sh_link], sym);
+		}
+	}
+	ret = vaddr ? lktrace_elf_vaddr_to_offset(f, &eh, vaddr, foff)
+		    : -ENOENT;
+
+end_sym:
+	kfree(sh);
+	return ret;
+}
+
+/* process context, may be preempted unlike other mechanisms */
+static int lktrace_uprobe_handler(struct uprobe_consumer *self,
+				struct pt_regs *regs LKTRACE_UPROBE_DATA)
+{
+	struct lktrace_uprobe *up;
+	up = container_of(self, struct lktrace_uprobe, lkup_consumer);
+
+	preempt_disable();
+	lktrace_site_hit(up->lkup_site, instruction_pointer(regs), regs);
+	preempt_enable();
+	return 0;
+}
+
+int lktrace_uprobe_attach(struct lktrace_site *site)
+{
+	struct lktrace_uprobe *up;
+	struct file *f;
+	char *path, *sym;
+	unsigned long foff_num;
+	loff_t foff;
+	int ret;
+
+	path = kstrdup(site->lks_fname + sizeof(LKTRACE_UPROBE_PREFIX) - 1,
+								GFP_KERNEL);
+	up = kzalloc(sizeof(*up), GFP_KERNEL);
+	if(path == NULL || up == NULL) {
+		ret = -ENOMEM;
+		goto attach_err;
+	}
+	sym = strrchr(path, ':');
+	*sym++ = '\0';
+
+	f = filp_open(path, O_RDONLY, 0);
+	if(IS_ERR(f)) {
+		ret = PTR_ERR(f);
+		goto attach_err;
+	}
+	/* no symbol starts with a digit, "abc" stays a symbol */
+	if(isdigit(*sym)) {
+		ret = kstrtoul(sym, 16, &foff_num);
+		foff = foff_num;
+	} else {
+		ret = lktrace_elf_sym_offset(f, sym, &foff);
+	}
+	if(ret == 0) {
+		up->lkup_inode = igrab(file_inode(f));
+	}
+	filp_close(f, NULL);
+	if(ret) {
+		goto attach_err;
+	}
+
+	up->lkup_site	  = site;
+	up->lkup_offset	  = foff + site->lks_offset;
+	up->lkup_consumer.handler = lktrace_uprobe_handler;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+	up->lkup_uprobe = uprobe_register(up->lkup_inode, up->lkup_offset, 0,
+				&up->lkup_consumer);
+	ret = PTR_ERR_OR_ZERO(up->lkup_uprobe);
+#else
+	ret = uprobe_register(up->lkup_inode, up->lkup_offset,
+				&up->lkup_consumer);
+#endif
+	if(ret) {
+		iput(up->lkup_inode);
+		goto attach_err;
+	}
+	site->lks_uprobe = up;
+	kfree(path);
+	return 0;
+
+attach_err:
+	printk(KERN_ERR "can't attach uprobe on %s: cause = %d\n",
+						site->lks_fname, ret);
+	kfree(up);
+	kfree(path);
+	return ret;
+}
+
+/* unregistering waits for handlers in flight */
+void lktrace_uprobe_detach(struct lktrace_site *site)
+{
+	struct lktrace_uprobe *up = site->lks_uprobe;
+
+	if(up == NULL) {
+		return;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+	uprobe_unregister_nosync(up->lkup_uprobe, &up->lkup_consumer);
+	uprobe_unregister_sync();
+#else
+	uprobe_unregister(up->lkup_inode, up->lkup_offset, &up->lkup_consumer);
+#endif
+	iput(up->lkup_inode);
+	kfree(up);
+	site->lks_uprobe = NULL;
+}
+
+#else
+
+int lktrace_uprobe_attach(struct lktrace_site *site)
+{
+	printk(KERN_ERR "uprobes not supported by this kernel\n");
+	return -ENOSYS;
+}
+
+void lktrace_uprobe_detach(struct lktrace_site *site)
+{
+}
+
+#endif
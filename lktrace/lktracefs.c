@@ -1,7 +1,14 @@
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/fs.h>
+#include <linux/fs_context.h>
 #include <linux/pagemap.h>
 #include <linux/spinlock_types.h>
+#include <linux/namei.h>
+#include <linux/err.h>
+#include <linux/seq_file.h>
+
+#include "lktrace.h"
 
 #define LKTRACE_FSNAME "lktracefs"
 #define LKTRACE_FSMAGIC 0xef1244dd
@@ -10,6 +17,10 @@
 # error "your kernel doesn't support kprobes"
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0)
+# error "lktrace needs linux 6.1 or later"
+#endif
+
 
 extern int lktracefile_create_enable_file(struct super_block *sb,
 			       struct dentry *root, int *associated_data);
@@ -18,28 +29,28 @@ extern int lktrace_create_debugfs(void *);
 
 extern void lktrace_destroy_debugfs(void);
 
-static struct lktrace_state {
-	int lk_enabled;
-} lktrace_state = {
-		.lk_enabled = 0
-	};
-
-static int lktracefs_get_super(struct file_system_type *fs,
-				int flags,
-				const char *devname,
-				void *mountoption,
-				struct vfsmount *vfsmount);
+/* per instance files, same in lktracefs root and instances/<name> */
+static char const *const lktracefs_instance_files[] = {
+	"enable", "list", "hist", "snapshot", "scope",
+	"snapshot_raw", "metadata", "switches", "latency", "preset",
+	"buffer_size_kb",
+};
 
 static struct inode *lktracefs_create_inode(struct super_block *sb, int mode)
 {
 	struct inode *ret = new_inode(sb);
 	if (likely(ret)) {
+		ret->i_ino = get_next_ino();
 		ret->i_mode = mode;
-		ret->i_uid = 0;
-		ret->i_gid = 0;
-		ret->i_atime = CURRENT_TIME;
-		ret->i_mtime = CURRENT_TIME;
-		ret->i_ctime = CURRENT_TIME;
+		ret->i_uid = GLOBAL_ROOT_UID;
+		ret->i_gid = GLOBAL_ROOT_GID;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+		simple_inode_init_ts(ret);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+		ret->i_atime = ret->i_mtime = inode_set_ctime_current(ret);
+#else
+		ret->i_atime = ret->i_mtime = ret->i_ctime = current_time(ret);
+#endif
 	}
 	return ret;
 }
@@ -75,7 +86,52 @@ struct dentry *lktracefs_create_file(struct super_block *sb,
 	return file;
 }
 
-__attribute__ ((unused))
+/*
+ * pin the instance an lktracefs file belongs to, the one of its
+ * directory. NULL once rmdir took it : rmdir clears the directory
+ * i_private under the directory lock.
+ */
+struct lktrace_instance *lktracefs_file_instance(struct file *file)
+{
+	struct inode *dir = d_inode(file->f_path.dentry->d_parent);
+	struct lktrace_instance *inst;
+
+	inode_lock_shared(dir);
+	inst = dir->i_private;
+	if (inst) {
+		lktrace_instance_get(inst);
+	}
+	inode_unlock_shared(dir);
+	return inst;
+}
+
+/* single_open with the pinned instance as seq_file private */
+int lktracefs_single_open(struct file *file,
+			  int (*show)(struct seq_file *, void *))
+{
+	struct lktrace_instance *inst = lktracefs_file_instance(file);
+	int ret;
+
+	if (inst == NULL) {
+		return -ENOENT;
+	}
+	ret = single_open(file, show, inst);
+	if (ret) {
+		lktrace_instance_put(inst);
+	}
+	return ret;
+}
+
+int lktracefs_single_release(struct inode *inode, struct file *file)
+{
+	struct lktrace_instance *inst;
+
+	inst = ((struct seq_file *)file->private_data)->private;
+	single_release(inode, file);
+	lktrace_instance_put(inst);
+	return 0;
+}
+
 static struct dentry *lktracefs_create_dir(struct super_block *sb,
 					   struct dentry *rootdir,
 					   char const *const fname)
@@ -101,20 +157,226 @@ static struct dentry *lktracefs_create_dir(struct super_block *sb,
 	return file;
 }
 
-static void lktracefs_create_files(struct super_block *sb, struct dentry *root)
+static void lktracefs_create_files(struct super_block *sb,
+				  struct dentry *root,
+				  struct lktrace_instance *inst)
 {
-	if (lktracefile_create_enable_file(sb, root, &lktrace_state.lk_enabled)) {
+	if (lktracefile_create_enable_file(sb, root, &inst->lki_enabled)) {
 		printk(KERN_ERR "unable to create enable file\n");
 	}
+	if (lktracefile_create_list_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create list file\n");
+	}
+	if (lktracefile_create_hist_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create hist file\n");
+	}
+	if (lktracefile_create_snapshot_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create snapshot file\n");
+	}
+	if (lktracefile_create_scope_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create scope file\n");
+	}
+	if (lktracefile_create_raw_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create snapshot_raw file\n");
+	}
+	if (lktracefile_create_metadata_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create metadata file\n");
+	}
+	if (lktracefile_create_switches_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create switches file\n");
+	}
+	if (lktracefile_create_latency_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create latency file\n");
+	}
+	if (lktracefile_create_preset_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create preset file\n");
+	}
+	if (lktracefile_create_buffer_size_file(sb, root, inst)) {
+		printk(KERN_ERR "unable to create buffer_size_kb file\n");
+	}
+}
+
+static struct inode *lktracefs_instance_inode(struct super_block *sb,
+					      struct lktrace_instance *inst)
+{
+	struct inode *inode = lktracefs_create_inode(sb, S_IFDIR | 0755);
+	if (likely(inode)) {
+		inode->i_op = &simple_dir_inode_operations;
+		inode->i_fop = &simple_dir_operations;
+		inode->i_private = inst;
+		/* "." */
+		inc_nlink(inode);
+	}
+	return inode;
+}
+
+/* mkdir instances/<name> makes a new empty instance */
+static int lktracefs_instance_new(struct inode *dir, struct dentry *dentry)
+{
+	struct lktrace_instance *inst;
+	struct inode *inode;
+
+	inst = lktrace_instance_create(dentry->d_name.name);
+	if (IS_ERR(inst)) {
+		return PTR_ERR(inst);
+	}
+
+	inode = lktracefs_instance_inode(dir->i_sb, inst);
+	if (unlikely(inode == NULL)) {
+		lktrace_instance_destroy(inst);
+		return -ENOMEM;
+	}
+	d_instantiate(dentry, inode);
+	/* pinned like any other lktracefs entry */
+	dget(dentry);
+	inc_nlink(dir);
+
+	lktracefs_create_files(dir->i_sb, dentry, inst);
+	return 0;
 }
 
-static int lktracefs_fill_super(struct super_block *sb, void *data, int silent)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+static struct dentry *lktracefs_instance_mkdir(struct mnt_idmap *idmap,
+					       struct inode *dir,
+					       struct dentry *dentry,
+					       umode_t mode)
+{
+	/* NULL keeps dentry */
+	return ERR_PTR(lktracefs_instance_new(dir, dentry));
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static int lktracefs_instance_mkdir(struct mnt_idmap *idmap,
+				    struct inode *dir,
+				    struct dentry *dentry,
+				    umode_t mode)
+{
+	return lktracefs_instance_new(dir, dentry);
+}
+#else
+static int lktracefs_instance_mkdir(struct user_namespace *ns,
+				    struct inode *dir,
+				    struct dentry *dentry,
+				    umode_t mode)
+{
+	return lktracefs_instance_new(dir, dentry);
+}
+#endif
+
+static struct dentry *lktracefs_lookup_file(struct dentry *dir,
+					    char const *name)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+	struct qstr qname = QSTR_INIT(name, strlen(name));
+	return lookup_noperm(&qname, dir);
+#else
+	return lookup_one_len(name, dir, strlen(name));
+#endif
+}
+
+/*
+ * rmdir instances/<name> drops its probes, files still open keep the
+ * rest of the instance until closed. Both dir and dentry inodes are
+ * locked, which orders it against lktracefs_file_instance.
+ */
+static int lktracefs_instance_rmdir(struct inode *dir, struct dentry *dentry)
+{
+	struct lktrace_instance *inst = dentry->d_inode->i_private;
+	struct dentry *files[ARRAY_SIZE(lktracefs_instance_files)];
+	int i, ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(files); ++i) {
+		char const *name = lktracefs_instance_files[i];
+		files[i] = lktracefs_lookup_file(dentry, name);
+		if (IS_ERR(files[i])) {
+			ret = PTR_ERR(files[i]);
+			files[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(files); ++i) {
+		if (files[i] == NULL) {
+			continue;
+		}
+		if (ret == 0 && files[i]->d_inode) {
+			simple_unlink(dentry->d_inode, files[i]);
+			d_delete(files[i]);
+		}
+		dput(files[i]);
+	}
+	if (ret) {
+		return ret;
+	}
+
+	dentry->d_inode->i_private = NULL;
+	lktrace_instance_destroy(inst);
+	return simple_rmdir(dir, dentry);
+}
+
+static struct inode_operations lktracefs_instances_iops = {
+	.lookup = simple_lookup,
+	.mkdir = lktracefs_instance_mkdir,
+	.rmdir = lktracefs_instance_rmdir,
+};
+
+struct lktracefs_remount {
+	struct super_block *lkrm_sb;
+	struct dentry *lkrm_dir;
+};
+
+/* instances outlive umount, give them their directory back */
+static int lktracefs_restore_instance(struct lktrace_instance *inst, void *data)
+{
+	struct lktracefs_remount *rm = data;
+	struct dentry *dentry;
+	struct inode *inode;
+
+	if (inst == lktrace_top_instance) {
+		return 0;
+	}
+	dentry = d_alloc_name(rm->lkrm_dir, inst->lki_name);
+	if (!dentry) {
+		return -ENOMEM;
+	}
+	inode = lktracefs_instance_inode(rm->lkrm_sb, inst);
+	if (!inode) {
+		dput(dentry);
+		return -ENOMEM;
+	}
+	d_add(dentry, inode);
+	inc_nlink(rm->lkrm_dir->d_inode);
+	lktracefs_create_files(rm->lkrm_sb, dentry, inst);
+	return 0;
+}
+
+static void lktracefs_create_instances_dir(struct super_block *sb,
+					   struct dentry *root)
+{
+	struct lktracefs_remount rm;
+	struct dentry *dir = lktracefs_create_dir(sb, root, "instances");
+
+	if (dir == NULL) {
+		printk(KERN_ERR "unable to create instances dir\n");
+		return;
+	}
+	dir->d_inode->i_op = &lktracefs_instances_iops;
+	/* "." and ".." */
+	inc_nlink(dir->d_inode);
+	inc_nlink(root->d_inode);
+
+	rm.lkrm_sb = sb;
+	rm.lkrm_dir = dir;
+	if (lktrace_for_each_instance(lktracefs_restore_instance, &rm)) {
+		printk(KERN_ERR "unable to restore instances\n");
+	}
+}
+
+static int lktracefs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
 	struct inode *root_inode;
 	struct dentry *root_dentry;
 
-	sb->s_blocksize = PAGE_CACHE_SIZE;
-	sb->s_blocksize_bits = PAGE_CACHE_SHIFT;
+	sb->s_blocksize = PAGE_SIZE;
+	sb->s_blocksize_bits = PAGE_SHIFT;
 	sb->s_magic = LKTRACE_FSMAGIC;
 	sb->s_op = &lktrace_sb_fops;
 
@@ -124,48 +386,79 @@ static int lktracefs_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	root_inode->i_op = &simple_dir_inode_operations;
 	root_inode->i_fop = &simple_dir_operations;
+	root_inode->i_private = lktrace_top_instance;
 
-	root_dentry = d_alloc_root(root_inode);
+	/* drops root_inode on failure */
+	root_dentry = d_make_root(root_inode);
 	if (unlikely(root_dentry == NULL)) {
-		goto d_alloc_root_error;
+		return -ENOMEM;
 	}
 	sb->s_root = root_dentry;
-	lktracefs_create_files(sb, root_dentry);
+	lktracefs_create_files(sb, root_dentry, lktrace_top_instance);
+	if (lktracefile_create_registry_file(sb, root_dentry)) {
+		printk(KERN_ERR "unable to create registry file\n");
+	}
+	if (lktracefile_create_budget_file(sb, root_dentry)) {
+		printk(KERN_ERR "unable to create budget file\n");
+	}
+	if (lktracefile_create_profile_file(sb, root_dentry)) {
+		printk(KERN_ERR "unable to create profile file\n");
+	}
+	lktracefs_create_instances_dir(sb, root_dentry);
 	return 0;
+}
 
- d_alloc_root_error:
-	iput(root_inode);
-	return -ENOMEM;
+/* one superblock shared by every mount, as mount_single did */
+static int lktracefs_get_tree(struct fs_context *fc)
+{
+	return get_tree_single(fc, lktracefs_fill_super);
 }
 
-static int
-lktracefs_get_super(struct file_system_type *fs,
-		    int flags,
-		    const char *devname,
-		    void *mountoption, struct vfsmount *vfsmount)
+static const struct fs_context_operations lktracefs_context_ops = {
+	.get_tree = lktracefs_get_tree,
+};
+
+static int lktracefs_init_fs_context(struct fs_context *fc)
 {
-	return get_sb_single(fs, flags, mountoption, lktracefs_fill_super,
-			     vfsmount);
+	fc->ops = &lktracefs_context_ops;
+	return 0;
 }
 
 static struct file_system_type lktracefs_type = {
 	.owner = THIS_MODULE,
 	.name = LKTRACE_FSNAME,
-	.get_sb = lktracefs_get_super,
+	.init_fs_context = lktracefs_init_fs_context,
 	.kill_sb = kill_litter_super,
 };
 
 /* register lktracefs filesystem */
 static int __init lktracefs_init(void)
 {
-	int ret = register_filesystem(&lktracefs_type);
+	int ret = lktrace_instance_init();
 	if(ret) {
+		printk(KERN_ERR "unable to create top level instance\n");
 		return ret;
 	}
-	ret = lktrace_create_debugfs(NULL);
+	ret = lktrace_probe_init();
+	if(ret) {
+		goto probe_init_error;
+	}
+	lktrace_budget_init();
+	ret = register_filesystem(&lktracefs_type);
 	if(ret) {
+		goto register_error;
+	}
+	/* debugfs list only mirrors the top level one, not fatal */
+	if(lktrace_create_debugfs(lktrace_top_instance)) {
 		printk(KERN_ERR "unable to create debugfs files\n");
 	}
+	return 0;
+
+ register_error:
+	lktrace_budget_exit();
+	lktrace_probe_exit();
+ probe_init_error:
+	lktrace_instance_exit();
 	return ret;
 }
 
@@ -174,6 +467,10 @@ static void __exit lktracefs_exit(void)
 {
 	unregister_filesystem(&lktracefs_type);
 	lktrace_destroy_debugfs();
+	lktrace_sample_exit();
+	lktrace_budget_exit();
+	lktrace_instance_exit();
+	lktrace_probe_exit();
 }
 
 module_init(lktracefs_init);
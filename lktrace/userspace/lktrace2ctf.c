@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../lktrace_raw.h"
+
+/*
+ * lktrace2ctf <lktracefs instance dir> <output dir>
+ *
+ * turns the frozen snapshot of an lktrace instance into a CTF trace
+ * readable by babeltrace or trace compass. The instance metadata file
+ * already is the trace TSDL, each cpu chunk of snapshot_raw becomes one
+ * packet of stream_<cpu>, records are copied as is. Run it on the
+ * traced machine : headers are written in host byte order.
+ */
+
+#define CTF_MAGIC		(0xc1fc1fc1)
+#define COPY_NREC		(1024)
+/* far above struct lktrace_record, catches corrupted headers */
+#define MAX_RECSIZE		(4096)
+
+struct ctf_packet_head {
+	__u32	magic;
+	__u32	stream_id;
+	__u64	timestamp_begin;
+	__u64	timestamp_end;
+	__u64	content_size;
+	__u64	packet_size;
+	__u64	events_discarded;
+	__u32	cpu_id;
+} __attribute__((packed));
+
+/* probe event ids declared by metadata, anything else maps to 0 */
+static unsigned char *known_ids;
+static unsigned int nknown_ids;
+
+static void perror_exit(char const *error)
+{
+	perror(error);
+	exit(1);
+}
+
+static FILE *open_in(char const *dir, char const *name)
+{
+	char path[4096];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror_exit(path);
+	}
+	return f;
+}
+
+static FILE *open_out(char const *dir, char const *name)
+{
+	char path[4096];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror_exit(path);
+	}
+	return f;
+}
+
+static void add_known_id(unsigned int id)
+{
+	if (id >= nknown_ids) {
+		unsigned int n = id * 2 + 64;
+		known_ids = realloc(known_ids, n);
+		if (known_ids == NULL) {
+			perror_exit("realloc");
+		}
+		memset(known_ids + nknown_ids, 0, n - nknown_ids);
+		nknown_ids = n;
+	}
+	known_ids[id] = 1;
+}
+
+static void copy_metadata(char const *in, char const *out)
+{
+	FILE *src = open_in(in, "metadata");
+	FILE *dst = open_out(out, "metadata");
+	char line[1024];
+	unsigned int id;
+
+	while (fgets(line, sizeof(line), src)) {
+		if (sscanf(line, " id = %u;", &id) == 1) {
+			add_known_id(id);
+		}
+		fputs(line, dst);
+	}
+	fclose(src);
+	if (fclose(dst)) {
+		perror_exit("metadata");
+	}
+}
+
+static void fix_ids(unsigned char *rec, size_t n,
+		    struct lktrace_raw_chunk const *chunk)
+{
+	__u32 id;
+	size_t i;
+
+	for (i = 0; i < n; ++i, rec += chunk->lkrc_recsize) {
+		memcpy(&id, rec + chunk->lkrc_idoff, sizeof(id));
+		if (id >= nknown_ids || !known_ids[id]) {
+			id = 0;
+			memcpy(rec + chunk->lkrc_idoff, &id, sizeof(id));
+		}
+	}
+}
+
+/* header fields used for sizes and offsets, checked before use */
+static void check_chunk(struct lktrace_raw_chunk const *chunk)
+{
+	if (chunk->lkrc_recsize == 0 || chunk->lkrc_recsize > MAX_RECSIZE ||
+	    chunk->lkrc_idoff > chunk->lkrc_recsize - sizeof(__u32)) {
+		fprintf(stderr, "bad record size %u, id at %u, on cpu %u\n",
+			chunk->lkrc_recsize, chunk->lkrc_idoff,
+			chunk->lkrc_cpu);
+		exit(1);
+	}
+	/* content_size is in bits */
+	if (chunk->lkrc_nrec > (~(__u64)0 / 8 - sizeof(struct ctf_packet_head))
+				/ chunk->lkrc_recsize) {
+		fprintf(stderr, "bad record count %llu on cpu %u\n",
+			(unsigned long long)chunk->lkrc_nrec,
+			chunk->lkrc_cpu);
+		exit(1);
+	}
+}
+
+static void copy_chunk(FILE *src, struct lktrace_raw_chunk const *chunk,
+		       char const *out)
+{
+	struct ctf_packet_head head;
+	unsigned char *recs;
+	char name[32];
+	__u64 left = chunk->lkrc_nrec;
+	FILE *dst;
+
+	snprintf(name, sizeof(name), "stream_%u", chunk->lkrc_cpu);
+	dst = open_out(out, name);
+
+	memset(&head, 0, sizeof(head));
+	head.magic = CTF_MAGIC;
+	head.timestamp_begin = chunk->lkrc_ts_begin;
+	head.timestamp_end = chunk->lkrc_ts_end;
+	head.content_size = (sizeof(head) +
+			     chunk->lkrc_nrec * chunk->lkrc_recsize) * 8;
+	head.packet_size = head.content_size;
+	head.events_discarded = chunk->lkrc_lost;
+	head.cpu_id = chunk->lkrc_cpu;
+	fwrite(&head, sizeof(head), 1, dst);
+
+	recs = malloc(COPY_NREC * chunk->lkrc_recsize);
+	if (recs == NULL) {
+		perror_exit("malloc");
+	}
+	while (left) {
+		size_t n = left < COPY_NREC ? left : COPY_NREC;
+		if (fread(recs, chunk->lkrc_recsize, n, src) != n) {
+			fprintf(stderr, "snapshot_raw truncated on cpu %u\n",
+				chunk->lkrc_cpu);
+			exit(1);
+		}
+		fix_ids(recs, n, chunk);
+		fwrite(recs, chunk->lkrc_recsize, n, dst);
+		left -= n;
+	}
+	free(recs);
+	if (fclose(dst)) {
+		perror_exit(name);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct lktrace_raw_chunk chunk;
+	unsigned long long nrec = 0, lost = 0;
+	FILE *raw;
+	int nchunk = 0;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <instance dir> <output dir>\n",
+			argv[0]);
+		exit(1);
+	}
+	if (mkdir(argv[2], 0755) && errno != EEXIST) {
+		perror_exit(argv[2]);
+	}
+
+	copy_metadata(argv[1], argv[2]);
+
+	raw = open_in(argv[1], "snapshot_raw");
+	while (fread(&chunk, sizeof(chunk), 1, raw) == 1) {
+		if (chunk.lkrc_magic != LKTRACE_RAW_MAGIC) {
+			fprintf(stderr, "bad chunk magic 0x%x\n",
+				chunk.lkrc_magic);
+			exit(1);
+		}
+		check_chunk(&chunk);
+		nchunk++;
+		nrec += chunk.lkrc_nrec;
+		lost += chunk.lkrc_lost;
+		if (chunk.lkrc_nrec) {
+			copy_chunk(raw, &chunk, argv[2]);
+		}
+	}
+	fclose(raw);
+
+	if (nchunk == 0) {
+		fprintf(stderr, "no frozen snapshot, write 1 to %s/snapshot"
+			" first\n", argv[1]);
+		exit(1);
+	}
+	printf("%llu records from %d cpus, %llu lost\n", nrec, nchunk, lost);
+	return 0;
+}
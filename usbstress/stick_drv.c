@@ -3,9 +3,14 @@
 #include <linux/usb.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/kref.h>
 #include <linux/slab.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/hid.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 /* define list */
 
@@ -43,6 +48,40 @@
 #define SS_INTPUT_PHYSLEN (64)
 #define SS_INTPUT_NAMELEN (32)
 
+/* interrupt urbs kept queued on the endpoint */
+#define SS_INTURB_MIN	(2)
+#define SS_INTURB_MAX	(8)
+
+/* log2 of latency in us, slot 0 is below 1 us */
+#define SS_HIST_SLOTS	(24)
+
+/* us_flags bits */
+#define SS_CTRL_BUSY	(0)
+#define SS_MOVED	(1)
+#define SS_STOPPING	(2)
+
+static unsigned int inturbs = 4;
+module_param(inturbs, uint, 0444);
+MODULE_PARM_DESC(inturbs, "interrupt urbs in flight per stick, 2 to 8");
+
+/*
+ * control requests are polled by a timer, every ctrl_min_ms while the
+ * stick moves, backing off twice slower at each idle poll up to
+ * ctrl_max_ms
+ */
+static unsigned int ctrl_min_ms = 10;
+module_param(ctrl_min_ms, uint, 0644);
+MODULE_PARM_DESC(ctrl_min_ms, "control poll period of a moving stick, ms");
+
+static unsigned int ctrl_max_ms = 500;
+module_param(ctrl_max_ms, uint, 0644);
+MODULE_PARM_DESC(ctrl_max_ms, "control poll period of an idle stick, ms");
+
+/* reports moving no axis by more than deadband are not synced */
+static unsigned int deadband;
+module_param(deadband, uint, 0644);
+MODULE_PARM_DESC(deadband, "axis change below which reports are dropped");
+
 /* private prototype */
 
 static void __exit stick_stress_exit(void);
@@ -73,18 +112,50 @@ static struct usb_driver stick_stress_driver = {
 };
 
 /*
- * stick_stress driver descriptor
+ * log2 latency histogram
+ * @ssh_slot	: counts, slot i holds [2^(i-1), 2^i[ us
+ * @ssh_count	: samples
+ * @ssh_max	: longest sample, us
+ */
+struct stick_stress_hist {
+	u64	ssh_slot[SS_HIST_SLOTS];
+	u64	ssh_count;
+	u64	ssh_max;
+};
+
+/*
+ * stick_stress device descriptor, one per probed interface, reached
+ * through usb_get_intfdata, urb context and input drvdata
  * @us_ep	: endpoint used by interrupt reception
  * @us_dev	: usb_device representation
  * @us_itf	: hid descriptor whose descriptor report can be parsed
  * @us_input	: input device representation
  * @us_urbctrl	: urb control object
  * @us_reqctrl	: controler request
- * @us_urbint	: urb interrupt object
- * @us_buffint	: interrupt (in) buffer
- * @us_dmaint	: interrupt (in) dma
+ * @us_urbint	: ring of interrupt urbs, each resubmitted on completion
+ * @us_buffint	: interrupt (in) buffers
+ * @us_dmaint	: interrupt (in) dmas
+ * @us_nint	: interrupt urbs used, in [SS_INTURB_MIN, SS_INTURB_MAX]
+ * @us_anchor	: interrupt urbs in flight
  * @us_buffctrl : ctrl (in) buffer
  * @us_dmactrl	: ctrl (in) dma
+ * @us_ctrlcnt	: control requests sent, selects the next request
+ * @us_flags	: SS_CTRL_BUSY while the control urb is in flight,
+ *		  SS_MOVED when a report changed since the last poll,
+ *		  SS_STOPPING from kill to the next open, under us_lock
+ * @us_ctrltimer: control poll scheduler
+ * @us_ctrlms	: current control poll period, ms
+ * @us_lastx	: last reported raw x
+ * @us_lasty	: last reported raw y
+ * @us_repx	: x last synced to input, -1 before the first sync
+ * @us_repy	: y last synced to input
+ * @us_subts	: submission time of each interrupt urb
+ * @us_lastrep	: completion time of the last report, 0 before any
+ * @us_hsubmit	: interrupt urb submit to completion, under us_lock
+ * @us_hsync	: completion to input_sync, under us_lock
+ * @us_hinterval: between two reports, under us_lock
+ * @us_debugfs	: debugfs directory of the device
+ * @us_kref	: held by the device and by each open latency file
  * @us_lock	: spinlock
  * @us_mutex	: mutex
  */
@@ -99,13 +170,32 @@ struct stick_stress {
 	struct urb		*us_urbctrl;
 	struct usb_ctrlrequest	*us_reqctrl;
 
-	struct urb		*us_urbint;
-	char			*us_buffint;
-	dma_addr_t		 us_dmaint;
+	struct urb		*us_urbint[SS_INTURB_MAX];
+	char			*us_buffint[SS_INTURB_MAX];
+	dma_addr_t		 us_dmaint[SS_INTURB_MAX];
+	unsigned int		 us_nint;
+	struct usb_anchor	 us_anchor;
 
 	char			*us_buffctrl;
 	dma_addr_t		 us_dmactrl;
 
+	unsigned int		 us_ctrlcnt;
+	unsigned long		 us_flags;
+	struct hrtimer		 us_ctrltimer;
+	unsigned int		 us_ctrlms;
+	int			 us_lastx;
+	int			 us_lasty;
+	int			 us_repx;
+	int			 us_repy;
+
+	ktime_t			 us_subts[SS_INTURB_MAX];
+	ktime_t			 us_lastrep;
+	struct stick_stress_hist us_hsubmit;
+	struct stick_stress_hist us_hsync;
+	struct stick_stress_hist us_hinterval;
+	struct dentry		*us_debugfs;
+	struct kref		 us_kref;
+
 	spinlock_t us_lock;
 	struct mutex us_mutex;
 
@@ -113,8 +203,11 @@ struct stick_stress {
 	char us_name[SS_INTPUT_NAMELEN];
 };
 
-/* all field 0 initialized */
-static struct stick_stress stickdrv;
+/* debugfs stickdrv directory, one subdirectory per device */
+static struct dentry *stick_stress_debugfs_root;
+
+/* orders latency file opens against device removal */
+static DEFINE_MUTEX(stick_stress_debugfs_mutex);
 
 /* convert status'err code in string */
 static char* usb_completion_status_err(int err)
@@ -141,13 +234,16 @@ static char* usb_submit_urb_err(int err)
 
 static void stick_stress_ctrl_completion(struct urb *urb)
 {
-	struct device *dev = &stickdrv.us_dev->dev;
+	struct stick_stress *ss;
+	struct device *dev;
 	int status;
 	if(unlikely(urb == NULL)) {
-		dev_dbg(dev, "urb completion NULL \n");
 		return;
 	}
-	status = urb->status;
+	ss	= urb->context;
+	dev	= &ss->us_dev->dev;
+	status	= urb->status;
+	clear_bit(SS_CTRL_BUSY, &ss->us_flags);
 
 	if(status) {
 		char *errstr = usb_completion_status_err(status);
@@ -155,132 +251,311 @@ static void stick_stress_ctrl_completion(struct urb *urb)
 	}
 }
 
-static int stick_stress_ask_stick_status(void)
+static void stick_stress_hist_add(struct stick_stress *ss,
+				struct stick_stress_hist *h,
+				ktime_t from,
+				ktime_t to)
+{
+	s64 us = ktime_us_delta(to, from);
+	unsigned long flags;
+	unsigned int slot;
+
+	if(us < 0) {
+		return;
+	}
+	slot = us ? min(ilog2(us) + 1, SS_HIST_SLOTS - 1) : 0;
+	spin_lock_irqsave(&ss->us_lock, flags);
+	h->ssh_slot[slot]++;
+	h->ssh_count++;
+	h->ssh_max = max_t(u64, h->ssh_max, us);
+	spin_unlock_irqrestore(&ss->us_lock, flags);
+}
+
+/* slot of an interrupt urb in the ring, us_nint if not there */
+static unsigned int stick_stress_urb_index(struct stick_stress *ss,
+					struct urb *urb)
+{
+	unsigned int i;
+
+	for(i = 0; i < ss->us_nint && ss->us_urbint[i] != urb; ++i) {
+	}
+	return i;
+}
+
+/*
+ * a completion running during a kill is off the anchor, checking
+ * SS_STOPPING and anchoring under us_lock keeps it from resubmitting
+ * behind usb_kill_anchored_urbs
+ */
+static int stick_stress_submit_int(struct stick_stress *ss, struct urb *urb)
+{
+	unsigned int i = stick_stress_urb_index(ss, urb);
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ss->us_lock, flags);
+	if(test_bit(SS_STOPPING, &ss->us_flags)) {
+		spin_unlock_irqrestore(&ss->us_lock, flags);
+		return -ESHUTDOWN;
+	}
+	if(i < ss->us_nint) {
+		ss->us_subts[i] = ktime_get();
+	}
+	usb_anchor_urb(urb, &ss->us_anchor);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if(ret) {
+		usb_unanchor_urb(urb);
+	}
+	spin_unlock_irqrestore(&ss->us_lock, flags);
+	dev_dbg(&ss->us_dev->dev, "inturb_submit : %s\n ",
+		usb_submit_urb_err(ret));
+	return ret;
+}
+
+/* one control request at a time, skipped while the previous one runs */
+static int stick_stress_ask_stick_status(struct stick_stress *ss)
 {
 	int ret;
 	char *msg_err;
-	static int cpt = 0;
-	spin_lock(&stickdrv.us_lock);
-	if(cpt & 0x1) {
-		stickdrv.us_buffctrl[0] = 0x0f; 
-		stickdrv.us_buffctrl[7] = 0x08; 
+	unsigned long flags;
+	if(test_and_set_bit(SS_CTRL_BUSY, &ss->us_flags)) {
+		return 0;
+	}
+	spin_lock_irqsave(&ss->us_lock, flags);
+	if(ss->us_ctrlcnt & 0x1) {
+		ss->us_buffctrl[0] = 0x0f; 
+		ss->us_buffctrl[7] = 0x08; 
 	} else {
-		stickdrv.us_buffctrl[0] = 0x0;
-		stickdrv.us_buffctrl[7] = 0x09;
+		ss->us_buffctrl[0] = 0x0;
+		ss->us_buffctrl[7] = 0x09;
 	}
-	cpt++;
-	spin_unlock(&stickdrv.us_lock);
-	
-	ret = usb_submit_urb(stickdrv.us_urbint, GFP_ATOMIC);
-	msg_err = usb_submit_urb_err(ret);
-	dev_dbg(&stickdrv.us_dev->dev, "inturb_submit : %s\n ",
-		msg_err);
+	ss->us_ctrlcnt++;
+	spin_unlock_irqrestore(&ss->us_lock, flags);
 
-	ret = usb_submit_urb(stickdrv.us_urbctrl, GFP_ATOMIC);
+	ret = usb_submit_urb(ss->us_urbctrl, GFP_ATOMIC);
+	if(ret) {
+		clear_bit(SS_CTRL_BUSY, &ss->us_flags);
+	}
 	msg_err = usb_submit_urb_err(ret);
-	dev_dbg(&stickdrv.us_dev->dev, "ctrlurb_submit : %s\n ",
+	dev_dbg(&ss->us_dev->dev, "ctrlurb_submit : %s\n ",
 		msg_err);
 	return ret;
 }
 
-static void stick_stress_process_packet(int x, int y)
+/*
+ * report axes then sync, unless no axis moved by more than deadband
+ * since the last sync. ts is the urb completion time.
+ */
+static void stick_stress_process_packet(struct stick_stress *ss, int x, int y,
+					ktime_t ts)
 {
 	if(x < 0) {
 		x = X_AXIS_MIN + abs(x);
 	} else {
 		x = X_AXIS_MAX - x;
 	}
-	input_report_abs(stickdrv.us_input, REL_X, x);
-
 	y = Y_AXIS_MAX - abs(y); 	
-	input_report_abs(stickdrv.us_input, REL_Y, y);
 
-	input_sync(stickdrv.us_input);
+	if(ss->us_repx >= 0 &&
+	   abs(x - ss->us_repx) <= deadband &&
+	   abs(y - ss->us_repy) <= deadband) {
+		return;
+	}
+	ss->us_repx = x;
+	ss->us_repy = y;
+
+	input_report_abs(ss->us_input, ABS_X, x);
+	input_report_abs(ss->us_input, ABS_Y, y);
+#ifdef MSC_TIMESTAMP
+	input_event(ss->us_input, EV_MSC, MSC_TIMESTAMP,
+			(u32)ktime_to_us(ts));
+#endif
+	input_sync(ss->us_input);
+	stick_stress_hist_add(ss, &ss->us_hsync, ts, ktime_get());
 }
 
 static void stick_stress_irq(struct urb *urb)
 {
+	ktime_t ts = ktime_get();
 	int x, y, flag;
 	int status = urb->status;
-	struct device *dev = &stickdrv.us_dev->dev;
+	struct stick_stress *ss = urb->context;
+	struct device *dev = &ss->us_dev->dev;
+	unsigned int i = stick_stress_urb_index(ss, urb);
+
+	if(i < ss->us_nint) {
+		stick_stress_hist_add(ss, &ss->us_hsubmit, ss->us_subts[i], ts);
+	}
 	if(status == 0) {
 		dev_dbg(dev, "urb transmited\n");
 		if(urb->actual_length == 8) {
-			flag = stickdrv.us_buffint[0]; 
+			char *buff = urb->transfer_buffer;
+			flag = buff[0]; 
 			if(flag) {
-				x = stickdrv.us_buffint[1];
-				y = stickdrv.us_buffint[2];
-				stick_stress_process_packet(x, y);
+				if(ktime_to_ns(ss->us_lastrep)) {
+					stick_stress_hist_add(ss,
+							&ss->us_hinterval,
+							ss->us_lastrep, ts);
+				}
+				ss->us_lastrep = ts;
+				x = buff[1];
+				y = buff[2];
+				if(x != ss->us_lastx || y != ss->us_lasty) {
+					ss->us_lastx = x;
+					ss->us_lasty = y;
+					set_bit(SS_MOVED, &ss->us_flags);
+				}
+				stick_stress_process_packet(ss, x, y, ts);
 			}
 		}
 	} else {
 		char *errstr = usb_completion_status_err(status);
 		dev_dbg(dev, "urbint completion err[%s]\n", errstr);
+		/* killed, unlinked or device gone */
+		if(status == -ENOENT || status == -ECONNRESET ||
+		   status == -ESHUTDOWN) {
+			return;
+		}
 	}
-	
-	stick_stress_ask_stick_status();
+
+	/* back at the tail of the ring, the others are still queued */
+	stick_stress_submit_int(ss, urb);
+}
+
+static ktime_t stick_stress_ms_to_ktime(unsigned int ms)
+{
+	return ktime_set(ms / MSEC_PER_SEC, (ms % MSEC_PER_SEC) * NSEC_PER_MSEC);
+}
+
+/* hrtimer callback, polls then adapts the period to stick motion */
+static enum hrtimer_restart stick_stress_ctrl_timer(struct hrtimer *timer)
+{
+	struct stick_stress *ss;
+	unsigned int minms = max(ctrl_min_ms, 1U);
+	unsigned int maxms = max(ctrl_max_ms, minms);
+
+	ss = container_of(timer, struct stick_stress, us_ctrltimer);
+	stick_stress_ask_stick_status(ss);
+
+	if(test_and_clear_bit(SS_MOVED, &ss->us_flags)) {
+		ss->us_ctrlms = minms;
+	} else {
+		ss->us_ctrlms = clamp(ss->us_ctrlms * 2, minms, maxms);
+	}
+	hrtimer_forward_now(timer, stick_stress_ms_to_ktime(ss->us_ctrlms));
+	return HRTIMER_RESTART;
+}
+
+static void stick_stress_kill_urb(struct stick_stress *ss)
+{
+	unsigned long flags;
+
+	/* no completion resubmits past this point */
+	spin_lock_irqsave(&ss->us_lock, flags);
+	set_bit(SS_STOPPING, &ss->us_flags);
+	spin_unlock_irqrestore(&ss->us_lock, flags);
+
+	/* waits for a running poll, which may submit the control urb */
+	hrtimer_cancel(&ss->us_ctrltimer);
+	usb_kill_anchored_urbs(&ss->us_anchor);
+	usb_kill_urb(ss->us_urbctrl);
 }
 
 static int stick_stress_open(struct input_dev *dev)
 {
-	return stick_stress_ask_stick_status();
+	struct stick_stress *ss = input_get_drvdata(dev);
+	unsigned int i;
+	int ret = 0;
+
+	clear_bit(SS_STOPPING, &ss->us_flags);
+	/* first report after open is always synced */
+	ss->us_repx = -1;
+	ss->us_lastrep = ktime_set(0, 0);
+	for(i = 0; i < ss->us_nint; ++i) {
+		ret = stick_stress_submit_int(ss, ss->us_urbint[i]);
+		if(ret) {
+			break;
+		}
+	}
+	if(ret == 0) {
+		ret = stick_stress_ask_stick_status(ss);
+	}
+	if(ret) {
+		stick_stress_kill_urb(ss);
+		return ret;
+	}
+	ss->us_ctrlms = max(ctrl_min_ms, 1U);
+	hrtimer_start(&ss->us_ctrltimer,
+			stick_stress_ms_to_ktime(ss->us_ctrlms),
+			HRTIMER_MODE_REL);
+	return 0;
 }
 
 static void stick_stress_close(struct input_dev *dev)
 {
-	usb_kill_urb(stickdrv.us_urbint);
-	usb_kill_urb(stickdrv.us_urbctrl);
+	stick_stress_kill_urb(input_get_drvdata(dev));
 }
 
-static void __devexit stick_stress_free_urb(void)
+static void stick_stress_free_urb(struct stick_stress *ss)
 {
-	if(stickdrv.us_buffctrl) {
-		usb_free_coherent(stickdrv.us_dev,
+	unsigned int i;
+
+	if(ss->us_buffctrl) {
+		usb_free_coherent(ss->us_dev,
 				BM_LEN,
-				stickdrv.us_buffctrl,
-			  	stickdrv.us_dmactrl);
-		 stickdrv.us_buffctrl = NULL;
+				ss->us_buffctrl,
+			  	ss->us_dmactrl);
+		 ss->us_buffctrl = NULL;
 	}
-	if(stickdrv.us_reqctrl) {
-		kfree(stickdrv.us_reqctrl);
-		stickdrv.us_reqctrl = NULL;
+	if(ss->us_reqctrl) {
+		kfree(ss->us_reqctrl);
+		ss->us_reqctrl = NULL;
 	}
-	if(stickdrv.us_urbctrl) {
-		usb_free_urb(stickdrv.us_urbctrl);
-		stickdrv.us_urbctrl = NULL;
+	if(ss->us_urbctrl) {
+		usb_free_urb(ss->us_urbctrl);
+		ss->us_urbctrl = NULL;
 	}
-	if(stickdrv.us_buffint) {
-		usb_free_coherent(stickdrv.us_dev,
-				BM_LEN,
-				stickdrv.us_buffint,
-				stickdrv.us_dmaint);
-		stickdrv.us_buffint = NULL;
-	}
-	if(stickdrv.us_urbint) {
-		usb_free_urb(stickdrv.us_urbint);
-		stickdrv.us_urbint = NULL;
+	for(i = 0; i < SS_INTURB_MAX; ++i) {
+		if(ss->us_buffint[i]) {
+			usb_free_coherent(ss->us_dev,
+					BM_LEN,
+					ss->us_buffint[i],
+					ss->us_dmaint[i]);
+			ss->us_buffint[i] = NULL;
+		}
+		if(ss->us_urbint[i]) {
+			usb_free_urb(ss->us_urbint[i]);
+			ss->us_urbint[i] = NULL;
+		}
 	}
 }
 
+static void stick_stress_release(struct kref *kref)
+{
+	kfree(container_of(kref, struct stick_stress, us_kref));
+}
+
 static void __devexit stick_stress_disconnect(struct usb_interface *itf)
 {
-	struct usb_device *dev;
+	struct stick_stress *ss = usb_get_intfdata(itf);
 	dev_dbg(&interface_to_usbdev(itf)->dev, "disconnect\n");
 	usb_set_intfdata(itf, NULL);
-	dev = interface_to_usbdev(itf);
-	usb_put_dev(dev);
-
-	if(stickdrv.us_input) {
-		input_unregister_device(stickdrv.us_input);
-	}
-
-	usb_kill_urb(stickdrv.us_urbctrl);
-	usb_kill_urb(stickdrv.us_urbint);
-
-	stick_stress_free_urb();
+	mutex_lock(&stick_stress_debugfs_mutex);
+	debugfs_remove_recursive(ss->us_debugfs);
+	mutex_unlock(&stick_stress_debugfs_mutex);
+
+	/* closes the input device, killing its urbs */
+	input_unregister_device(ss->us_input);
+	stick_stress_kill_urb(ss);
+
+	stick_stress_free_urb(ss);
+	usb_put_dev(ss->us_dev);
+	/* freed once the last latency file is closed */
+	kref_put(&ss->us_kref, stick_stress_release);
 }
 
-static void __devinit stick_stress_find_endpoint(struct usb_interface *itf)
+static void __devinit stick_stress_find_endpoint(struct stick_stress *ss,
+						struct usb_interface *itf)
 {
 	struct usb_host_endpoint *curr = NULL;
 	struct usb_host_interface *interface;
@@ -293,147 +568,147 @@ static void __devinit stick_stress_find_endpoint(struct usb_interface *itf)
 	numep		= desc->bNumEndpoints;
 
 	for(i = 0, curr = interface->endpoint;
-	    i < numep && !stickdrv.us_ep; 
+	    i < numep && !ss->us_ep; 
 	    ++i, ++curr) {
 		int type = usb_endpoint_is_int_in(&curr->desc);
 		if(type) {
-			stickdrv.us_ep = curr;
+			ss->us_ep = curr;
 		}
 	}
 }
 
 /*------------------ init urbs -------------------------------*/
-static int __devinit stick_stress_alloc_urb(void)
+static int __devinit stick_stress_alloc_urb(struct stick_stress *ss)
 {
-	stickdrv.us_urbctrl = usb_alloc_urb(0, GFP_KERNEL);
-	if(stickdrv.us_urbctrl == NULL) {
-		return -ENOMEM;
-	}
+	unsigned int i;
 
-	stickdrv.us_reqctrl = 
-			kzalloc(sizeof(*stickdrv.us_reqctrl), GFP_KERNEL);
-
-	stickdrv.us_urbint = usb_alloc_urb(0, GFP_KERNEL);
-	if(stickdrv.us_urbint == NULL) {
-		goto usb_alloc_urb_int_err;
+	ss->us_urbctrl = usb_alloc_urb(0, GFP_KERNEL);
+	ss->us_reqctrl = kzalloc(sizeof(*ss->us_reqctrl), GFP_KERNEL);
+	if(ss->us_urbctrl == NULL || ss->us_reqctrl == NULL) {
+		goto usb_alloc_err;
 	}
 
-	stickdrv.us_buffctrl = usb_alloc_coherent(	stickdrv.us_dev,
-							BM_LEN,
-							GFP_ATOMIC,
-							&stickdrv.us_dmactrl);
-	if(stickdrv.us_buffctrl == NULL) {
-		goto usb_alloc_dmactrl_err;
+	ss->us_buffctrl = usb_alloc_coherent(	ss->us_dev,
+						BM_LEN,
+						GFP_KERNEL,
+						&ss->us_dmactrl);
+	if(ss->us_buffctrl == NULL) {
+		goto usb_alloc_err;
 	}
-	
-	stickdrv.us_buffint = usb_alloc_coherent(	stickdrv.us_dev,
+
+	for(i = 0; i < ss->us_nint; ++i) {
+		ss->us_urbint[i]  = usb_alloc_urb(0, GFP_KERNEL);
+		ss->us_buffint[i] = usb_alloc_coherent(	ss->us_dev,
 							BM_LEN,
-							GFP_ATOMIC,
-							&stickdrv.us_dmaint);
-	if(stickdrv.us_buffint == NULL) {
-		goto usb_alloc_dmaint_err;
+							GFP_KERNEL,
+							&ss->us_dmaint[i]);
+		if(ss->us_urbint[i] == NULL || ss->us_buffint[i] == NULL) {
+			goto usb_alloc_err;
+		}
 	}
 
 	return 0;
 
-usb_alloc_dmaint_err:
-	usb_free_coherent(stickdrv.us_dev, BM_LEN,  stickdrv.us_buffctrl,
-			stickdrv.us_dmactrl);
-usb_alloc_dmactrl_err:
-	usb_free_urb(stickdrv.us_urbint);
-usb_alloc_urb_int_err:	
-	usb_free_urb(stickdrv.us_urbctrl);
-
+usb_alloc_err:
+	stick_stress_free_urb(ss);
 	return -ENOMEM;
 }
 
-static int __devinit stick_stress_init_ctrlurb(void)
+static int __devinit stick_stress_init_ctrlurb(struct stick_stress *ss)
 {
-	unsigned int ctrlpipe = usb_sndctrlpipe(stickdrv.us_dev, 0);
-	stickdrv.us_reqctrl->bRequestType  = 	(USB_TYPE_CLASS | USB_DIR_OUT |
+	unsigned int ctrlpipe = usb_sndctrlpipe(ss->us_dev, 0);
+	ss->us_reqctrl->bRequestType  = 	(USB_TYPE_CLASS | USB_DIR_OUT |
 						USB_RECIP_INTERFACE);
-	stickdrv.us_reqctrl->bRequest = USB_REQ_SET_CONFIGURATION;
-	stickdrv.us_reqctrl->wValue   = cpu_to_le16(BM_VALUE);
-	stickdrv.us_reqctrl->wIndex   = cpu_to_le16(BM_INDEX);
-	stickdrv.us_reqctrl->wLength  = cpu_to_le16(4*BM_LEN);
+	ss->us_reqctrl->bRequest = USB_REQ_SET_CONFIGURATION;
+	ss->us_reqctrl->wValue   = cpu_to_le16(BM_VALUE);
+	ss->us_reqctrl->wIndex   = cpu_to_le16(BM_INDEX);
+	ss->us_reqctrl->wLength  = cpu_to_le16(4*BM_LEN);
 
-	usb_fill_control_urb(	stickdrv.us_urbctrl,
-				stickdrv.us_dev,
+	usb_fill_control_urb(	ss->us_urbctrl,
+				ss->us_dev,
 				ctrlpipe,
-				(unsigned char*)stickdrv.us_reqctrl,
-				stickdrv.us_buffctrl,
+				(unsigned char*)ss->us_reqctrl,
+				ss->us_buffctrl,
 				BM_LEN,
 				stick_stress_ctrl_completion,
-				&stickdrv);
-	stickdrv.us_urbctrl->transfer_dma    = stickdrv.us_dmactrl;
-	stickdrv.us_urbctrl->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+				ss);
+	ss->us_urbctrl->transfer_dma    = ss->us_dmactrl;
+	ss->us_urbctrl->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 
 	return 0;						
 }
 
-static int __devinit stick_stress_init_inturb(void)
+static int __devinit stick_stress_init_inturb(struct stick_stress *ss)
 {
-	__u8 ep_addr  = stickdrv.us_ep->desc.bEndpointAddress;
-	__u8 ep_itval = stickdrv.us_ep->desc.bInterval;
-	unsigned int intpipe = usb_rcvintpipe(	stickdrv.us_dev,
+	__u8 ep_addr  = ss->us_ep->desc.bEndpointAddress;
+	__u8 ep_itval = ss->us_ep->desc.bInterval;
+	unsigned int intpipe = usb_rcvintpipe(	ss->us_dev,
 						ep_addr);
-
-	usb_fill_int_urb(stickdrv.us_urbint,
-			 stickdrv.us_dev,
-			 intpipe,
-			 stickdrv.us_buffint,
-			 BM_LEN,
-			 stick_stress_irq,
-			 &stickdrv,
-			 ep_itval);
-	stickdrv.us_urbint->transfer_dma    = stickdrv.us_dmaint;
-	stickdrv.us_urbint->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	unsigned int i;
+
+	for(i = 0; i < ss->us_nint; ++i) {
+		usb_fill_int_urb(ss->us_urbint[i],
+				 ss->us_dev,
+				 intpipe,
+				 ss->us_buffint[i],
+				 BM_LEN,
+				 stick_stress_irq,
+				 ss,
+				 ep_itval);
+		ss->us_urbint[i]->transfer_dma    = ss->us_dmaint[i];
+		ss->us_urbint[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
 
 	return 0;
 }
 
-static int __devinit stick_stress_prepare_urb(void)
+static int __devinit stick_stress_prepare_urb(struct stick_stress *ss)
 {
 	int ret;
 
-	ret = stick_stress_alloc_urb();
+	ret = stick_stress_alloc_urb(ss);
 	if(ret) {
 		return ret;
 	}
-	stick_stress_init_ctrlurb();
-	stick_stress_init_inturb();
+	stick_stress_init_ctrlurb(ss);
+	stick_stress_init_inturb(ss);
 	return ret;
 }
 
-static int __devinit stick_stress_init_input_dev(struct usb_interface *itf)
+static int __devinit stick_stress_init_input_dev(struct stick_stress *ss,
+						struct usb_interface *itf)
 {
 	int ret;
-	stickdrv.us_input = input_allocate_device();
-	if(stickdrv.us_input == NULL) {
+	ss->us_input = input_allocate_device();
+	if(ss->us_input == NULL) {
 		return -ENOMEM;
 	}
-	ret = usb_make_path(	stickdrv.us_dev,
-				stickdrv.us_phys,
-				sizeof(stickdrv.us_phys));
+	ret = usb_make_path(	ss->us_dev,
+				ss->us_phys,
+				sizeof(ss->us_phys));
 	if(ret < 0) {
 		goto makepath_err;
 	}
-	strlcat(stickdrv.us_phys, "/input0", sizeof(stickdrv.us_phys));
-	snprintf(stickdrv.us_name, sizeof(stickdrv.us_name), "stick stress");
+	strlcat(ss->us_phys, "/input0", sizeof(ss->us_phys));
+	snprintf(ss->us_name, sizeof(ss->us_name), "stick stress");
 
-	stickdrv.us_input->name = stickdrv.us_name;
-	stickdrv.us_input->phys = stickdrv.us_phys;
-	usb_to_input_id(stickdrv.us_dev, &stickdrv.us_input->id);
-	stickdrv.us_input->dev.parent =  &itf->dev;
+	ss->us_input->name = ss->us_name;
+	ss->us_input->phys = ss->us_phys;
+	usb_to_input_id(ss->us_dev, &ss->us_input->id);
+	ss->us_input->dev.parent =  &itf->dev;
 	
-	stickdrv.us_input->evbit[0] = BIT_MASK(EV_ABS);
-	input_set_abs_params(stickdrv.us_input, ABS_X, 0, X_AXIS_MAX, 0, 0);
-	input_set_abs_params(stickdrv.us_input, ABS_Y, 0, Y_AXIS_MAX, 0, 0);
+	ss->us_input->evbit[0] = BIT_MASK(EV_ABS);
+	input_set_abs_params(ss->us_input, ABS_X, 0, X_AXIS_MAX, 0, 0);
+	input_set_abs_params(ss->us_input, ABS_Y, 0, Y_AXIS_MAX, 0, 0);
+#ifdef MSC_TIMESTAMP
+	input_set_capability(ss->us_input, EV_MSC, MSC_TIMESTAMP);
+#endif
 
-	stickdrv.us_input->open  = stick_stress_open;
-	stickdrv.us_input->close = stick_stress_close;
+	ss->us_input->open  = stick_stress_open;
+	ss->us_input->close = stick_stress_close;
+	input_set_drvdata(ss->us_input, ss);
 
-	ret = input_register_device(stickdrv.us_input);
+	ret = input_register_device(ss->us_input);
 	if(ret) {
 		goto makepath_err;
 	}
@@ -441,66 +716,216 @@ static int __devinit stick_stress_init_input_dev(struct usb_interface *itf)
 	return 0;
 
 makepath_err:
-	input_free_device(stickdrv.us_input);
+	input_free_device(ss->us_input);
 	return -ENOMEM;
 }
 
+/*------------------ debugfs latency file ------------------------*/
+
+/* upper bound in us of the slot holding the pct percentile */
+static u64 stick_stress_hist_pct(struct stick_stress_hist const *h,
+				unsigned int pct)
+{
+	u64 want = div_u64(h->ssh_count * pct + 99, 100), seen = 0;
+	unsigned int i;
+
+	for(i = 0; i < SS_HIST_SLOTS; ++i) {
+		seen += h->ssh_slot[i];
+		if(seen && seen >= want) {
+			return 1ULL << i;
+		}
+	}
+	return 0;
+}
+
+static void stick_stress_hist_show(struct seq_file *m, char const *name,
+				struct stick_stress_hist const *h)
+{
+	unsigned int i;
+
+	seq_printf(m, "%s : count %llu p50 %llu p99 %llu max %llu us\n", name,
+			h->ssh_count, stick_stress_hist_pct(h, 50),
+			stick_stress_hist_pct(h, 99), h->ssh_max);
+	for(i = 0; i < SS_HIST_SLOTS; ++i) {
+		if(h->ssh_slot[i]) {
+			seq_printf(m, "\t%10llu us %10llu\n",
+					i ? 1ULL << (i - 1) : 0ULL,
+					h->ssh_slot[i]);
+		}
+	}
+}
+
+static int stick_stress_latency_show(struct seq_file *m, void *v)
+{
+	struct stick_stress *ss = m->private;
+	struct stick_stress_hist *h;
+	unsigned long flags;
+
+	/* copied, not to print with interrupts off */
+	h = kmalloc(3 * sizeof(*h), GFP_KERNEL);
+	if(h == NULL) {
+		return -ENOMEM;
+	}
+	spin_lock_irqsave(&ss->us_lock, flags);
+	h[0] = ss->us_hsubmit;
+	h[1] = ss->us_hsync;
+	h[2] = ss->us_hinterval;
+	spin_unlock_irqrestore(&ss->us_lock, flags);
+
+	stick_stress_hist_show(m, "submit_to_complete", &h[0]);
+	stick_stress_hist_show(m, "complete_to_sync", &h[1]);
+	stick_stress_hist_show(m, "report_interval", &h[2]);
+	kfree(h);
+	return 0;
+}
+
+/*
+ * debugfs does not wait for open files on removal : an open file pins
+ * the device state, and a file removed before we get the mutex fails
+ */
+static int stick_stress_latency_open(struct inode *inode, struct file *file)
+{
+	struct stick_stress *ss;
+	int ret = -ENODEV;
+
+	mutex_lock(&stick_stress_debugfs_mutex);
+	if(!d_unlinked(file->f_path.dentry)) {
+		ss = inode->i_private;
+		ret = single_open(file, stick_stress_latency_show, ss);
+		if(ret == 0) {
+			kref_get(&ss->us_kref);
+		}
+	}
+	mutex_unlock(&stick_stress_debugfs_mutex);
+	return ret;
+}
+
+static int stick_stress_latency_release(struct inode *inode, struct file *file)
+{
+	struct stick_stress *ss = ((struct seq_file *)file->private_data)->private;
+
+	single_release(inode, file);
+	kref_put(&ss->us_kref, stick_stress_release);
+	return 0;
+}
+
+/* any write resets the histograms */
+static ssize_t stick_stress_latency_write(struct file *file,
+					char const __user *ubuff,
+					size_t size,
+					loff_t *where)
+{
+	struct stick_stress *ss;
+	unsigned long flags;
+
+	ss = ((struct seq_file *)file->private_data)->private;
+	spin_lock_irqsave(&ss->us_lock, flags);
+	memset(&ss->us_hsubmit, 0, sizeof(ss->us_hsubmit));
+	memset(&ss->us_hsync, 0, sizeof(ss->us_hsync));
+	memset(&ss->us_hinterval, 0, sizeof(ss->us_hinterval));
+	spin_unlock_irqrestore(&ss->us_lock, flags);
+	return size;
+}
+
+static const struct file_operations stick_stress_latency_fops = {
+	.open		=	stick_stress_latency_open,
+	.read		=	seq_read,
+	.write		=	stick_stress_latency_write,
+	.llseek		=	seq_lseek,
+	.release	=	stick_stress_latency_release,
+	.owner		=	THIS_MODULE,
+};
+
+/* debugfs is a debug aid, the device works without it */
+static void stick_stress_debugfs_create(struct stick_stress *ss,
+					struct usb_interface *itf)
+{
+	if(stick_stress_debugfs_root == NULL) {
+		return;
+	}
+	ss->us_debugfs = debugfs_create_dir(dev_name(&itf->dev),
+					stick_stress_debugfs_root);
+	if(IS_ERR_OR_NULL(ss->us_debugfs)) {
+		ss->us_debugfs = NULL;
+		return;
+	}
+	debugfs_create_file("latency", 0600, ss->us_debugfs, ss,
+				&stick_stress_latency_fops);
+}
+
 /*-----------------------------------------------------------------*/
 
 static int __devinit stick_stress_probe(struct usb_interface *itf,
 					const struct usb_device_id *id __unused)
 {
 	struct usb_device *device;
+	struct stick_stress *ss;
 	int ret = 0;
 
+	ss = kzalloc(sizeof(*ss), GFP_KERNEL);
+	if(ss == NULL) {
+		return -ENOMEM;
+	}
+	spin_lock_init(&ss->us_lock);
+	mutex_init(&ss->us_mutex);
+	kref_init(&ss->us_kref);
+	init_usb_anchor(&ss->us_anchor);
+	hrtimer_init(&ss->us_ctrltimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ss->us_ctrltimer.function = stick_stress_ctrl_timer;
+	ss->us_nint = clamp_t(unsigned int, inturbs, SS_INTURB_MIN,
+						SS_INTURB_MAX);
+
 	device = interface_to_usbdev(itf);
-	stickdrv.us_dev = usb_get_dev(device);
-	stickdrv.us_itf = itf;
+	ss->us_dev = usb_get_dev(device);
+	ss->us_itf = itf;
 
-	stick_stress_find_endpoint(itf);
-	if(unlikely(stickdrv.us_ep == NULL)) {
+	stick_stress_find_endpoint(ss, itf);
+	if(unlikely(ss->us_ep == NULL)) {
 		dev_dbg(&device->dev, "%s : can't find endpoint\n", __func__);
-		return -EIO;
+		ret = -EIO;
+		goto probe_err;
 	}
-	usb_set_intfdata(itf, &stickdrv);
-	ret = stick_stress_prepare_urb();
+	ret = stick_stress_prepare_urb(ss);
 
 	if(ret) {
 		dev_dbg(&device->dev, "prepare urb error\n");
 		goto probe_err;
 	}
 
-	
-	ret = stick_stress_init_input_dev(itf);
+	usb_set_intfdata(itf, ss);
+	ret = stick_stress_init_input_dev(ss, itf);
 	if(ret) {
 		dev_dbg(&device->dev, "input register error\n");
-		goto probe_err;
+		goto input_err;
 	}
 	
+	stick_stress_debugfs_create(ss, itf);
 	dev_dbg(&device->dev, "%s probe success\n", __func__);
 
 	return 0;
-probe_err:
+input_err:
 	usb_set_intfdata(itf, NULL);
+	stick_stress_free_urb(ss);
+probe_err:
 	usb_put_dev(device);
+	kfree(ss);
 	return ret;
 }
 
 /* __init/__exit functions  */
-static void __init stick_stress_init_data(void)
-{
-	spin_lock_init(&stickdrv.us_lock);
-	mutex_init(&stickdrv.us_mutex);
-}
-
 static int __init stick_stress_init(void)
 {
 	int retval;
-	stick_stress_init_data();
 
+	stick_stress_debugfs_root = debugfs_create_dir(STICK_STICKDRV_NAME,
+							NULL);
+	if(IS_ERR(stick_stress_debugfs_root)) {
+		stick_stress_debugfs_root = NULL;
+	}
 	retval = usb_register(&stick_stress_driver);
 	if(likely(retval != 0)) {
 		err("error usb_register\n");
+		debugfs_remove_recursive(stick_stress_debugfs_root);
 	}
 
 	return retval;
@@ -509,6 +934,7 @@ static int __init stick_stress_init(void)
 static void __exit stick_stress_exit(void)
 {
 	usb_deregister(&stick_stress_driver);
+	debugfs_remove_recursive(stick_stress_debugfs_root);
 }
 
 module_init(stick_stress_init);